@@ -0,0 +1,164 @@
+#ifndef _BLOCKRAND_H
+#define _BLOCKRAND_H
+
+/*
+ * Seekable random data: every 4K block of a file is generated from a 64bit
+ * key that is derived from (seed, file key, block index), and every 32bit
+ * word of the block is a murmur3 finalizer of
+ * (low key + word index * golden) ^ high key.
+ * With only 32 key bits, every block would be a window on the same 2^32
+ * word cycle and blocks would repeat after 2^32 keys, so the high bits
+ * select one of 2^32 different sequences.
+ * Any block of any file can be regenerated independently and the lanes of
+ * a block are independent, so the generator vectorizes.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCKRAND_X86 1
+#endif
+
+#define BLOCKRAND_SIZE 4096
+#define BLOCKRAND_WORDS (BLOCKRAND_SIZE / 4)
+#define BLOCKRAND_GOLDEN 0x9e3779b9U
+
+static inline uint64_t blockrand_key(uint64_t seed, uint64_t key, uint64_t block)
+{
+	/* splitmix64 finalizer */
+	uint64_t z = seed ^ (key * 0x9e3779b97f4a7c15ULL) ^
+		     (block * 0xd1b54a32d192ed03ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline uint32_t blockrand_fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline void blockrand_words_scalar(uint32_t *p, int start, int n, uint64_t k)
+{
+	uint32_t c = (uint32_t)k + start * BLOCKRAND_GOLDEN;
+	uint32_t hi = k >> 32;
+	int i;
+
+	for (i = 0; i < n; i++, c += BLOCKRAND_GOLDEN)
+		p[i] = blockrand_fmix32(c ^ hi);
+}
+
+#ifdef BLOCKRAND_X86
+/* SSE2 has no 32bit mullo, so multiply even and odd lanes separately */
+static inline __m128i blockrand_mullo_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+				  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline void blockrand_words_sse2(uint32_t *p, int start, int n, uint64_t k)
+{
+	const __m128i m1 = _mm_set1_epi32(0x85ebca6b);
+	const __m128i m2 = _mm_set1_epi32(0xc2b2ae35);
+	const __m128i step = _mm_set1_epi32(4 * BLOCKRAND_GOLDEN);
+	const __m128i hi = _mm_set1_epi32(k >> 32);
+	uint32_t c = (uint32_t)k + start * BLOCKRAND_GOLDEN;
+	__m128i h, v = _mm_setr_epi32(c, c + BLOCKRAND_GOLDEN,
+				      c + 2 * BLOCKRAND_GOLDEN,
+				      c + 3 * BLOCKRAND_GOLDEN);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		h = _mm_xor_si128(v, hi);
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+		h = blockrand_mullo_sse2(h, m1);
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 13));
+		h = blockrand_mullo_sse2(h, m2);
+		h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+		_mm_storeu_si128((__m128i *)(p + i), h);
+		v = _mm_add_epi32(v, step);
+	}
+	blockrand_words_scalar(p + i, start + i, n - i, k);
+}
+
+__attribute__((target("avx2")))
+static inline void blockrand_words_avx2(uint32_t *p, int start, int n, uint64_t k)
+{
+	const __m256i m1 = _mm256_set1_epi32(0x85ebca6b);
+	const __m256i m2 = _mm256_set1_epi32(0xc2b2ae35);
+	const __m256i step = _mm256_set1_epi32(8 * BLOCKRAND_GOLDEN);
+	const __m256i hi = _mm256_set1_epi32(k >> 32);
+	const __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+						 _mm256_set1_epi32(BLOCKRAND_GOLDEN));
+	__m256i h, v = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)k + start * BLOCKRAND_GOLDEN),
+					lanes);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		h = _mm256_xor_si256(v, hi);
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+		h = _mm256_mullo_epi32(h, m1);
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+		h = _mm256_mullo_epi32(h, m2);
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+		_mm256_storeu_si256((__m256i *)(p + i), h);
+		v = _mm256_add_epi32(v, step);
+	}
+	blockrand_words_scalar(p + i, start + i, n - i, k);
+}
+#endif
+
+typedef void (*blockrand_words_t)(uint32_t *, int, int, uint64_t);
+
+static inline blockrand_words_t blockrand_impl(const char *name)
+{
+#ifdef BLOCKRAND_X86
+	if (!name || !strcmp(name, "avx2")) {
+		if (__builtin_cpu_supports("avx2"))
+			return blockrand_words_avx2;
+	}
+	if (!name || !strcmp(name, "sse2"))
+		return blockrand_words_sse2;
+#endif
+	if (!name || !strcmp(name, "scalar"))
+		return blockrand_words_scalar;
+	return NULL;
+}
+
+/*
+ * Fill len bytes (multiple of 4) of file key at file offset off (multiple
+ * of 4) with the same data, regardless of how the file is split to calls.
+ */
+static inline void blockrand_fill(blockrand_words_t words, void *buf, size_t len,
+				  uint64_t seed, uint64_t key, uint64_t off)
+{
+	uint32_t *p = buf;
+	uint64_t w = off >> 2;
+	size_t n = len >> 2;
+	int i, count;
+
+	while (n) {
+		i = w % BLOCKRAND_WORDS;
+		count = BLOCKRAND_WORDS - i;
+		if (count > n)
+			count = n;
+		words(p, i, count, blockrand_key(seed, key, w / BLOCKRAND_WORDS));
+		p += count;
+		w += count;
+		n -= count;
+	}
+}
+
+#endif
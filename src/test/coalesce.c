@@ -0,0 +1,168 @@
+/*
+ * coalesce - merge events on the same object within a time/count window
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "coalesce.h"
+
+#define COAL_HASH_SIZE 8192	/* 2 * COAL_MAX_PENDING */
+
+struct coal_record {
+	struct coal_record *hnext;		/* hash chain */
+	struct coal_record *prev, *next;	/* FIFO by first event */
+	struct coal_event ev;			/* must be last */
+};
+
+struct coal_stats coal_stats;
+
+static uint64_t window_ns;
+static unsigned int max_count;
+static coal_fn deliver_fn;
+static struct coal_record *hash[COAL_HASH_SIZE];
+static struct coal_record fifo = { .prev = &fifo, .next = &fifo };
+static int npending;
+
+static unsigned int key_hash(const void *key, unsigned int len)
+{
+	const unsigned char *p = key;
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+	return h & (COAL_HASH_SIZE - 1);
+}
+
+static struct coal_record **find(const void *key, unsigned int len)
+{
+	struct coal_record **p = &hash[key_hash(key, len)];
+
+	while (*p && ((*p)->ev.keylen != len || memcmp((*p)->ev.key, key, len)))
+		p = &(*p)->hnext;
+	return p;
+}
+
+int coal_init(int window_ms, int count, coal_fn deliver)
+{
+	window_ns = window_ms * 1000000ULL;
+	max_count = count;
+	deliver_fn = deliver;
+	return 0;
+}
+
+static void deliver(struct coal_record *r, unsigned long long *reason)
+{
+	uint64_t now = lat_now_ns();
+
+	if (r->prev) {
+		r->prev->next = r->next;
+		r->next->prev = r->prev;
+		*find(r->ev.key, r->ev.keylen) = r->hnext;
+		npending--;
+	}
+	lat_hist_add(&coal_stats.latency, now - r->ev.first_ns);
+	coal_stats.records++;
+	(*reason)++;
+	deliver_fn(&r->ev);
+	free(r);
+}
+
+static struct coal_record *new_record(const void *key, unsigned int keylen,
+				      uint64_t mask, int fd, void *data)
+{
+	struct coal_record *r;
+
+	if (keylen > COAL_KEY_MAX)
+		keylen = COAL_KEY_MAX;
+	r = malloc(sizeof(*r) + keylen);
+	if (!r) {
+		perror("alloc event record");
+		return NULL;
+	}
+	r->hnext = r->prev = r->next = NULL;
+	r->ev.mask = mask;
+	r->ev.count = 1;
+	r->ev.fd = fd;
+	r->ev.first_ns = r->ev.last_ns = lat_now_ns();
+	r->ev.data = data;
+	r->ev.keylen = keylen;
+	memcpy(r->ev.key, key, keylen);
+	return r;
+}
+
+void coal_add(const void *key, unsigned int keylen, uint64_t mask, int fd,
+	      void *data, int barrier)
+{
+	struct coal_record **p, *r;
+
+	coal_stats.events++;
+	if (keylen > COAL_KEY_MAX)
+		keylen = COAL_KEY_MAX;
+
+	if (barrier) {
+		coal_stats.barriers++;
+		while (fifo.next != &fifo)
+			deliver(fifo.next, &coal_stats.by_barrier);
+		r = new_record(key, keylen, mask, fd, data);
+		if (r)
+			deliver(r, &coal_stats.by_barrier);
+		return;
+	}
+
+	p = find(key, keylen);
+	r = *p;
+	if (r) {
+		r->ev.mask |= mask;
+		r->ev.count++;
+		r->ev.last_ns = lat_now_ns();
+		if (fd >= 0 && fd != r->ev.fd)
+			close(fd);
+		if (max_count && r->ev.count >= max_count)
+			deliver(r, &coal_stats.by_count);
+		return;
+	}
+
+	if (npending >= COAL_MAX_PENDING)
+		deliver(fifo.next, &coal_stats.by_pending);
+
+	r = new_record(key, keylen, mask, fd, data);
+	if (!r)
+		return;
+	/* find() again, delivery above may have changed the chain */
+	*find(key, keylen) = r;
+	r->prev = fifo.prev;
+	r->next = &fifo;
+	fifo.prev->next = r;
+	fifo.prev = r;
+	npending++;
+	if (max_count == 1)
+		deliver(r, &coal_stats.by_count);
+}
+
+void coal_flush_due(void)
+{
+	uint64_t now = lat_now_ns();
+
+	while (fifo.next != &fifo && now - fifo.next->ev.first_ns >= window_ns)
+		deliver(fifo.next, &coal_stats.by_time);
+}
+
+void coal_flush_all(void)
+{
+	while (fifo.next != &fifo)
+		deliver(fifo.next, &coal_stats.by_time);
+}
+
+void coal_print_stats(void)
+{
+	printf("Coalescing: events=%llu records=%llu (%.1f events/record) barriers=%llu flushed by time=%llu count=%llu barrier=%llu pending=%llu\n",
+		coal_stats.events, coal_stats.records,
+		coal_stats.records ? (double)coal_stats.events / coal_stats.records : 0,
+		coal_stats.barriers, coal_stats.by_time, coal_stats.by_count,
+		coal_stats.by_barrier, coal_stats.by_pending);
+	lat_hist_print("coalesce", &coal_stats.latency);
+}
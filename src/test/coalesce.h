@@ -0,0 +1,62 @@
+#ifndef _COALESCE_H
+#define _COALESCE_H
+
+#include <stdint.h>
+#include "lathist.h"
+
+/*
+ * Coalescing stage between the event read loop and event handling.
+ *
+ * Events on the same object (an opaque key, e.g. dev/ino or FID) are
+ * merged into one pending record with an OR-ed mask and an event count.
+ * A record is delivered when its first event is older than the time
+ * window or when it reaches the count window. Records are delivered in
+ * the order of their first event.
+ *
+ * Events that change the namespace (create/rename/delete) are barriers:
+ * all pending records are delivered before the barrier event, which is
+ * delivered as is, so no event moves across a namespace change.
+ */
+#define COAL_KEY_MAX 280
+#define COAL_MAX_PENDING 4096
+
+struct coal_event {
+	uint64_t mask;
+	unsigned int count;	/* number of merged events */
+	int fd;			/* fd of first event, later fds are closed */
+	uint64_t first_ns, last_ns;
+	void *data;		/* of first event */
+	unsigned int keylen;
+	char key[];
+};
+
+typedef void (*coal_fn)(struct coal_event *ev);
+
+struct coal_stats {
+	unsigned long long events;	/* events added */
+	unsigned long long records;	/* records delivered */
+	unsigned long long barriers;
+	unsigned long long by_time, by_count, by_barrier, by_pending;
+	struct lat_hist latency;	/* first event added to delivery */
+};
+
+extern struct coal_stats coal_stats;
+
+/*
+ * Events are merged for up to window_ms (0 until the next coal_flush_due)
+ * and up to max_count events (0 for no limit). deliver() must close the fd.
+ * A pending record keeps its fd open, so callers that have the object key
+ * without the fd should pass fd -1 to not hold up to COAL_MAX_PENDING fds.
+ */
+int coal_init(int window_ms, int max_count, coal_fn deliver);
+
+void coal_add(const void *key, unsigned int keylen, uint64_t mask, int fd,
+	      void *data, int barrier);
+
+/* Deliver records whose time window expired */
+void coal_flush_due(void);
+void coal_flush_all(void);
+
+void coal_print_stats(void);
+
+#endif
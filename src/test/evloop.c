@@ -0,0 +1,203 @@
+/*
+ * evloop - epoll loop for many fanotify/inotify groups
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "evloop.h"
+
+#define EVLOOP_MAX_EVENTS 256
+
+static int epoll_fd = -1;
+static struct evgroup *groups;
+static int ngroups, stopping;
+static unsigned long long nwaits;
+
+/* FIFO of groups that may have more events to read */
+static struct evgroup *ready_head, **ready_tail = &ready_head;
+static int nready;
+
+int evloop_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	return 0;
+}
+
+struct evgroup *evloop_add(int fd, enum evgroup_type type, evgroup_fn fn,
+			   void *data, const char *name)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+	struct evgroup *g = calloc(1, sizeof(*g));
+
+	if (!g) {
+		perror("alloc group");
+		return NULL;
+	}
+	g->fd = fd;
+	g->type = type;
+	g->fn = fn;
+	g->data = data;
+	snprintf(g->name, sizeof(g->name), "%s", name);
+	if (type != EVGROUP_CONTROL &&
+	    evread_init(&g->events, fd, (enum evread_type)type, 0, 0)) {
+		free(g);
+		return NULL;
+	}
+
+	ev.data.ptr = g;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		evread_free(&g->events);
+		free(g);
+		return NULL;
+	}
+
+	g->next = groups;
+	groups = g;
+	ngroups++;
+	return g;
+}
+
+static void ready_add(struct evgroup *g)
+{
+	if (g->ready)
+		return;
+
+	g->ready = 1;
+	g->next_ready = NULL;
+	*ready_tail = g;
+	ready_tail = &g->next_ready;
+	nready++;
+}
+
+static struct evgroup *ready_pop(void)
+{
+	struct evgroup *g = ready_head;
+
+	ready_head = g->next_ready;
+	if (!ready_head)
+		ready_tail = &ready_head;
+	g->ready = 0;
+	nready--;
+	return g;
+}
+
+/* Handle one batch of group - returns 1 if group may have more events */
+static int handle_group(struct evgroup *g, int *ret)
+{
+	ssize_t len;
+
+	if (g->type == EVGROUP_CONTROL) {
+		*ret = g->fn(g, NULL, 0);
+		return 0;
+	}
+
+	len = evread(&g->events);
+	if (len < 0) {
+		perror(g->name);
+		*ret = -1;
+		return 0;
+	}
+	if (!len)
+		return 0;
+
+	g->nbatches++;
+	g->nevents += g->events.events;
+	*ret = g->fn(g, g->events.buf, len);
+
+	/* Drained group will be reported again by epoll on the next event */
+	if (g->events.drained) {
+		g->events.drained = 0;
+		return 0;
+	}
+	return 1;
+}
+
+int evloop_run(void)
+{
+	struct epoll_event evs[EVLOOP_MAX_EVENTS];
+	struct evgroup *g;
+	int i, n, ret = 0;
+
+	stopping = 0;
+	while (!stopping) {
+		/* Do not block while groups are left to drain */
+		n = epoll_wait(epoll_fd, evs, EVLOOP_MAX_EVENTS, nready ? 0 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+		nwaits++;
+
+		for (i = 0; i < n; i++) {
+			g = evs[i].data.ptr;
+			g->nwakeups++;
+			ready_add(g);
+		}
+
+		/* One batch of every group that is ready at start of pass */
+		for (n = nready; n > 0 && !stopping; n--) {
+			g = ready_pop();
+			if (handle_group(g, &ret))
+				ready_add(g);
+			if (ret < 0)
+				stopping = 1;
+		}
+	}
+
+	return ret < 0 ? -1 : 0;
+}
+
+void evloop_stop(void)
+{
+	stopping = 1;
+}
+
+void evloop_print_stats(int per_group)
+{
+	unsigned long long nbatches = 0, nevents = 0;
+	struct evgroup *g;
+
+	for (g = groups; g; g = g->next) {
+		nbatches += g->nbatches;
+		nevents += g->nevents;
+		if (!per_group || g->type == EVGROUP_CONTROL)
+			continue;
+		printf("group %-24s wakeups=%llu batches=%llu events=%llu (%.1f events/batch)\n",
+			g->name, g->nwakeups, g->nbatches, g->nevents,
+			g->nbatches ? (double)g->nevents / g->nbatches : 0);
+	}
+	printf("Event loop: groups=%d waits=%llu batches=%llu events=%llu (%.1f events/wait)\n",
+		ngroups, nwaits, nbatches, nevents,
+		nwaits ? (double)nevents / nwaits : 0);
+}
+
+void evloop_free(void)
+{
+	struct evgroup *g;
+
+	while ((g = groups)) {
+		groups = g->next;
+		close(g->fd);
+		evread_free(&g->events);
+		free(g);
+	}
+	ngroups = 0;
+	ready_head = NULL;
+	ready_tail = &ready_head;
+	nready = 0;
+	close(epoll_fd);
+	epoll_fd = -1;
+}
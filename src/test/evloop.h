@@ -0,0 +1,56 @@
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include "evread.h"
+
+/*
+ * Single threaded epoll loop that owns many fanotify/inotify groups and
+ * control fds (signalfd, timerfd, stdin).
+ *
+ * All fds are added edge triggered. A ready group stays on the ready list
+ * until it is drained and every pass over the ready list reads one batch
+ * from each group, so a busy group cannot starve the others.
+ */
+enum evgroup_type {
+	EVGROUP_FANOTIFY = EVREAD_FANOTIFY,
+	EVGROUP_INOTIFY = EVREAD_INOTIFY,
+	EVGROUP_CONTROL,
+};
+
+struct evgroup;
+
+/*
+ * Called with a batch of events of a notification group, or with NULL buf
+ * when a control fd is ready, in which case it must read the fd until
+ * EAGAIN. A negative return value stops the loop.
+ */
+typedef int (*evgroup_fn)(struct evgroup *g, char *buf, ssize_t len);
+
+struct evgroup {
+	int fd;
+	enum evgroup_type type;
+	evgroup_fn fn;
+	void *data;
+	char name[64];
+	struct evread events;
+	struct evgroup *next;		/* all groups */
+	struct evgroup *next_ready;	/* ready list */
+	int ready;
+	unsigned long long nwakeups, nbatches, nevents;
+};
+
+int evloop_init(void);
+
+/* The fd must be non blocking and is closed by evloop_free() */
+struct evgroup *evloop_add(int fd, enum evgroup_type type, evgroup_fn fn,
+			   void *data, const char *name);
+
+/* Run until a handler returns a negative value or evloop_stop() */
+int evloop_run(void);
+void evloop_stop(void);
+
+/* Print totals and optionally the counters of every group */
+void evloop_print_stats(int per_group);
+void evloop_free(void);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * evread - batched read of fanotify/inotify events with an adaptive buffer
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "evread.h"
+
+/*
+ * A read that leaves less room than the largest event may have left events.
+ * The largest fanotify event is FAN_RENAME with old and new dir fid+name
+ * records, a target fid record, a pidfd record and 4 byte record padding.
+ */
+#define FAN_FID_INFO_MAX (sizeof(struct fanotify_event_info_fid) + \
+			  sizeof(struct file_handle) + MAX_HANDLE_SZ + 4)
+#define FAN_EVENT_MAX (sizeof(struct fanotify_event_metadata) + \
+		       3 * FAN_FID_INFO_MAX + 2 * (NAME_MAX + 1) + \
+		       sizeof(struct fanotify_event_info_pidfd) + \
+		       sizeof(struct fanotify_event_info_error))
+#define IN_EVENT_MAX (sizeof(struct inotify_event) + NAME_MAX + 1)
+/* Number of reads to look at before shrinking the buffer */
+#define EVREAD_WINDOW 64
+
+static int resize(struct evread *er, size_t size)
+{
+	char *buf;
+
+	if (size < er->min_size)
+		size = er->min_size;
+	if (size > er->max_size)
+		size = er->max_size;
+	if (size == er->size)
+		return 0;
+
+	buf = realloc(er->buf, size);
+	if (!buf)
+		return -1;
+	er->buf = buf;
+	er->size = size;
+	er->nresize++;
+	return 0;
+}
+
+static size_t roundup_pow2(size_t n)
+{
+	size_t size = EVREAD_MIN_SIZE;
+
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+int evread_init(struct evread *er, int fd, enum evread_type type,
+		size_t min_size, size_t max_size)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	memset(er, 0, sizeof(*er));
+	er->fd = fd;
+	er->type = type;
+	er->nonblock = flags >= 0 && (flags & O_NONBLOCK);
+	er->min_size = roundup_pow2(min_size ?: EVREAD_MIN_SIZE);
+	er->max_size = max_size ?: EVREAD_MAX_SIZE;
+	if (er->max_size < er->min_size)
+		er->max_size = er->min_size;
+	er->slack = type == EVREAD_FANOTIFY ? FAN_EVENT_MAX : IN_EVENT_MAX;
+	er->window = EVREAD_WINDOW;
+	if (resize(er, er->min_size)) {
+		perror("alloc event buffer");
+		return -1;
+	}
+	er->nresize = 0;
+	return 0;
+}
+
+static int count_events(struct evread *er, ssize_t len)
+{
+	struct fanotify_event_metadata *metadata;
+	struct inotify_event *event;
+	char *p;
+	int n = 0;
+
+	if (er->type == EVREAD_FANOTIFY) {
+		metadata = (struct fanotify_event_metadata *)er->buf;
+		while (FAN_EVENT_OK(metadata, len)) {
+			n++;
+			metadata = FAN_EVENT_NEXT(metadata, len);
+		}
+	} else {
+		for (p = er->buf; p < er->buf + len; n++) {
+			event = (struct inotify_event *)p;
+			p += sizeof(*event) + event->len;
+		}
+	}
+	return n;
+}
+
+ssize_t evread(struct evread *er)
+{
+	ssize_t len;
+	int queued;
+
+	er->events = 0;
+	if (er->drained) {
+		/*
+		 * Last read drained the queue - end the batch without a read
+		 * that would fail with EAGAIN. Events that were queued since
+		 * will be reported by the next poll.
+		 */
+		er->drained = 0;
+		return 0;
+	}
+	if (er->full) {
+		/* Grow buffer to drain all queued events in one read */
+		if (ioctl(er->fd, FIONREAD, &queued) == 0) {
+			if (!queued && er->nonblock) {
+				er->full = 0;
+				return 0;
+			}
+			if (queued > er->size && resize(er, roundup_pow2(queued)))
+				perror("grow event buffer");
+		}
+	}
+
+	len = read(er->fd, er->buf, er->size);
+	er->nreads++;
+	if (len < 0) {
+		er->full = 0;
+		if (errno == EAGAIN) {
+			er->nempty++;
+			return 0;
+		}
+		return -1;
+	}
+
+	er->full = len + er->slack > er->size;
+	er->drained = er->nonblock && !er->full;
+	er->events = count_events(er, len);
+	er->nevents += er->events;
+	er->nbytes += len;
+	if (len > er->peak)
+		er->peak = len;
+
+	/* Shrink buffer if reads did not need most of it for a while */
+	if (--er->window <= 0) {
+		if (er->peak * 4 <= er->size && !er->full)
+			resize(er, roundup_pow2(er->peak * 2));
+		er->window = EVREAD_WINDOW;
+		er->peak = 0;
+	}
+	return len;
+}
+
+void evread_print_stats(struct evread *er)
+{
+	unsigned long long ndata = er->nreads - er->nempty;
+
+	printf("Event reads: reads=%llu empty=%llu events=%llu (%.1f events/read, %.0f bytes/read) buffer=%zu resizes=%llu\n",
+		er->nreads, er->nempty, er->nevents,
+		ndata ? (double)er->nevents / ndata : 0,
+		ndata ? (double)er->nbytes / ndata : 0,
+		er->size, er->nresize);
+}
+
+void evread_free(struct evread *er)
+{
+	free(er->buf);
+	er->buf = NULL;
+	er->size = 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _EVREAD_H
+#define _EVREAD_H
+
+#include <sys/types.h>
+
+/*
+ * Batched read of fanotify/inotify events with an adaptive buffer.
+ *
+ * When a read fills the buffer, the queue is probably not drained, so the
+ * next read asks FIONREAD for the queued bytes and grows the buffer to
+ * drain them in one read. When a read leaves room for the largest event of
+ * the group type, the queue was drained, so no extra read is needed to
+ * learn that. The buffer shrinks back when reads use only a small part of
+ * it for a while.
+ */
+enum evread_type {
+	EVREAD_FANOTIFY,
+	EVREAD_INOTIFY,
+};
+
+#define EVREAD_MIN_SIZE 4096
+#define EVREAD_MAX_SIZE (1 << 20)
+
+struct evread {
+	int fd;
+	enum evread_type type;
+	int nonblock;
+	int full;		/* last read filled the buffer */
+	int drained;		/* last read drained the queue */
+	char *buf;		/* events of last read */
+	size_t size, min_size, max_size;
+	size_t slack;		/* max size of an event */
+	size_t peak;		/* max bytes per read in this window */
+	int window;		/* reads left in window */
+	int events;		/* events in last read */
+	unsigned long long nreads, nempty, nevents, nbytes, nresize;
+};
+
+/* Zero sizes select the default min/max buffer size */
+int evread_init(struct evread *er, int fd, enum evread_type type,
+		size_t min_size, size_t max_size);
+
+/*
+ * Read a batch of events into er->buf.
+ * Returns bytes read, 0 if no events are queued on a non blocking fd
+ * and -1 on error.
+ */
+ssize_t evread(struct evread *er);
+
+void evread_print_stats(struct evread *er);
+void evread_free(struct evread *er);
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _FANINFO_H
+#define _FANINFO_H
+
+/*
+ * Iterator over the info records that follow fanotify event metadata.
+ *
+ * Records are walked in place by their header length, so the iterator
+ * does not allocate or copy and does not depend on the order or number of
+ * records, which differ by the FAN_REPORT_* flags of the group and by the
+ * event type (e.g. FAN_RENAME has old and new dir records). A record that
+ * is truncated or overruns the event stops the walk with an error.
+ * Records of unknown types are returned with only the header set.
+ *
+ * Includers must define _GNU_SOURCE for struct file_handle.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/fanotify.h>
+
+#ifndef FAN_EVENT_INFO_TYPE_FID
+#define FAN_EVENT_INFO_TYPE_FID		1
+#define FAN_EVENT_INFO_TYPE_DFID_NAME	2
+#define FAN_EVENT_INFO_TYPE_DFID	3
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_PIDFD
+#define FAN_EVENT_INFO_TYPE_PIDFD	4
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_ERROR
+#define FAN_EVENT_INFO_TYPE_ERROR	5
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+#define FAN_EVENT_INFO_TYPE_OLD_DFID_NAME	10
+#define FAN_EVENT_INFO_TYPE_NEW_DFID_NAME	12
+#endif
+
+struct fan_info {
+	int type;			/* FAN_EVENT_INFO_TYPE_* */
+	const struct fanotify_event_info_header *hdr;
+	/* FID, DFID and *DFID_NAME records */
+	const unsigned int *fsid;	/* two ints */
+	const struct file_handle *fh;
+	const char *name;		/* *DFID_NAME records, otherwise NULL */
+	/* PIDFD record */
+	int pidfd;
+	/* ERROR record */
+	int error;
+	unsigned int error_count;
+};
+
+struct fan_info_iter {
+	const char *pos, *end;
+};
+
+static inline void fan_info_init(struct fan_info_iter *it,
+				 const struct fanotify_event_metadata *md)
+{
+	it->pos = (const char *)md + md->metadata_len;
+	it->end = (const char *)md + md->event_len;
+}
+
+static inline int fan_info_has_fid(int type)
+{
+	return type == FAN_EVENT_INFO_TYPE_FID ||
+	       type == FAN_EVENT_INFO_TYPE_DFID ||
+	       type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+	       type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME ||
+	       type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+}
+
+static inline int fan_info_has_name(int type)
+{
+	return type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+	       type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME ||
+	       type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+}
+
+/* Returns 1 with the next record, 0 after the last record, -1 if malformed */
+static inline int fan_info_next(struct fan_info_iter *it, struct fan_info *info)
+{
+	const struct fanotify_event_info_header *hdr;
+	const struct fanotify_event_info_fid *fid;
+	const char *rec_end, *handle_end;
+
+	if (it->pos >= it->end)
+		return 0;
+
+	hdr = (const struct fanotify_event_info_header *)it->pos;
+	if (it->end - it->pos < (ptrdiff_t)sizeof(*hdr) ||
+	    hdr->len < sizeof(*hdr) || hdr->len > it->end - it->pos)
+		goto malformed;
+	rec_end = it->pos + hdr->len;
+
+	info->type = hdr->info_type;
+	info->hdr = hdr;
+	info->fsid = NULL;
+	info->fh = NULL;
+	info->name = NULL;
+	info->pidfd = -1;
+	info->error = 0;
+	info->error_count = 0;
+
+	if (fan_info_has_fid(hdr->info_type)) {
+		fid = (const struct fanotify_event_info_fid *)hdr;
+		if (hdr->len < sizeof(*fid) + sizeof(struct file_handle))
+			goto malformed;
+		info->fsid = (const unsigned int *)&fid->fsid;
+		info->fh = (const struct file_handle *)fid->handle;
+		handle_end = (const char *)info->fh->f_handle + info->fh->handle_bytes;
+		if (handle_end > rec_end)
+			goto malformed;
+		if (fan_info_has_name(hdr->info_type)) {
+			/* Name is null terminated and padded to the record length */
+			if (handle_end == rec_end ||
+			    !memchr(handle_end, 0, rec_end - handle_end))
+				goto malformed;
+			info->name = handle_end;
+		}
+	} else if (hdr->info_type == FAN_EVENT_INFO_TYPE_PIDFD) {
+		if (hdr->len < sizeof(struct fanotify_event_info_pidfd))
+			goto malformed;
+		info->pidfd = ((const struct fanotify_event_info_pidfd *)hdr)->pidfd;
+	} else if (hdr->info_type == FAN_EVENT_INFO_TYPE_ERROR) {
+		if (hdr->len < sizeof(struct fanotify_event_info_error))
+			goto malformed;
+		info->error = ((const struct fanotify_event_info_error *)hdr)->error;
+		info->error_count = ((const struct fanotify_event_info_error *)hdr)->error_count;
+	}
+
+	it->pos = rec_end;
+	return 1;
+
+malformed:
+	it->pos = it->end;
+	return -1;
+}
+
+/* Find the first record of type, returns 1 if found */
+static inline int fan_info_find(const struct fanotify_event_metadata *md,
+				int type, struct fan_info *info)
+{
+	struct fan_info_iter it;
+
+	fan_info_init(&it, md);
+	while (fan_info_next(&it, info) > 0) {
+		if (info->type == type)
+			return 1;
+	}
+	return 0;
+}
+
+#endif
@@ -19,6 +19,9 @@
 #include <sys/fanotify.h>
 #include <sys/inotify.h>
 #include "tlpi_hdr.h"
+#include "evread.h"
+#include "faninfo.h"
+#include "fidres.h"
 
 #ifndef XFS_FILEID_TYPE_64FLAG
 #define XFS_FILEID_TYPE_64FLAG  0x80
@@ -30,7 +33,9 @@
 #define FILEID_INO64_GEN_PARENT (FILEID_INO32_GEN_PARENT|XFS_FILEID_TYPE_64FLAG)
 #endif
 
+#ifndef FAN_RENAME
 #define FAN_RENAME		0x10000000
+#endif
 
 #ifndef FAN_MARK_FILESYSTEM
 #define FAN_MARK_FILESYSTEM     0x00000100
@@ -39,11 +44,17 @@
 #ifndef FAN_REPORT_FID
 #define FAN_REPORT_FID		0x00000200
 #endif
-#ifndef FAN_REPORT_FILENAME
-#define FAN_REPORT_FILENAME     0x00000400
+#ifndef FAN_REPORT_DIR_FID
+#define FAN_REPORT_DIR_FID      0x00000400
+#endif
+#ifndef FAN_REPORT_NAME
+#define FAN_REPORT_NAME         0x00000800
+#endif
+#ifndef FAN_REPORT_TARGET_FID
+#define FAN_REPORT_TARGET_FID   0x00001000
 #endif
-#ifndef FAN_REPORT_COOKIE
-#define FAN_REPORT_COOKIE       0x00000800
+#ifndef FAN_REPORT_PIDFD
+#define FAN_REPORT_PIDFD        0x00000080
 #endif
 
 
@@ -51,6 +62,35 @@
 		IN_MOVE | IN_MOVE_SELF |\
 		IN_CREATE | IN_DELETE)
 
+static void displayFid(struct fan_info *info)
+{
+    const struct file_handle *fh = info->fh;
+    const unsigned *fid = (const unsigned *)fh->f_handle;
+
+    printf("fsid = %8x%8x; ", info->fsid[0], info->fsid[1]);
+    printf("type = 0x%x; ", fh->handle_type);
+    printf("bytes = %d; ", fh->handle_bytes);
+    switch (fh->handle_type) {
+	    case FILEID_INO32_GEN_PARENT:
+		    printf("parent ino = %u; ", fid[2]);
+		    printf("parent gen = %u; ", fid[3]);
+	    case FILEID_INO32_GEN:
+		    printf("ino = %u; ", fid[0]);
+		    printf("gen = %u; ", fid[1]);
+		    break;
+	    case FILEID_INO64_GEN_PARENT:
+		    printf("parent ino = %llu; ", *(unsigned long long *)(fid+3));
+		    printf("parent gen = %u; ", fid[5]);
+	    case FILEID_INO64_GEN:
+		    printf("ino = %llu; ", *(unsigned long long *)fid);
+		    printf("gen = %u; ", fid[2]);
+		    break;
+    }
+    if (info->name)
+	    printf("name = %s", info->name);
+    printf("\n");
+}
+
 /*
  * Display information from fanotify_event_metadata structure:
 struct fanotify_event_metadata {
@@ -69,9 +109,9 @@ static void displayNotifyEvent(struct fanotify_event_metadata *i)
     char path[256];
     char filename[256];
     ssize_t len = 0;
-    int *fsid = (int *)(i + 1);
-    struct file_handle *fh = (struct file_handle *)(fsid + 3);
-    unsigned *fid = (unsigned *)fh->f_handle;
+    struct fan_info_iter it;
+    struct fan_info info;
+    int ret, fd;
 
     printf("    fd = %d; ", i->fd);
     printf("    pid = %d; ", i->pid);
@@ -95,49 +135,60 @@ static void displayNotifyEvent(struct fanotify_event_metadata *i)
     if (i->mask & FAN_RENAME)       printf("FAN_RENAME ");
     printf("\n");
 
-    if (i->fd > 0) {
-	len = snprintf(procfile, 255, "/proc/self/fd/%d", i->fd);
+    /* In FID mode, resolve the path from the file handle */
+    fd = i->fd;
+    if (fd == FAN_NOFD)
+	fd = fidres_open_event(i, O_PATH);
+
+    if (fd > 0) {
+	len = snprintf(procfile, 255, "/proc/self/fd/%d", fd);
 	if (len > 0)
 		len = readlink(procfile, path, 255);
 	if (len > 0)
 		path[len] = 0;
-	close(i->fd);
+	close(fd);
     }
 
     if (len > 0)
         printf("        path = %s\n", path);
 
-    if (i->event_len <= FAN_EVENT_METADATA_LEN)
-	    return;
-
-    printf("    fsid = %8x%8x; ", fsid[1], fsid[2]);
-    printf("    type = 0x%x; ", fh->handle_type);
-    printf("    bytes = %d; ", fh->handle_bytes);
-    switch (fh->handle_type) {
-	    case FILEID_INO32_GEN_PARENT:
-		    printf("    parent ino = %u; ", fid[2]);
-		    printf("    parent gen = %u; ", fid[3]);
-	    case FILEID_INO32_GEN:
-		    printf("    ino = %u; ", fid[0]);
-		    printf("    gen = %u; ", fid[1]);
-		    break;
-	    case FILEID_INO64_GEN_PARENT:
-		    printf("    parent ino = %llu; ", *(unsigned long long *)(fid+3));
-		    printf("    parent gen = %u; ", fid[5]);
-	    case FILEID_INO64_GEN:
-		    printf("    ino = %llu; ", *(unsigned long long *)fid);
-		    printf("    gen = %u; ", fid[2]);
-		    break;
+    /* Info records depend on the group flags and on the event type */
+    fan_info_init(&it, i);
+    while ((ret = fan_info_next(&it, &info)) > 0) {
+	switch (info.type) {
+		case FAN_EVENT_INFO_TYPE_FID:
+			printf("        fid: ");
+			break;
+		case FAN_EVENT_INFO_TYPE_DFID:
+		case FAN_EVENT_INFO_TYPE_DFID_NAME:
+			printf("        dfid: ");
+			break;
+		case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+			printf("        old dfid: ");
+			break;
+		case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+			printf("        new dfid: ");
+			break;
+		case FAN_EVENT_INFO_TYPE_PIDFD:
+			printf("        pidfd = %d\n", info.pidfd);
+			if (info.pidfd >= 0)
+				close(info.pidfd);
+			continue;
+		case FAN_EVENT_INFO_TYPE_ERROR:
+			printf("        error = %d; count = %u\n", info.error,
+			       info.error_count);
+			continue;
+		default:
+			printf("        info type %d; len = %d\n", info.type,
+			       info.hdr->len);
+			continue;
+	}
+	displayFid(&info);
     }
-
-    if (i->event_len > FAN_EVENT_METADATA_LEN + 3*sizeof(int) + sizeof(*fh) + fh->handle_bytes)
-	    printf("        name = %s\n", fh->f_handle + fh->handle_bytes);
-    else
-	    printf("\n");
+    if (ret < 0)
+	    printf("        malformed info record\n");
 }
 
-#define BUF_LEN (10 * (sizeof(struct fanotify_event_metadata) + NAME_MAX + 1))
-
 static int add_watch(int notifyFd, const char *path)
 {
 	int wd;
@@ -147,6 +198,11 @@ static int add_watch(int notifyFd, const char *path)
 	 * file descriptor
 	 */
 	wd = fanotify_mark(notifyFd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+				FAN_ALL_EVENTS|FAN_DENTRY_EVENTS|FAN_RENAME|
+				FAN_EVENT_ON_CHILD|FAN_ONDIR,
+				AT_FDCWD, path);
+	if (wd == -1)
+		wd = fanotify_mark(notifyFd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
 				FAN_ALL_EVENTS|FAN_DENTRY_EVENTS|
 				FAN_EVENT_ON_CHILD|FAN_ONDIR,
 				AT_FDCWD, path);
@@ -173,7 +229,7 @@ int
 main(int argc, char *argv[])
 {
     int notifyFd, wd, j;
-    char buf[BUF_LEN] __attribute__ ((aligned(8)));
+    struct evread events;
     ssize_t numRead, len;
     struct fanotify_event_metadata *event;
     int countdown = 5;
@@ -182,8 +238,12 @@ main(int argc, char *argv[])
     if (argc < 2 || strcmp(argv[1], "--help") == 0)
         usageErr("%s pathname...\n", argv[0]);
 
-    notifyFd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_NOTIF |
-		    FAN_REPORT_FID | FAN_REPORT_FILENAME | FAN_REPORT_COOKIE, 0);
+    notifyFd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_NOTIF | FAN_REPORT_PIDFD |
+		    FAN_REPORT_FID | FAN_REPORT_DIR_FID | FAN_REPORT_NAME |
+		    FAN_REPORT_TARGET_FID, 0);
+    if (notifyFd == -1)
+	notifyFd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_NOTIF |
+			FAN_REPORT_FID | FAN_REPORT_DIR_FID | FAN_REPORT_NAME, 0);
     if (notifyFd == -1) {
 	fprintf(stderr, "fanotify file handle event info not supported\n");
 	notifyFd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_NOTIF, O_RDONLY);
@@ -192,12 +252,20 @@ main(int argc, char *argv[])
 	    errExit("fanotify_init");
     }
 
+    if (fidres_init(0))
+	exit(EXIT_FAILURE);
+
     for (j = 1; j < argc; j++) {
 	wd = add_watch(notifyFd, argv[j]);
 	if (wd == -1)
 		errExit("notify_add_watch");
+	if (fidres_add_mount(argv[j]))
+		exit(EXIT_FAILURE);
     }
 
+    if (evread_init(&events, notifyFd, EVREAD_FANOTIFY, 0, 0))
+        exit(EXIT_FAILURE);
+
     printf("Waiting for events...\n");
     while (--countdown > 0) {
 	printf("%d...\n",countdown);
@@ -205,23 +273,27 @@ main(int argc, char *argv[])
     }
 
     for (;;) {                                  /* Read events forever */
-        numRead = read(notifyFd, buf, BUF_LEN);
+        numRead = evread(&events);
         if (numRead == 0)
             fatal("read() from notify fd returned 0!");
 
         if (numRead == -1)
             errExit("read");
 
-        printf("Read %ld bytes from notify fd\n", (long) numRead);
+        printf("Read %ld bytes (%d events) from notify fd\n", (long) numRead,
+               events.events);
 
         /* Process all of the events in buffer returned by read() */
 
-	event = (struct fanotify_event_metadata *)buf;
+	event = (struct fanotify_event_metadata *)events.buf;
 	len = numRead;
         while (FAN_EVENT_OK(event, len)) {
             displayNotifyEvent(event);
-	    if (maxevents-- <= 0)
+	    if (maxevents-- <= 0) {
+		    evread_print_stats(&events);
+		    fidres_print_stats();
 		    exit(EXIT_SUCCESS);
+	    }
 	    event = FAN_EVENT_NEXT(event, len);
         }
     }
@@ -10,9 +10,22 @@
 #include <stdlib.h>
 #include <sys/fanotify.h>
 #include <unistd.h>
+#include "fdpath.h"
+#include "permq.h"
 
 static int nrequests;
 static int fail_every = 10;
+static int perm_workers;
+
+/* Deny every fail_every access - called concurrently by permission workers */
+static int
+decide(int fd, uint64_t mask, int pid)
+{
+    if (!(mask & FAN_ACCESS_PERM))
+        return FAN_ALLOW;
+
+    return (__sync_add_and_fetch(&nrequests, 1) % fail_every) ? FAN_ALLOW : FAN_DENY;
+}
 
 static void
 handle_events(int fd)
@@ -20,9 +33,7 @@ handle_events(int fd)
     const struct fanotify_event_metadata *metadata;
     struct fanotify_event_metadata buf[200];
     ssize_t len;
-    char path[PATH_MAX];
-    ssize_t path_len;
-    char procfd_path[PATH_MAX];
+    const char *path;
     struct fanotify_response response;
 
     /* Loop while events can be read from fanotify file descriptor. */
@@ -58,7 +69,10 @@ handle_events(int fd)
 
             /* metadata->fd contains either FAN_NOFD, indicating a
                queue overflow, or a file descriptor (a nonnegative
-               integer). Here, we simply ignore queue overflow. */
+               integer). On queue overflow, cached paths may be stale. */
+
+            if (metadata->fd < 0 && (metadata->mask & FAN_Q_OVERFLOW))
+                fdpath_invalidate_all();
 
             if (metadata->fd >= 0) {
 
@@ -69,21 +83,25 @@ handle_events(int fd)
 
                     /* Allow file to be opened. */
 
-                    response.fd = metadata->fd;
-                    response.response = FAN_ALLOW;
-                    write(fd, &response, sizeof(response));
+                    if (!perm_workers) {
+                        response.fd = metadata->fd;
+                        response.response = FAN_ALLOW;
+                        write(fd, &response, sizeof(response));
+                    }
                 }
 
                 /* Handle access/readdir permission event. */
 
                 if (metadata->mask & FAN_ACCESS_PERM) {
                     printf("FAN_ACCESS_PERM: ");
-		    nrequests++;
-                    response.fd = metadata->fd;
-                    response.response = (nrequests % fail_every) ? FAN_ALLOW : FAN_DENY;
-                    write(fd, &response, sizeof(response));
-		    if (response.response == FAN_DENY)
-                        printf("DENIED! ");
+                    if (!perm_workers) {
+                        response.fd = metadata->fd;
+                        response.response = decide(metadata->fd, metadata->mask,
+                                                   metadata->pid);
+                        write(fd, &response, sizeof(response));
+                        if (response.response == FAN_DENY)
+                            printf("DENIED! ");
+                    }
                 }
 
                 /* Handle closing of writable file event. */
@@ -93,21 +111,21 @@ handle_events(int fd)
 
                 /* Retrieve and print pathname of the accessed file. */
 
-                snprintf(procfd_path, sizeof(procfd_path),
-                         "/proc/self/fd/%d", metadata->fd);
-                path_len = readlink(procfd_path, path,
-                                    sizeof(path) - 1);
-                if (path_len == -1) {
-                    perror("readlink");
+                path = fdpath_get(metadata->fd);
+                if (!path)
                     exit(EXIT_FAILURE);
-                }
 
-                path[path_len] = 0;
                 printf("File %s\n", path);
 
-                /* Close the file descriptor of the event. */
+                /* Close the file descriptor of the event, or hand it over
+                   to the permission workers, which close it after the
+                   response. */
 
-                close(metadata->fd);
+                if (perm_workers &&
+                    (metadata->mask & (FAN_OPEN_PERM | FAN_ACCESS_PERM)))
+                    perm_submit(metadata);
+                else
+                    close(metadata->fd);
             }
 
             /* Advance to next event. */
@@ -128,11 +146,15 @@ main(int argc, char *argv[])
     /* Check mount point is supplied. */
 
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s MOUNT [fail every]\n", argv[0]);
+        fprintf(stderr, "Usage: %s MOUNT [fail every] [permission workers]\n", argv[0]);
+        fprintf(stderr, "Event paths are cached per inode and are not rename-safe:\n"
+                        "a file may be printed by its old path after it was renamed.\n");
         exit(EXIT_FAILURE);
     }
     if (argc > 2)
         fail_every = atoi(argv[2]);
+    if (argc > 3)
+        perm_workers = atoi(argv[3]);
 
     printf("Press enter key to terminate.\n");
 
@@ -145,6 +167,9 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (perm_workers && perm_start(fd, perm_workers, decide))
+        exit(EXIT_FAILURE);
+
     /* Mark the mount for:
        - permission events before opening files
        - notification events after closing a write-enabled
@@ -201,7 +226,10 @@ main(int argc, char *argv[])
         }
     }
 
+    if (perm_workers)
+        perm_stop();
     printf("Listening for events stopped.\en");
+    fdpath_print_stats();
     exit(EXIT_SUCCESS);
 }
 
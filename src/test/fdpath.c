@@ -0,0 +1,227 @@
+/*
+ * fdpath - resolve path of fanotify event fd with a bounded LRU cache
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "fdpath.h"
+
+/*
+ * Both hits and misses cost one statx() of the event fd to get the inode
+ * key. Birth time stands in for the inode generation, so a recycled inode
+ * number does not hit the path of a deleted inode. Unlinked inodes are
+ * never cached.
+ *
+ * A hit is not checked against the namespace. Listeners in fd mode get no
+ * rename events, so a renamed path is reported until the entry is evicted
+ * or invalidated. A statx() of the cached path would catch it, but costs
+ * about as much as the readlink() it saves (see pathbench).
+ */
+struct fdpath_entry {
+	struct fdpath_key key;
+	struct fdpath_entry *hnext;		/* hash chain */
+	struct fdpath_entry *prev, *next;	/* LRU list, most recent first */
+	char *path;
+};
+
+struct fdpath_stats fdpath_stats;
+
+static struct fdpath_entry **hash;
+static unsigned int hash_mask;
+static struct fdpath_entry lru = { .prev = &lru, .next = &lru };
+static int capacity, count;
+static char path_buf[PATH_MAX];
+
+int fdpath_init(int max)
+{
+	unsigned int size = 1;
+
+	fdpath_invalidate_all();
+	free(hash);
+
+	capacity = max > 0 ? max : FDPATH_CACHE_SIZE;
+	while (size < capacity * 2)
+		size <<= 1;
+	hash = calloc(size, sizeof(*hash));
+	if (!hash) {
+		perror("alloc fdpath cache");
+		return -1;
+	}
+	hash_mask = size - 1;
+	return 0;
+}
+
+static unsigned int key_hash(struct fdpath_key *key)
+{
+	uint64_t h = key->ino * 0x9e3779b97f4a7c15ULL;
+
+	h ^= key->dev + (h >> 29);
+	h ^= key->gen * 0xbf58476d1ce4e5b9ULL;
+	return (h ^ (h >> 32)) & hash_mask;
+}
+
+static int get_key(int fd, struct fdpath_key *key, int *nlink)
+{
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_INO | STATX_NLINK | STATX_BTIME, &stx)) {
+		perror("statx");
+		return -1;
+	}
+
+	key->dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+	key->ino = stx.stx_ino;
+	key->gen = 0;
+	if (stx.stx_mask & STATX_BTIME)
+		key->gen = stx.stx_btime.tv_sec * 1000000000LL + stx.stx_btime.tv_nsec;
+	*nlink = stx.stx_nlink;
+	return 0;
+}
+
+static struct fdpath_entry **find(struct fdpath_key *key)
+{
+	struct fdpath_entry **p = &hash[key_hash(key)];
+
+	while (*p && memcmp(&(*p)->key, key, sizeof(*key)))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void lru_del(struct fdpath_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_add(struct fdpath_entry *e)
+{
+	e->next = lru.next;
+	e->prev = &lru;
+	lru.next->prev = e;
+	lru.next = e;
+}
+
+static void remove_entry(struct fdpath_entry **p)
+{
+	struct fdpath_entry *e = *p;
+
+	*p = e->hnext;
+	lru_del(e);
+	free(e->path);
+	free(e);
+	count--;
+}
+
+static const char *read_path(int fd)
+{
+	char procfd_path[64];
+	ssize_t len;
+
+	snprintf(procfd_path, sizeof(procfd_path), "/proc/self/fd/%d", fd);
+	len = readlink(procfd_path, path_buf, sizeof(path_buf) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return NULL;
+	}
+	path_buf[len] = 0;
+	return path_buf;
+}
+
+const char *fdpath_get(int fd)
+{
+	struct fdpath_key key;
+	struct fdpath_entry **p, *e;
+	const char *path;
+	int nlink;
+
+	if (!hash && fdpath_init(0))
+		return read_path(fd);
+
+	if (get_key(fd, &key, &nlink))
+		return NULL;
+
+	p = find(&key);
+	if (!nlink) {
+		/* Deleted inode - do not cache "(deleted)" path */
+		if (*p) {
+			remove_entry(p);
+			fdpath_stats.invalidations++;
+		}
+		fdpath_stats.misses++;
+		return read_path(fd);
+	}
+	if (*p) {
+		e = *p;
+		lru_del(e);
+		lru_add(e);
+		fdpath_stats.hits++;
+		return e->path;
+	}
+
+	fdpath_stats.misses++;
+	path = read_path(fd);
+	if (!path)
+		return NULL;
+
+	if (count >= capacity) {
+		e = lru.prev;
+		remove_entry(find(&e->key));
+		fdpath_stats.evictions++;
+	}
+	e = malloc(sizeof(*e));
+	if (!e || !(e->path = strdup(path))) {
+		free(e);
+		return path;
+	}
+	e->key = key;
+	e->hnext = NULL;
+	*find(&key) = e;
+	lru_add(e);
+	count++;
+	return e->path;
+}
+
+void fdpath_invalidate(int fd)
+{
+	struct fdpath_key key;
+	struct fdpath_entry **p;
+	int nlink;
+
+	if (!hash || get_key(fd, &key, &nlink))
+		return;
+
+	p = find(&key);
+	if (*p) {
+		remove_entry(p);
+		fdpath_stats.invalidations++;
+	}
+}
+
+void fdpath_invalidate_all(void)
+{
+	if (!hash)
+		return;
+
+	while (lru.next != &lru) {
+		remove_entry(find(&lru.next->key));
+		fdpath_stats.invalidations++;
+	}
+}
+
+void fdpath_print_stats(void)
+{
+	unsigned long long total = fdpath_stats.hits + fdpath_stats.misses;
+
+	printf("Path cache: hits=%llu misses=%llu (%.1f%% hits) evictions=%llu invalidations=%llu\n",
+		fdpath_stats.hits, fdpath_stats.misses,
+		total ? 100.0 * fdpath_stats.hits / total : 0,
+		fdpath_stats.evictions, fdpath_stats.invalidations);
+}
@@ -0,0 +1,40 @@
+#ifndef _FDPATH_H
+#define _FDPATH_H
+
+#include <stdint.h>
+
+/*
+ * Resolve the path of a fanotify event fd with a bounded LRU cache keyed by
+ * inode, so hot files do not cost a readlink() of /proc/self/fd per event.
+ *
+ * A cached path goes stale if the file or one of its ancestors is renamed.
+ * Listeners that get rename or delete events should invalidate the entry
+ * of the event fd, and all entries after a queue overflow. Listeners in fd
+ * mode get no rename events, so they may print a stale path after rename.
+ */
+struct fdpath_key {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t gen;		/* birth time if reported by the filesystem */
+};
+
+struct fdpath_stats {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long invalidations;
+};
+
+extern struct fdpath_stats fdpath_stats;
+
+/* Set the max number of cached paths (default FDPATH_CACHE_SIZE) */
+#define FDPATH_CACHE_SIZE 4096
+int fdpath_init(int capacity);
+
+/* Returned path is valid until the next call, NULL on error */
+const char *fdpath_get(int fd);
+void fdpath_invalidate(int fd);
+void fdpath_invalidate_all(void);
+void fdpath_print_stats(void);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * fidres - resolve fanotify file handles with a mount fd pool and dir fd cache
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/vfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fidres.h"
+
+struct dir_entry {
+	struct dir_entry *hnext;		/* hash chain */
+	struct dir_entry *prev, *next;		/* LRU list, most recent first */
+	int fd;
+	unsigned int keylen;
+	unsigned char key[];	/* fsid, handle type, handle bytes */
+};
+
+struct mount_entry {
+	uint64_t fsid;
+	int fd;
+};
+
+struct fidres_stats fidres_stats;
+
+static struct mount_entry mounts[FIDRES_MAX_MOUNTS];
+static int nmounts;
+static struct dir_entry **hash;
+static unsigned int hash_mask;
+static struct dir_entry lru = { .prev = &lru, .next = &lru };
+static int capacity, count;
+
+int fidres_init(int max)
+{
+	unsigned int size = 1;
+
+	capacity = max > 0 ? max : FIDRES_CACHE_SIZE;
+	while (size < capacity * 2)
+		size <<= 1;
+	hash = calloc(size, sizeof(*hash));
+	if (!hash) {
+		perror("alloc fidres cache");
+		return -1;
+	}
+	hash_mask = size - 1;
+	return 0;
+}
+
+int fidres_add_mount(const char *path)
+{
+	struct statfs sfs;
+	uint64_t fsid;
+	int i, fd;
+
+	if (statfs(path, &sfs)) {
+		perror(path);
+		return -1;
+	}
+	memcpy(&fsid, &sfs.f_fsid, sizeof(fsid));
+	for (i = 0; i < nmounts; i++) {
+		if (mounts[i].fsid == fsid)
+			return 0;
+	}
+	if (nmounts == FIDRES_MAX_MOUNTS) {
+		fprintf(stderr, "%s: too many mounts\n", path);
+		return -1;
+	}
+	/* open_by_handle_at() fails with EBADF on an O_PATH mount fd */
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	mounts[nmounts].fsid = fsid;
+	mounts[nmounts].fd = fd;
+	nmounts++;
+	return 0;
+}
+
+static int mount_fd(const unsigned int *fsid)
+{
+	uint64_t key;
+	int i;
+
+	memcpy(&key, fsid, sizeof(key));
+	for (i = 0; i < nmounts; i++) {
+		if (mounts[i].fsid == key)
+			return mounts[i].fd;
+	}
+	fidres_stats.nomount++;
+	errno = ENODEV;
+	return -1;
+}
+
+static unsigned int make_key(unsigned char *key, const unsigned int *fsid,
+			     const struct file_handle *fh)
+{
+	memcpy(key, fsid, 8);
+	memcpy(key + 8, &fh->handle_type, sizeof(fh->handle_type));
+	memcpy(key + 12, fh->f_handle, fh->handle_bytes);
+	return 12 + fh->handle_bytes;
+}
+
+static struct dir_entry **find(const unsigned char *key, unsigned int len)
+{
+	struct dir_entry **p;
+	unsigned int h = 2166136261u, i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ key[i]) * 16777619u;
+	p = &hash[h & hash_mask];
+	while (*p && ((*p)->keylen != len || memcmp((*p)->key, key, len)))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void lru_del(struct dir_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_add(struct dir_entry *e)
+{
+	e->next = lru.next;
+	e->prev = &lru;
+	lru.next->prev = e;
+	lru.next = e;
+}
+
+static void evict_lru(void)
+{
+	struct dir_entry *e = lru.prev;
+
+	lru_del(e);
+	*find(e->key, e->keylen) = e->hnext;
+	close(e->fd);
+	free(e);
+	count--;
+	fidres_stats.evictions++;
+}
+
+static int open_handle(const unsigned int *fsid, const struct file_handle *fh,
+		       int flags)
+{
+	int mfd = mount_fd(fsid);
+	int fd;
+
+	if (mfd < 0)
+		return -1;
+	fidres_stats.by_handle++;
+	fd = open_by_handle_at(mfd, (struct file_handle *)fh, flags);
+	if (fd < 0 && (errno == ESTALE || errno == ENOENT))
+		fidres_stats.stale++;
+	return fd;
+}
+
+int fidres_dirfd(const unsigned int *fsid, const struct file_handle *fh)
+{
+	unsigned char key[12 + MAX_HANDLE_SZ];
+	struct dir_entry **p, *e;
+	unsigned int keylen;
+	int fd;
+
+	if (fh->handle_bytes > MAX_HANDLE_SZ) {
+		errno = EINVAL;
+		return -1;
+	}
+	keylen = make_key(key, fsid, fh);
+	p = find(key, keylen);
+	e = *p;
+	if (e) {
+		fidres_stats.hits++;
+		lru_del(e);
+		lru_add(e);
+		return e->fd;
+	}
+
+	fidres_stats.misses++;
+	fd = open_handle(fsid, fh, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	e = malloc(sizeof(*e) + keylen);
+	if (!e) {
+		perror("alloc dir fd");
+		close(fd);
+		return -1;
+	}
+	if (count >= capacity) {
+		evict_lru();
+		p = find(key, keylen);
+	}
+	e->fd = fd;
+	e->keylen = keylen;
+	memcpy(e->key, key, keylen);
+	e->hnext = NULL;
+	*p = e;
+	lru_add(e);
+	count++;
+	return fd;
+}
+
+int fidres_open(const struct fan_info *info, int flags)
+{
+	int dfd, fd;
+
+	if (!info->fh) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!info->name)
+		return open_handle(info->fsid, info->fh, flags | O_CLOEXEC);
+
+	dfd = fidres_dirfd(info->fsid, info->fh);
+	if (dfd < 0)
+		return -1;
+	fidres_stats.by_name++;
+	fd = openat(dfd, info->name, flags | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT)
+		fidres_stats.stale++;
+	return fd;
+}
+
+int fidres_open_event(const struct fanotify_event_metadata *md, int flags)
+{
+	struct fan_info_iter it;
+	struct fan_info info, fid = { .fh = NULL }, name = { .fh = NULL };
+
+	fan_info_init(&it, md);
+	while (fan_info_next(&it, &info) > 0) {
+		if (info.type == FAN_EVENT_INFO_TYPE_FID)
+			fid = info;
+		else if (info.type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+			 info.type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME)
+			name = info;
+	}
+
+	/* Events on the dir itself are reported with name "." */
+	if (name.fh && !(fid.fh && !strcmp(name.name, ".")))
+		return fidres_open(&name, flags);
+	if (fid.fh)
+		return fidres_open(&fid, flags);
+	errno = EINVAL;
+	return -1;
+}
+
+void fidres_print_stats(void)
+{
+	printf("FID resolver: mounts=%d by name=%llu by handle=%llu dir fds=%d hits=%llu misses=%llu evictions=%llu stale=%llu nomount=%llu\n",
+		nmounts, fidres_stats.by_name, fidres_stats.by_handle, count,
+		fidres_stats.hits, fidres_stats.misses, fidres_stats.evictions,
+		fidres_stats.stale, fidres_stats.nomount);
+}
@@ -0,0 +1,53 @@
+#ifndef _FIDRES_H
+#define _FIDRES_H
+
+#include <stdint.h>
+#include "faninfo.h"
+
+/*
+ * Resolve fanotify file handles (FID mode events) to open fds.
+ *
+ * open_by_handle_at() needs a mount fd of the filesystem, so one mount fd
+ * is kept per fsid for the paths registered with fidres_add_mount().
+ * Events with a dir handle and a name (FAN_REPORT_DFID_NAME) are resolved
+ * with openat() of the name relative to the dir fd, and dir fds are kept
+ * in a bounded LRU cache keyed by fsid and dir handle, so events on files
+ * in the same dirs mostly cost a single openat(). Events with only a file
+ * handle are resolved with open_by_handle_at().
+ *
+ * Requires CAP_DAC_READ_SEARCH.
+ */
+#define FIDRES_CACHE_SIZE 1024
+#define FIDRES_MAX_MOUNTS 64
+
+struct fidres_stats {
+	unsigned long long by_name;	/* openat() of name in cached dir */
+	unsigned long long by_handle;	/* open_by_handle_at() */
+	unsigned long long hits, misses, evictions;	/* dir fd cache */
+	unsigned long long stale;	/* object no longer exists */
+	unsigned long long nomount;	/* no mount fd for fsid */
+};
+
+extern struct fidres_stats fidres_stats;
+
+/* Set the max number of cached dir fds (default FIDRES_CACHE_SIZE) */
+int fidres_init(int capacity);
+
+/* Register a mount fd for the filesystem of path */
+int fidres_add_mount(const char *path);
+
+/* Returns a cached O_PATH fd of dir, valid until the next call, or -1 */
+int fidres_dirfd(const unsigned int *fsid, const struct file_handle *fh);
+
+/* Returns a new fd of the object of a fid record, which the caller closes */
+int fidres_open(const struct fan_info *info, int flags);
+
+/*
+ * Returns a new fd of the event object: by name if the event has a dir
+ * record with a name, otherwise by the file handle. Errors are -1.
+ */
+int fidres_open_event(const struct fanotify_event_metadata *md, int flags);
+
+void fidres_print_stats(void);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * ignore - adaptive ignore marks for noisy directories
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/fanotify.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ignore.h"
+
+#ifndef FAN_MARK_IGNORE
+#define FAN_MARK_IGNORE		0x00000400
+#endif
+#ifndef FAN_MARK_IGNORE_SURV
+#define FAN_MARK_IGNORE_SURV	(FAN_MARK_IGNORE | FAN_MARK_IGNORED_SURV_MODIFY)
+#endif
+
+#define IGNORE_HASH_SIZE 4096
+/* Forget dirs that were not seen and not ignored for a while */
+#define IGNORE_IDLE_SECS 10
+#define NSEC_PER_SEC 1000000000ULL
+
+struct ignore_dir {
+	struct ignore_dir *hnext;
+	uint64_t window;	/* start of current window (ns) */
+	unsigned int count;	/* events in current window */
+	unsigned int rate;	/* events/s when ignored */
+	time_t since, until;	/* ignored in [since, until) */
+	int secs;		/* last ignore duration */
+	time_t expired;		/* when last ignore expired */
+	char path[];
+};
+
+struct ignore_stats ignore_stats;
+
+static int fanotify_fd = -1;
+static uint64_t ignore_mask;
+static unsigned int threshold;
+static struct ignore_dir *hash[IGNORE_HASH_SIZE];
+
+static unsigned int path_hash(const char *path, int len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h & (IGNORE_HASH_SIZE - 1);
+}
+
+static struct ignore_dir **find(const char *path, int len)
+{
+	struct ignore_dir **p = &hash[path_hash(path, len)];
+
+	while (*p && (strncmp((*p)->path, path, len) || (*p)->path[len]))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int ignore_mark(struct ignore_dir *d, unsigned int flags)
+{
+	return fanotify_mark(fanotify_fd, flags | FAN_MARK_IGNORE_SURV,
+			     ignore_mask | FAN_EVENT_ON_CHILD, AT_FDCWD, d->path);
+}
+
+int ignore_init(int fd, uint64_t mask, int events_per_sec)
+{
+	fanotify_fd = fd;
+	ignore_mask = mask;
+	threshold = events_per_sec;
+
+	/* Probe FAN_MARK_IGNORE support with an ignore mark on / */
+	if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_IGNORE_SURV,
+			  mask | FAN_EVENT_ON_CHILD, AT_FDCWD, "/") ||
+	    fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_IGNORE_SURV,
+			  mask | FAN_EVENT_ON_CHILD, AT_FDCWD, "/")) {
+		perror("FAN_MARK_IGNORE is not supported");
+		return -1;
+	}
+	return 0;
+}
+
+static void start_ignore(struct ignore_dir *d, uint64_t ns)
+{
+	time_t now = ns / NSEC_PER_SEC;
+	/* Rate so far in window - at least 1ms to avoid noise */
+	uint64_t elapsed = ns - d->window > NSEC_PER_SEC / 1000 ?
+			   ns - d->window : NSEC_PER_SEC / 1000;
+
+	/* Still noisy right after the last ignore expired - back off */
+	if (d->expired && now - d->expired <= 2) {
+		d->secs = d->secs * 2 > IGNORE_MAX_SECS ? IGNORE_MAX_SECS : d->secs * 2;
+		ignore_stats.renewed++;
+	} else {
+		d->secs = IGNORE_SECS;
+	}
+
+	if (ignore_mark(d, FAN_MARK_ADD)) {
+		perror(d->path);
+		return;
+	}
+	d->rate = d->count * NSEC_PER_SEC / elapsed;
+	d->since = now;
+	d->until = now + d->secs;
+	ignore_stats.added++;
+	ignore_stats.ignored++;
+}
+
+void ignore_event(const char *path)
+{
+	const char *p = strrchr(path, '/');
+	int len = p ? (p == path ? 1 : p - path) : 0;
+	uint64_t ns = now_ns();
+	time_t now = ns / NSEC_PER_SEC;
+	struct ignore_dir **pd, *d;
+
+	ignore_stats.events++;
+	if (!len)
+		return;
+
+	pd = find(path, len);
+	d = *pd;
+	if (!d) {
+		d = calloc(1, sizeof(*d) + len + 1);
+		if (!d)
+			return;
+		memcpy(d->path, path, len);
+		*pd = d;
+	}
+
+	if (ns - d->window >= NSEC_PER_SEC) {
+		d->window = ns;
+		d->count = 0;
+	}
+	/* Events queued before the ignore mark was added */
+	if (d->until > now)
+		return;
+
+	if (++d->count >= threshold)
+		start_ignore(d, ns);
+}
+
+void ignore_expire(void)
+{
+	uint64_t ns = now_ns();
+	time_t now = ns / NSEC_PER_SEC;
+	struct ignore_dir **pd, *d;
+	int i;
+
+	for (i = 0; i < IGNORE_HASH_SIZE; i++) {
+		pd = &hash[i];
+		while ((d = *pd)) {
+			if (d->until && d->until <= now) {
+				if (ignore_mark(d, FAN_MARK_REMOVE))
+					perror(d->path);
+				ignore_stats.suppressed += (unsigned long long)d->rate * (now - d->since);
+				ignore_stats.expired++;
+				ignore_stats.ignored--;
+				d->until = 0;
+				d->expired = now;
+				d->count = 0;
+				d->window = ns;
+			}
+			if (!d->until && ns - d->window > IGNORE_IDLE_SECS * NSEC_PER_SEC) {
+				*pd = d->hnext;
+				free(d);
+				continue;
+			}
+			pd = &d->hnext;
+		}
+	}
+}
+
+void ignore_print_stats(void)
+{
+	unsigned long long suppressed = ignore_stats.suppressed, total;
+	time_t now = now_ns() / NSEC_PER_SEC;
+	struct ignore_dir *d;
+	int i;
+
+	/* Count also the dirs that are still ignored */
+	for (i = 0; i < IGNORE_HASH_SIZE; i++) {
+		for (d = hash[i]; d; d = d->hnext) {
+			if (d->until)
+				suppressed += (unsigned long long)d->rate * (now - d->since);
+		}
+	}
+	total = ignore_stats.events + suppressed;
+
+	printf("Ignore marks: threshold=%u/s added=%llu renewed=%llu expired=%llu ignored=%d events=%llu suppressed~%llu (%.1f%%)\n",
+		threshold, ignore_stats.added, ignore_stats.renewed,
+		ignore_stats.expired, ignore_stats.ignored, ignore_stats.events,
+		suppressed, total ? 100.0 * suppressed / total : 0);
+}
@@ -0,0 +1,45 @@
+#ifndef _IGNORE_H
+#define _IGNORE_H
+
+#include <stdint.h>
+
+/*
+ * Adaptive ignore marks for noisy directories.
+ *
+ * Events are counted per parent dir in windows of one second. When a dir
+ * crosses the threshold of events per second, an ignore mark for events on
+ * its children is added on the dir, so the kernel stops queueing them.
+ * The ignore mark is removed after IGNORE_SECS to sample the rate again.
+ * A dir that is still noisy is ignored again for twice as long, up to
+ * IGNORE_MAX_SECS. The number of suppressed events is estimated from the
+ * rate that was measured before the dir was ignored.
+ *
+ * Requires FAN_MARK_IGNORE (kernel 6.0), because legacy ignore masks do
+ * not apply to events on children and are cleared on modify.
+ */
+#define IGNORE_SECS 4
+#define IGNORE_MAX_SECS 64
+
+struct ignore_stats {
+	unsigned long long events;	/* events delivered and counted */
+	unsigned long long suppressed;	/* estimated events not delivered */
+	unsigned long long added;
+	unsigned long long renewed;
+	unsigned long long expired;
+	int ignored;			/* dirs currently ignored */
+};
+
+extern struct ignore_stats ignore_stats;
+
+/* Ignore mask is the mask of events that may be suppressed */
+int ignore_init(int fanotify_fd, uint64_t mask, int threshold);
+
+/* Count an event on file path */
+void ignore_event(const char *path);
+
+/* Remove expired ignore marks - call at least once per second */
+void ignore_expire(void);
+
+void ignore_print_stats(void);
+
+#endif
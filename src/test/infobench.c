@@ -0,0 +1,165 @@
+/*
+ * infobench - fanotify info record decode benchmark
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ *
+ * Fills a buffer with synthetic events in the layouts that the kernel
+ * reports with FAN_REPORT_DFID_NAME_TARGET and FAN_REPORT_PIDFD and
+ * measures how fast a single core walks their info records.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/fanotify.h>
+#include "faninfo.h"
+
+#define HANDLE_BYTES 12
+#define BUF_SIZE (1 << 20)
+
+enum layout {
+	LAYOUT_FID,		/* FAN_MODIFY on a file */
+	LAYOUT_DFID_NAME,	/* FAN_CREATE with target fid */
+	LAYOUT_RENAME,		/* FAN_RENAME with old and new names */
+	LAYOUT_PIDFD,		/* FAN_CREATE with target fid and pidfd */
+	LAYOUT_MIXED,
+	LAYOUT_MAX
+};
+
+static const char *layout_names[] = {
+	"fid", "dfid+name", "rename", "dfid+name+pidfd", "mixed",
+};
+
+static char *add_fid(char *p, int type, const char *name, unsigned int ino)
+{
+	struct fanotify_event_info_fid *fid = (void *)p;
+	struct file_handle *fh = (void *)fid->handle;
+	size_t len = sizeof(*fid) + sizeof(*fh) + HANDLE_BYTES;
+
+	if (name)
+		len += strlen(name) + 1;
+	len = (len + 3) & ~3;
+	memset(p, 0, len);
+	fid->hdr.info_type = type;
+	fid->hdr.len = len;
+	fid->fsid.val[0] = 0x1234;
+	fid->fsid.val[1] = 0x5678;
+	fh->handle_bytes = HANDLE_BYTES;
+	fh->handle_type = 1;
+	memcpy(fh->f_handle, &ino, sizeof(ino));
+	if (name)
+		strcpy((char *)fh->f_handle + HANDLE_BYTES, name);
+	return p + len;
+}
+
+static char *add_event(char *p, enum layout layout, unsigned int seq)
+{
+	struct fanotify_event_metadata *md = (void *)p;
+	struct fanotify_event_info_pidfd *pidfd;
+	char name[32];
+
+	memset(md, 0, sizeof(*md));
+	md->vers = FANOTIFY_METADATA_VERSION;
+	md->metadata_len = sizeof(*md);
+	md->fd = FAN_NOFD;
+	md->pid = 1000 + seq % 7;
+	p += sizeof(*md);
+	snprintf(name, sizeof(name), "file%u", seq);
+
+	switch (layout) {
+		case LAYOUT_FID:
+			md->mask = FAN_MODIFY;
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_FID, NULL, seq);
+			break;
+		case LAYOUT_DFID_NAME:
+		case LAYOUT_PIDFD:
+			md->mask = FAN_CREATE;
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_DFID_NAME, name, 2);
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_FID, NULL, seq);
+			if (layout != LAYOUT_PIDFD)
+				break;
+			pidfd = (void *)p;
+			pidfd->hdr.info_type = FAN_EVENT_INFO_TYPE_PIDFD;
+			pidfd->hdr.len = sizeof(*pidfd);
+			pidfd->pidfd = -1;
+			p += sizeof(*pidfd);
+			break;
+		case LAYOUT_RENAME:
+			md->mask = FAN_RENAME;
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_OLD_DFID_NAME, name, 2);
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_NEW_DFID_NAME, "renamed", 3);
+			p = add_fid(p, FAN_EVENT_INFO_TYPE_FID, NULL, seq);
+			break;
+		default:
+			return add_event(p - sizeof(*md), seq % LAYOUT_MIXED, seq);
+	}
+	md->event_len = p - (char *)md;
+	return p;
+}
+
+/* Decode all records and fold them into a checksum, so work is not elided */
+static unsigned long decode(const char *buf, ssize_t len,
+			    unsigned long long *nevents,
+			    unsigned long long *nrecords)
+{
+	const struct fanotify_event_metadata *md = (const void *)buf;
+	struct fan_info_iter it;
+	struct fan_info info;
+	unsigned long sum = 0;
+
+	while (FAN_EVENT_OK(md, len)) {
+		fan_info_init(&it, md);
+		while (fan_info_next(&it, &info) > 0) {
+			(*nrecords)++;
+			if (info.fh)
+				sum += info.fh->handle_bytes + info.fsid[0];
+			if (info.name)
+				sum += info.name[0];
+			sum += info.pidfd;
+		}
+		(*nevents)++;
+		md = FAN_EVENT_NEXT(md, len);
+	}
+	return sum;
+}
+
+int main(int argc, char *argv[])
+{
+	char *buf = malloc(BUF_SIZE), *p, *end;
+	unsigned long long nevents, nrecords;
+	struct timespec start, stop;
+	unsigned long sum = 0;
+	double secs;
+	int loops = argc > 1 ? atoi(argv[1]) : 200;
+	int layout, i;
+	unsigned int seq;
+
+	if (!buf) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (layout = 0; layout < LAYOUT_MAX; layout++) {
+		p = buf;
+		end = buf + BUF_SIZE - 4096;
+		for (seq = 0; p < end; seq++)
+			p = add_event(p, layout, seq);
+
+		nevents = nrecords = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < loops; i++)
+			sum += decode(buf, p - buf, &nevents, &nrecords);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-16s events/buf=%-6u %.1f Mevents/s %.1f Mrecords/s %.2f GB/s\n",
+			layout_names[layout], seq, nevents / secs / 1e6,
+			nrecords / secs / 1e6, (double)(p - buf) * loops / secs / 1e9);
+	}
+	/* Print the checksum so the decode loop is not optimized out */
+	fprintf(stderr, "checksum %lu\n", sum);
+	free(buf);
+	return 0;
+}
@@ -9,8 +9,13 @@
 \*************************************************************************/
 
 #include <sys/inotify.h>
+#include <sys/resource.h>
+#include <dirent.h>
 #include <limits.h>
+#include <time.h>
 #include "tlpi_hdr.h"
+#include "evread.h"
+#include "inotree.h"
 
 #define FS_VOLATILE            0x01000000
 #define IN_VOLATILE            0//0x08000000
@@ -52,8 +57,6 @@ static inline int is_new_dentry(struct inotify_event *i)
 	return (i->mask & FS_D_INSTANTIATE) == FS_D_INSTANTIATE && i->len > 0;
 }
 
-#define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
-
 static int add_watch(int inotifyFd, const char *dir, const char *name)
 {
 	char path[256];
@@ -73,49 +76,122 @@ static int add_watch(int inotifyFd, const char *dir, const char *name)
 	return wd;
 }
 
+static void             /* Display path of event from the inotree table */
+displayPath(struct inotify_event *i)
+{
+    char path[PATH_MAX];
+
+    if (inotree_path(i->wd, i->len ? i->name : NULL, path, sizeof(path)) >= 0)
+        printf("        path = %s\n", path);
+}
+
+static void             /* Display entry found by the scan of a new dir */
+displayScanned(int wd, const char *name, unsigned char type)
+{
+    char path[PATH_MAX];
+
+    if (inotree_path(wd, name, path, sizeof(path)) >= 0)
+        printf("    scanned %s%s\n", path, type == DT_DIR ? "/" : "");
+}
+
+static void             /* Watch trees with inotree and display setup cost */
+addTrees(int inotifyFd, char *paths[], int npaths)
+{
+    struct timespec start, end;
+    struct rusage ru;
+    int j;
+
+    if (inotree_init(inotifyFd, IN_ALL_EVENTS, displayScanned))
+        exit(EXIT_FAILURE);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < npaths; j++) {
+        if (inotree_add(paths[j]) == -1)
+            exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("Watching %d dirs in %.3f sec, table %zu KB, max RSS %ld KB\n",
+           inotree_stats.count, (end.tv_sec - start.tv_sec) +
+           (end.tv_nsec - start.tv_nsec) / 1e9, inotree_mem() / 1024,
+           ru.ru_maxrss);
+}
+
 int
 main(int argc, char *argv[])
 {
-    int inotifyFd, wd, j;
-    char buf[BUF_LEN] __attribute__ ((aligned(8)));
+    int inotifyFd, wd, j, opt;
+    int recursive = 0, setupOnly = 0;
+    struct evread events;
     ssize_t numRead;
     char *p;
     struct inotify_event *event;
 
-    if (argc < 2 || strcmp(argv[1], "--help") == 0)
-        usageErr("%s pathname...\n", argv[0]);
+    while ((opt = getopt(argc, argv, "rb")) != -1) {
+        switch (opt) {
+        case 'r': recursive = 1;                break;
+        case 'b': recursive = setupOnly = 1;    break;
+        default:  optind = argc + 1;            break;
+        }
+    }
+
+    if (optind >= argc || strcmp(argv[optind], "--help") == 0)
+        usageErr("%s [-r] [-b] pathname...\n"
+                 "        -r  watch the trees under pathnames\n"
+                 "        -b  exit after watching the trees (benchmark)\n",
+                 argv[0]);
 
     inotifyFd = inotify_init();                 /* Create inotify instance */
     if (inotifyFd == -1)
         errExit("inotify_init");
 
-    for (j = 1; j < argc; j++) {
+    if (recursive) {
+        addTrees(inotifyFd, argv + optind, argc - optind);
+        if (setupOnly) {
+            inotree_print_stats();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    for (j = optind; j < argc && !recursive; j++) {
 	wd = add_watch(inotifyFd, argv[j], "");
 	if (wd == -1)
 		errExit("inotify_add_watch");
     }
 
+    if (evread_init(&events, inotifyFd, EVREAD_INOTIFY, 0, 0))
+        exit(EXIT_FAILURE);
+
     for (;;) {                                  /* Read events forever */
-        numRead = read(inotifyFd, buf, BUF_LEN);
+        numRead = evread(&events);
         if (numRead == 0)
             fatal("read() from inotify fd returned 0!");
 
         if (numRead == -1)
             errExit("read");
 
-        printf("Read %ld bytes from inotify fd\n", (long) numRead);
+        printf("Read %ld bytes (%d events) from inotify fd\n", (long) numRead,
+               events.events);
 
         /* Process all of the events in buffer returned by read() */
 
-        for (p = buf; p < buf + numRead; ) {
+        for (p = events.buf; p < events.buf + numRead; ) {
             event = (struct inotify_event *) p;
             displayInotifyEvent(event);
 
-	    if (is_new_dentry(event))
+            if (recursive) {
+                displayPath(event);
+                inotree_event(event);
+            } else if (is_new_dentry(event)) {
 		    add_watch(inotifyFd, NULL, event->name);
+            }
 
             p += sizeof(struct inotify_event) + event->len;
         }
+
+        if (recursive)
+            inotree_flush();
     }
 
     exit(EXIT_SUCCESS);
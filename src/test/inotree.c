@@ -0,0 +1,567 @@
+/*
+ * inotree - recursive inotify watches with a wd to path table
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "inotree.h"
+
+#define DENTS_BUF_SIZE (32 * 1024)
+#define INOTREE_MIN_SIZE 1024
+#define INOTREE_MAX_DEPTH (PATH_MAX / 2)
+#define DETACHED -1		/* parent of a dir moved out of the tree */
+
+/* Flags of watch_dir() */
+#define WATCH_REPORT	1	/* report the entries of new dirs */
+#define WATCH_FULL	2	/* also scan dirs that are already watched */
+
+struct node {
+	int wd;			/* 0 for an empty slot */
+	int parent;		/* 0 for a root */
+	int child;		/* wd of first child dir, 0 for none */
+	int prev, next;		/* wds of sibling dirs, 0 for none */
+	char *name;		/* path for a root */
+};
+
+/* Dir events that are handled after the batch */
+struct delayed {
+	int parent;
+	int wd;			/* of moved dir */
+	uint32_t cookie;
+	int tries;
+	char *name;
+};
+
+struct delayed_list {
+	struct delayed *v;
+	int n, size;
+};
+
+struct inotree_stats inotree_stats;
+
+static int inotify_fd = -1;
+static uint32_t watch_mask;
+static inotree_fn found_fn;
+static struct node *table;
+static unsigned int table_mask;
+static size_t names_bytes;
+static struct delayed_list moves, pending;
+static int need_resync, nospc;
+
+/*
+ * The kernel allocates wds cyclically, so live wds are mostly a dense
+ * range and indexing by the wd itself spreads them with no collisions.
+ */
+static struct node *lookup(int wd)
+{
+	unsigned int i = wd & table_mask;
+
+	while (table[i].wd) {
+		if (table[i].wd == wd)
+			return &table[i];
+		i = (i + 1) & table_mask;
+	}
+	return NULL;
+}
+
+static struct node *slot(struct node *t, unsigned int mask, int wd)
+{
+	unsigned int i = wd & mask;
+
+	while (t[i].wd)
+		i = (i + 1) & mask;
+	return &t[i];
+}
+
+static int grow(void)
+{
+	unsigned int size = (table_mask + 1) * 2, i;
+	struct node *t = calloc(size, sizeof(*t));
+
+	if (!t) {
+		perror("alloc inotree table");
+		return -1;
+	}
+	for (i = 0; i <= table_mask; i++) {
+		if (table[i].wd)
+			*slot(t, size - 1, table[i].wd) = table[i];
+	}
+	free(table);
+	table = t;
+	table_mask = size - 1;
+	return 0;
+}
+
+/* Keep the load under 3/4 */
+static struct node *insert(int wd)
+{
+	struct node *n;
+
+	if ((inotree_stats.count + 1) * 4 > (table_mask + 1) * 3 && grow())
+		return NULL;
+	n = slot(table, table_mask, wd);
+	n->wd = wd;
+	n->parent = DETACHED;
+	n->child = n->prev = n->next = 0;
+	n->name = NULL;
+	if (++inotree_stats.count > inotree_stats.peak)
+		inotree_stats.peak = inotree_stats.count;
+	return n;
+}
+
+/* Children are linked by wd, because entries move on grow and delete */
+static void link_child(struct node *n)
+{
+	struct node *p = n->parent > 0 ? lookup(n->parent) : NULL;
+	struct node *s;
+
+	if (!p)
+		return;
+	n->prev = 0;
+	n->next = p->child;
+	if (p->child && (s = lookup(p->child)))
+		s->prev = n->wd;
+	p->child = n->wd;
+}
+
+static void unlink_child(struct node *n)
+{
+	struct node *p, *s;
+
+	if (n->prev) {
+		if ((s = lookup(n->prev)))
+			s->next = n->next;
+	} else if (n->parent > 0 && (p = lookup(n->parent)) &&
+		   p->child == n->wd) {
+		p->child = n->next;
+	}
+	if (n->next && (s = lookup(n->next)))
+		s->prev = n->prev;
+	n->prev = n->next = 0;
+}
+
+/* Linear probing delete: shift back entries that probed past the hole */
+static int remove_node(int wd)
+{
+	struct node *n = lookup(wd), *c;
+	unsigned int i, j, home;
+	int next;
+
+	if (!n)
+		return 0;
+	unlink_child(n);
+	/* Children that are still watched have no path until removed */
+	for (next = n->child; next && (c = lookup(next)); ) {
+		next = c->next;
+		c->parent = DETACHED;
+		c->prev = c->next = 0;
+	}
+	if (n->name) {
+		names_bytes -= strlen(n->name) + 1;
+		free(n->name);
+	}
+	i = j = n - table;
+	for (;;) {
+		j = (j + 1) & table_mask;
+		if (!table[j].wd)
+			break;
+		home = table[j].wd & table_mask;
+		/* Move j to the hole at i unless its home is cyclically in (i, j] */
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].wd = 0;
+	inotree_stats.count--;
+	return 1;
+}
+
+static int set_name(struct node *n, int parent, const char *name)
+{
+	char *s;
+
+	if (n->name && n->parent == parent && !strcmp(n->name, name))
+		return 0;
+	s = strdup(name);
+	if (!s) {
+		perror("alloc inotree name");
+		return -1;
+	}
+	if (n->name) {
+		names_bytes -= strlen(n->name) + 1;
+		free(n->name);
+		inotree_stats.moved++;
+	}
+	names_bytes += strlen(s) + 1;
+	n->name = s;
+	unlink_child(n);
+	n->parent = parent;
+	link_child(n);
+	return 0;
+}
+
+static int push(struct delayed_list *l, int parent, uint32_t cookie,
+		int tries, const char *name)
+{
+	struct delayed *v;
+	char *s;
+
+	if (l->n == l->size) {
+		v = realloc(l->v, (l->size ? l->size * 2 : 16) * sizeof(*v));
+		if (!v)
+			return -1;
+		l->v = v;
+		l->size = l->size ? l->size * 2 : 16;
+	}
+	s = strdup(name);
+	if (!s)
+		return -1;
+	l->v[l->n].parent = parent;
+	l->v[l->n].wd = 0;
+	l->v[l->n].cookie = cookie;
+	l->v[l->n].tries = tries;
+	l->v[l->n].name = s;
+	l->n++;
+	return 0;
+}
+
+int inotree_path(int wd, const char *name, char *buf, size_t size)
+{
+	const char *names[INOTREE_MAX_DEPTH];
+	struct node *n;
+	size_t len = 0, l;
+	int depth = 0;
+
+	if (name && *name)
+		names[depth++] = name;
+	for (; wd; wd = n->parent) {
+		n = wd > 0 ? lookup(wd) : NULL;
+		if (!n || !n->name) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (depth == INOTREE_MAX_DEPTH)
+			goto too_long;
+		names[depth++] = n->name;
+	}
+	while (depth--) {
+		l = strlen(names[depth]);
+		if (len && buf[len - 1] != '/') {
+			if (len + 1 >= size)
+				goto too_long;
+			buf[len++] = '/';
+		}
+		if (len + l >= size)
+			goto too_long;
+		memcpy(buf + len, names[depth], l);
+		len += l;
+	}
+	if (!size)
+		goto too_long;
+	buf[len] = 0;
+	return len;
+
+too_long:
+	errno = ENAMETOOLONG;
+	return -1;
+}
+
+static int watch_dir(int dfd, const char *path, int parent, const char *name,
+		     int flags);
+
+/* Watch the subdirs of dir and report its entries if needed */
+static void scan_dir(int fd, int wd, int flags)
+{
+	char *buf = malloc(DENTS_BUF_SIZE);
+	struct dirent64 *de;
+	struct stat st;
+	ssize_t n, off;
+	int type;
+
+	if (!buf) {
+		perror("alloc dents buffer");
+		return;
+	}
+	inotree_stats.scanned++;
+	while ((n = getdents64(fd, buf, DENTS_BUF_SIZE)) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct dirent64 *)(buf + off);
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			type = de->d_type;
+			if (type == DT_UNKNOWN &&
+			    !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+			if ((flags & WATCH_REPORT) && found_fn) {
+				inotree_stats.found++;
+				found_fn(wd, de->d_name, type);
+			}
+			if (type != DT_DIR ||
+			    watch_dir(fd, de->d_name, wd, de->d_name, flags) >= 0 ||
+			    errno == ENOENT || errno == ENOTDIR)
+				continue;
+			if (errno != ENOSPC || !nospc++)
+				perror(de->d_name);
+		}
+	}
+	/* Dir may be removed before it is scanned */
+	if (n < 0 && errno != ENOENT)
+		perror("getdents64");
+	free(buf);
+}
+
+/*
+ * Watch dir at path relative to dfd as the child name of parent.
+ * Returns the wd or -1 with errno set.
+ */
+static int watch_dir(int dfd, const char *path, int parent, const char *name,
+		     int flags)
+{
+	char proc[32];
+	struct node *n;
+	int fd, wd, err = 0, new = 0;
+
+	fd = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	/* Watch the inode that we opened, wherever it is now */
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	wd = inotify_add_watch(inotify_fd, proc, watch_mask);
+	if (wd < 0) {
+		err = errno;
+		goto out;
+	}
+	n = lookup(wd);
+	if (!n) {
+		n = insert(wd);
+		if (!n) {
+			err = ENOMEM;
+			goto rm_watch;
+		}
+		new = 1;
+		inotree_stats.added++;
+	}
+	if (set_name(n, parent, name)) {
+		err = ENOMEM;
+		if (new)
+			goto rm_watch;
+		goto out;
+	}
+	if (new || (flags & WATCH_FULL))
+		scan_dir(fd, wd, new ? flags : flags & ~WATCH_REPORT);
+	goto out;
+
+rm_watch:
+	if (new)
+		remove_node(wd);
+	inotify_rm_watch(inotify_fd, wd);
+	wd = -1;
+out:
+	close(fd);
+	errno = err;
+	return wd;
+}
+
+static void new_dir(int parent, const char *name, int tries)
+{
+	char path[PATH_MAX];
+
+	if (inotree_path(parent, name, path, sizeof(path)) < 0)
+		return;
+	if (watch_dir(AT_FDCWD, path, parent, name, WATCH_REPORT) >= 0)
+		return;
+	if (errno == ENOENT || errno == ENOTDIR) {
+		/* Path may be stale until an ancestor rename is processed */
+		if (tries < INOTREE_RETRIES && !push(&pending, parent, 0, tries + 1, name)) {
+			if (!tries)
+				inotree_stats.retried++;
+		} else {
+			inotree_stats.gone++;
+		}
+		return;
+	}
+	if (errno != ENOSPC || !nospc++)
+		perror(path);
+}
+
+int inotree_init(int fd, uint32_t mask, inotree_fn found)
+{
+	inotify_fd = fd;
+	watch_mask = mask | INOTREE_MASK | IN_ONLYDIR;
+	found_fn = found;
+	table = calloc(INOTREE_MIN_SIZE, sizeof(*table));
+	if (!table) {
+		perror("alloc inotree table");
+		return -1;
+	}
+	table_mask = INOTREE_MIN_SIZE - 1;
+	return 0;
+}
+
+int inotree_add(const char *path)
+{
+	int wd = watch_dir(AT_FDCWD, path, 0, path, 0);
+
+	if (wd < 0)
+		perror(path);
+	return wd;
+}
+
+static struct node *find_child(int parent, const char *name)
+{
+	struct node *p = lookup(parent), *c;
+	int wd;
+
+	for (wd = p ? p->child : 0; wd && (c = lookup(wd)); wd = c->next) {
+		if (!strcmp(c->name, name))
+			return c;
+	}
+	return NULL;
+}
+
+void inotree_event(const struct inotify_event *ev)
+{
+	struct node *n;
+	int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		need_resync = 1;
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		if (remove_node(ev->wd))
+			inotree_stats.removed++;
+		return;
+	}
+	if (!(ev->mask & IN_ISDIR) || !ev->len || !lookup(ev->wd))
+		return;
+
+	if (ev->mask & IN_MOVED_FROM) {
+		/*
+		 * Resolve the moved dir now, before a new dir with the same
+		 * name is watched, and detach it until IN_MOVED_TO names it.
+		 */
+		n = find_child(ev->wd, ev->name);
+		if (!n)
+			return;
+		if (push(&moves, ev->wd, ev->cookie, 0, ev->name)) {
+			perror("alloc inotree move");
+			return;
+		}
+		moves.v[moves.n - 1].wd = n->wd;
+		unlink_child(n);
+		n->parent = DETACHED;
+		return;
+	}
+	if (ev->mask & IN_MOVED_TO) {
+		for (i = 0; i < moves.n; i++) {
+			if (moves.v[i].cookie != ev->cookie)
+				continue;
+			free(moves.v[i].name);
+			moves.v[i] = moves.v[--moves.n];
+			break;
+		}
+	}
+	/* A dir renamed in the tree keeps its wd and only gets a new name */
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		new_dir(ev->wd, ev->name, 0);
+}
+
+/* Entries are removed on IN_IGNORED, so the table does not change here */
+static void rm_watches(int wd, int depth)
+{
+	struct node *n = lookup(wd), *c;
+	int child;
+
+	if (!n || depth >= INOTREE_MAX_DEPTH)
+		return;
+	for (child = n->child; child && (c = lookup(child)); child = c->next)
+		rm_watches(child, depth + 1);
+	inotify_rm_watch(inotify_fd, wd);
+}
+
+/* Remove the watches of a dir that was moved out of the tree */
+static void move_out(int wd)
+{
+	struct node *top = lookup(wd);
+
+	/* Dir may be removed or renamed back into the tree meanwhile */
+	if (!top || top->parent != DETACHED)
+		return;
+	inotree_stats.moved_out++;
+	/* Until the entries are removed they have no path */
+	rm_watches(wd, 0);
+}
+
+static void resync(void)
+{
+	struct delayed_list roots = { NULL };
+	unsigned int i;
+	int j;
+
+	inotree_stats.resync++;
+	for (i = 0; i <= table_mask; i++) {
+		if (table[i].wd && !table[i].parent &&
+		    push(&roots, 0, 0, 0, table[i].name))
+			perror("alloc inotree root");
+	}
+	for (j = 0; j < roots.n; j++) {
+		if (watch_dir(AT_FDCWD, roots.v[j].name, 0, roots.v[j].name,
+			      WATCH_FULL | WATCH_REPORT) < 0)
+			perror(roots.v[j].name);
+		free(roots.v[j].name);
+	}
+	free(roots.v);
+}
+
+void inotree_flush(void)
+{
+	struct delayed_list retry = pending;
+	int i;
+
+	/* Moves whose IN_MOVED_TO was not seen in this batch */
+	for (i = 0; i < moves.n; i++) {
+		move_out(moves.v[i].wd);
+		free(moves.v[i].name);
+	}
+	moves.n = 0;
+
+	pending = (struct delayed_list){ NULL };
+	for (i = 0; i < retry.n; i++) {
+		new_dir(retry.v[i].parent, retry.v[i].name, retry.v[i].tries);
+		free(retry.v[i].name);
+	}
+	free(retry.v);
+
+	if (need_resync) {
+		need_resync = 0;
+		resync();
+	}
+}
+
+size_t inotree_mem(void)
+{
+	return (table_mask + 1) * sizeof(*table) + names_bytes;
+}
+
+void inotree_print_stats(void)
+{
+	printf("inotree: dirs=%d peak=%d added=%llu removed=%llu moved=%llu moved out=%llu scanned=%llu found=%llu retried=%llu gone=%llu resync=%llu table=%u slots mem=%zu KB\n",
+		inotree_stats.count, inotree_stats.peak, inotree_stats.added,
+		inotree_stats.removed, inotree_stats.moved,
+		inotree_stats.moved_out, inotree_stats.scanned,
+		inotree_stats.found, inotree_stats.retried, inotree_stats.gone,
+		inotree_stats.resync, table_mask + 1, inotree_mem() / 1024);
+}
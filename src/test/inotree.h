@@ -0,0 +1,80 @@
+#ifndef _INOTREE_H
+#define _INOTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+/*
+ * Recursive inotify watches with a wd to (parent wd, name) table.
+ *
+ * The table is open addressed with linear probing and indexed by wd, so
+ * the path of any watched dir is built by walking up the parent wds and
+ * renamed dirs only need their own entry updated. Every entry also links
+ * the entries of its child dirs, so a moved dir and the dirs under it are
+ * found without a scan of the table.
+ *
+ * A new dir is opened by its path built from the table (subdirs found by
+ * a scan are opened relative to the fd of the scanned dir) and the watch
+ * is added on the opened fd via /proc/self/fd, so the watch and the scan
+ * that follows are on the same inode, even if the dir is renamed
+ * meanwhile. The scan watches the subdirs and reports the entries that may
+ * have been created before the watch was armed, so they are not missed.
+ * Entries that are created after the watch was armed may be reported twice.
+ *
+ * New dirs whose path is stale (an ancestor was renamed and the rename
+ * event is not processed yet) are retried for a few batches. A dir is
+ * detached from its parent on IN_MOVED_FROM, and its watches are removed
+ * if no IN_MOVED_TO moved it back into the tree in the same batch. Table
+ * entries are removed on IN_IGNORED.
+ *
+ * Requires /proc to be mounted.
+ */
+#define INOTREE_RETRIES 3
+
+/* Events that are always watched to keep the table up to date */
+#define INOTREE_MASK (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct inotree_stats {
+	unsigned long long added;	/* watches added */
+	unsigned long long removed;	/* IN_IGNORED */
+	unsigned long long moved;	/* dirs renamed in the tree */
+	unsigned long long moved_out;	/* dirs moved out of the tree */
+	unsigned long long scanned;	/* dirs listed */
+	unsigned long long found;	/* entries reported by scans */
+	unsigned long long retried;	/* new dirs with a stale path */
+	unsigned long long gone;	/* new dirs not found after retries */
+	unsigned long long resync;	/* full rescans after overflow */
+	int count, peak;
+};
+
+extern struct inotree_stats inotree_stats;
+
+/* Entry found by the scan of a new dir (type is DT_*) */
+typedef void (*inotree_fn)(int wd, const char *name, unsigned char type);
+
+/* Watch dirs with mask on inotify fd and report scanned entries to found */
+int inotree_init(int fd, uint32_t mask, inotree_fn found);
+
+/* Watch the tree at path, returns the root wd or -1 */
+int inotree_add(const char *path);
+
+/* Update the table with an event */
+void inotree_event(const struct inotify_event *ev);
+
+/*
+ * Call after every batch of events: retries new dirs with a stale path,
+ * removes watches of dirs that were moved out of the tree and rescans the
+ * trees after IN_Q_OVERFLOW.
+ */
+void inotree_flush(void);
+
+/* Build the path of wd (and name if not NULL), returns length or -1 */
+int inotree_path(int wd, const char *name, char *buf, size_t size);
+
+/* Memory used by the table and names */
+size_t inotree_mem(void);
+
+void inotree_print_stats(void);
+
+#endif
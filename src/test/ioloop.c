@@ -13,6 +13,7 @@
 #include <libgen.h>
 #include <string.h>
 #include <errno.h>
+#include "lathist.h"
 
 #define MAX_LEN 1024
 
@@ -35,6 +36,26 @@ static int io_loop(int fd, file_op op, size_t len, int count)
 	return 0;
 }
 
+/* Latency of open() as seen by the caller, e.g. with a permission listener */
+static int open_loop(const char *path, int count)
+{
+	static struct lat_hist hist;
+	uint64_t t;
+	int fd;
+
+	while (count--) {
+		t = lat_now_ns();
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return -1;
+		lat_hist_add(&hist, lat_now_ns() - t);
+		close(fd);
+	}
+
+	lat_hist_print("open", &hist);
+	return 0;
+}
+
 void main(int argc, char *argv[])
 {
 	const char *progname = basename(argv[0]);
@@ -55,6 +76,9 @@ void main(int argc, char *argv[])
 		mode = "write";
 		flags = O_WRONLY|O_CREAT;
 		op = do_write;
+	} else if (argc > 3 && argv[3][0] == 'o') {
+		mode = "open";
+		op = NULL;
 	}
 
 	if (argc > 4)
@@ -71,7 +95,7 @@ void main(int argc, char *argv[])
 
 	printf("%s count=%d len=%d op=%s\n", progname, count, len, mode);
 
-	if (io_loop(fd, op, len, count))
+	if (op ? io_loop(fd, op, len, count) : open_loop(argv[1], count))
 		perror(mode);
 
 	close(fd);
@@ -4,6 +4,7 @@
  * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
  */
 
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -14,7 +15,10 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "iter.h"
+#include "lathist.h"
 
 int tree_id = 0;
 int tree_depth;
@@ -26,9 +30,26 @@ char *file_prefix = "f";
 char *dir_prefix = "d";
 int data_seed = 0;
 int keep_data = 0;
+int seekable_data = 0;
+int max_errors = 1;
+int clone_percent = 0;
+int direct_io = 0;
+int io_size = 0;
+int generic_rm = 0;
+int incremental = 0;
+int lat_enabled = 0;
+int progress_secs = 0;
+char *lat_json;
+char *checkpoint_file;
+int shard_index = 0;
+int shard_count = 1;
 int copy_root_acls = 0;
 int copy_root_mtime = 0;
 int dry_run = 0;
+int iter_threads = 1;
+int uring_depth = 0;
+int (*iter_flush)(void);
+int (*iter_drain)(void);
 int trace_depth = 0;
 int xid = 0;
 int node_id_log16;
@@ -40,8 +61,13 @@ int file_blocks;
 xid_t start_id = 0;
 xid_t end_id = LLONG_MAX;
 
-char rel_path[PATH_MAX];
-static char *base = rel_path;
+__thread char rel_path[PATH_MAX];
+static __thread int rel_len;
+
+__thread xid_t iter_seq;
+volatile int iter_stopped;
+__thread struct iter_stats iter_stats;
+struct iter_stats iter_total;
 
 void iter_usage()
 {
@@ -54,12 +80,31 @@ void iter_usage()
 	fprintf(stderr, "-x <start global id>  (default = 0, id in hexa as printed by -v deepest trace prints)\n");
 	fprintf(stderr, "-X <end global id>  (default = MAX, id in hexa as printed by -v deepest trace prints)\n");
 	fprintf(stderr, "-N <tree prefix id>   (prefix id in hexa for all global ids, implies -x)\n");
-	fprintf(stderr, "-s <data type/seed> [-k] (default = 0)\n");
+	fprintf(stderr, "-j <threads>          (default = 1, split tree to subtree tasks for parallel workers)\n");
+	fprintf(stderr, "-K <checkpoint file>  (record completed subtree tasks and resume from them on restart)\n");
+	fprintf(stderr, "-S <shard>/<shards>   (only iterate shard 0..shards-1 of subtree tasks, balanced by files)\n");
+	fprintf(stderr, "-u <io_uring depth>   (default = 0, number of files created/removed in flight with io_uring)\n");
+	fprintf(stderr, "-s <data type/seed> [-k] [-R] [-F <shared %%>] [-D] [-I <io size KB>] (default = 0)\n");
 	fprintf(stderr, "data type/seed may be 0 (default) for fallocate, < 0 for sparse file and > 0 for seed of random data\n");
 	fprintf(stderr, "By default, existing file is truncated to zero before its data is allocated and initialized.\n");
 	fprintf(stderr, "With -k option, an existing file is not truncated and allocated blocks are kept in the file.\n");
 	fprintf(stderr, "random data overwrites existing data, but fallocate and ftruncate do not zero out existing data.\n");
+	fprintf(stderr, "With -R option, random data of every file block is generated from file id and block offset,\n");
+	fprintf(stderr, "so any block can be regenerated independently (not compatible with data created without -R).\n");
+	fprintf(stderr, "With -F <shared %%> option, the shared %% of every file blocks are cloned from a golden file\n");
+	fprintf(stderr, "(FICLONERANGE or copy_file_range) and only the rest is written (implies -R).\n");
+	fprintf(stderr, "With -D option, random data is written with O_DIRECT from aligned buffers, bypassing page cache.\n");
+	fprintf(stderr, "With -I <io size KB> option, generated blocks are batched and written with a single pwritev()\n");
+	fprintf(stderr, "of up to io size (default = 1024 with -D and file size block size otherwise).\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "-i incremental, only create missing entries and repair entries that differ from spec\n");
+	fprintf(stderr, "   (file size, allocated blocks with -s 0, xid and ACL xattrs and mtime with -M)\n");
+	fprintf(stderr, "-G generic rmtree, list dirs with getdents64 and remove all entries with -j workers\n");
+	fprintf(stderr, "   (with -x/-X/-N/-v, only the subtrees in range are removed, including extra entries)\n");
+	fprintf(stderr, "-L print per syscall latency histograms summary\n");
+	fprintf(stderr, "-J <json file>        (write latency summary as JSON, implies -L)\n");
+	fprintf(stderr, "-P <seconds>          (default = 0, print progress and ETA every interval)\n");
+	fprintf(stderr, "-E <max errors>       (default = 1, verifytree stops after max mismatches, 0 for no limit)\n");
 	fprintf(stderr, "-A copy ACLs from dirtree root to files and dirs\n");
 	fprintf(stderr, "-M copy mtime from dirtree root to files mtime/atime\n");
 	fprintf(stderr, "-n dry-run\n");
@@ -69,7 +114,7 @@ int iter_parseopt(int argc, char *argv[])
 {
 	int c;
 
-	while ((c = getopt(argc, argv, "AMc:C:w:s:f:d:v:x:X:N:kn")) != -1) {
+	while ((c = getopt(argc, argv, "AMc:C:w:s:f:d:v:x:X:N:j:u:E:F:I:J:P:K:S:kRDGLin")) != -1) {
 		switch (c) {
 			case 'A':
 				copy_root_acls = 1;
@@ -97,6 +142,45 @@ int iter_parseopt(int argc, char *argv[])
 			case 'k':
 				keep_data = 1;
 				break;
+			case 'E':
+				max_errors = atoi(optarg);
+				break;
+			case 'F':
+				clone_percent = atoi(optarg);
+				if (clone_percent < 0 || clone_percent > 100) {
+					fprintf(stderr, "illegal shared percent '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'I':
+				io_size = atoi(optarg);
+				if (io_size <= 0) {
+					fprintf(stderr, "illegal io size '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'L':
+				lat_enabled = 1;
+				break;
+			case 'J':
+				lat_json = optarg;
+				lat_enabled = 1;
+				break;
+			case 'P':
+				progress_secs = atoi(optarg);
+				break;
+			case 'i':
+				incremental = 1;
+				break;
+			case 'G':
+				generic_rm = 1;
+				break;
+			case 'D':
+				direct_io = 1;
+				break;
+			case 'R':
+				seekable_data = 1;
+				break;
 			case 'n':
 				dry_run = 1;
 				break;
@@ -123,6 +207,39 @@ int iter_parseopt(int argc, char *argv[])
 				tree_id = strtoll(optarg, NULL, 16);
 				xid = 1;
 				break;
+			case 'u':
+				uring_depth = atoi(optarg);
+				if (uring_depth < 0)
+					uring_depth = 0;
+				break;
+			case 'j':
+				iter_threads = atoi(optarg);
+				if (iter_threads < 1)
+					iter_threads = 1;
+				break;
+			case 'K':
+				/* Tools may chdir to tree root before iteration */
+				checkpoint_file = malloc(PATH_MAX);
+				if (!checkpoint_file ||
+				    (optarg[0] != '/' && !getcwd(checkpoint_file, PATH_MAX))) {
+					perror(optarg);
+					return -1;
+				}
+				if (optarg[0] == '/')
+					checkpoint_file[0] = 0;
+				else
+					strcat(checkpoint_file, "/");
+				strncat(checkpoint_file, optarg,
+					PATH_MAX - strlen(checkpoint_file) - 1);
+				break;
+			case 'S':
+				if (sscanf(optarg, "%d/%d", &shard_index, &shard_count) != 2 ||
+				    shard_count < 1 || shard_index < 0 ||
+				    shard_index >= shard_count) {
+					fprintf(stderr, "illegal shard '%s'\n", optarg);
+					return -1;
+				}
+				break;
 			default:
 				fprintf(stderr, "illegal option '%s'\n", argv[optind]);
 			case 'h':
@@ -159,7 +276,191 @@ static int skip_id(int depth, xid_t id)
 	return (((id < start_id) || id > end_id) && (tabs == (trace_depth - 1)));
 }
 
-static int iter_names(iter_op op, int depth, xid_t parent)
+/* Every thread records into its own histograms and merges them at exit */
+static const char *lat_names[LAT_MAX] = {
+	[LAT_OP] = "op",
+	[LAT_MKDIR] = "mkdir",
+	[LAT_OPEN] = "open",
+	[LAT_TRUNCATE] = "truncate",
+	[LAT_FALLOCATE] = "fallocate",
+	[LAT_WRITE] = "write",
+	[LAT_READ] = "read",
+	[LAT_STAT] = "stat",
+	[LAT_XATTR] = "xattr",
+	[LAT_UTIMES] = "utimes",
+	[LAT_CLOSE] = "close",
+	[LAT_UNLINK] = "unlink",
+	[LAT_RMDIR] = "rmdir",
+	[LAT_MARK] = "mark",
+};
+
+static __thread struct lat_hist lat_hist[LAT_MAX];
+static struct lat_hist lat_total[LAT_MAX];
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t iter_now_ns(void)
+{
+	return lat_now_ns();
+}
+
+void lat_record(int class, uint64_t ns)
+{
+	lat_hist_add(&lat_hist[class], ns);
+}
+
+/* Merge histograms of this thread into the totals */
+void lat_merge(void)
+{
+	int i;
+
+	if (!lat_enabled)
+		return;
+
+	pthread_mutex_lock(&lat_lock);
+	for (i = 0; i < LAT_MAX; i++)
+		lat_hist_merge(&lat_total[i], &lat_hist[i]);
+	pthread_mutex_unlock(&lat_lock);
+	memset(lat_hist, 0, sizeof(lat_hist));
+}
+
+/* Print p50/p99/p999 of all classes of merged histograms (in usec) */
+void lat_report(void)
+{
+	FILE *json = NULL;
+	struct lat_hist *h;
+	int i, n = 0;
+
+	if (!lat_enabled)
+		return;
+
+	if (lat_json) {
+		json = fopen(lat_json, "w");
+		if (!json)
+			perror(lat_json);
+	}
+	if (json)
+		fprintf(json, "{\n");
+
+	for (i = 0; i < LAT_MAX; i++) {
+		h = &lat_total[i];
+		if (!h->count)
+			continue;
+		lat_hist_print(lat_names[i], h);
+		if (json)
+			fprintf(json, "%s  \"%s\": { \"count\": %llu, \"p50_us\": %.1f, "
+				"\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f }",
+				n++ ? ",\n" : "", lat_names[i],
+				(unsigned long long)h->count,
+				lat_percentile(h, 0.5), lat_percentile(h, 0.99),
+				lat_percentile(h, 0.999), h->max / 1000.0);
+	}
+
+	if (json) {
+		fprintf(json, "\n}\n");
+		fclose(json);
+	}
+	memset(lat_total, 0, sizeof(lat_total));
+}
+
+/*
+ * Progress (-P) is published by every thread into shared counters in
+ * batches of PROGRESS_BATCH entries and printed by a progress thread.
+ */
+#define PROGRESS_BATCH 64
+
+static struct iter_stats progress;
+static __thread struct iter_stats published;
+static xid_t progress_total;
+static pthread_t progress_tid;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int progress_stop;
+
+static void progress_publish(int force)
+{
+	xid_t files = iter_stats.files - published.files;
+	xid_t dirs = iter_stats.dirs - published.dirs;
+
+	if (!progress_secs || (!force && files + dirs < PROGRESS_BATCH))
+		return;
+
+	__sync_add_and_fetch(&progress.files, files);
+	__sync_add_and_fetch(&progress.dirs, dirs);
+	__sync_add_and_fetch(&progress.bytes, iter_stats.bytes - published.bytes);
+	published = iter_stats;
+}
+
+static void print_progress(struct iter_stats *now, struct iter_stats *last,
+			   double interval, double secs)
+{
+	xid_t done = now->files + now->dirs;
+	xid_t ops = done - last->files - last->dirs;
+	double eta = done ? (progress_total - done) * secs / done : 0;
+
+	fprintf(stderr, "progress %.0fs: files=%lld dirs=%lld (%.1f%%) %.0f ops/s %.1f MB/s eta=%.0fs\n",
+		secs, now->files, now->dirs,
+		progress_total ? 100.0 * done / progress_total : 0,
+		ops / interval, (now->bytes - last->bytes) / interval / (1024 * 1024),
+		eta > 0 ? eta : 0);
+}
+
+static void *progress_thread(void *arg)
+{
+	struct iter_stats now, last = { 0 };
+	struct timespec deadline;
+	uint64_t start = iter_now_ns();
+	double secs, prev = 0;
+
+	pthread_mutex_lock(&progress_lock);
+	while (!progress_stop) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += progress_secs;
+		pthread_cond_timedwait(&progress_cond, &progress_lock, &deadline);
+		if (progress_stop)
+			break;
+		now.files = __atomic_load_n(&progress.files, __ATOMIC_RELAXED);
+		now.dirs = __atomic_load_n(&progress.dirs, __ATOMIC_RELAXED);
+		now.bytes = __atomic_load_n(&progress.bytes, __ATOMIC_RELAXED);
+		secs = (iter_now_ns() - start) / 1e9;
+		print_progress(&now, &last, secs - prev, secs);
+		last = now;
+		prev = secs;
+	}
+	pthread_mutex_unlock(&progress_lock);
+	return NULL;
+}
+
+static void progress_start(xid_t total)
+{
+	int ret;
+
+	progress_total = total;
+	memset(&progress, 0, sizeof(progress));
+	memset(&published, 0, sizeof(published));
+	progress_stop = 0;
+	ret = pthread_create(&progress_tid, NULL, progress_thread, NULL);
+	if (ret) {
+		errno = ret;
+		perror("progress thread");
+		progress_secs = 0;
+	}
+}
+
+static void progress_finish(void)
+{
+	if (!progress_secs)
+		return;
+
+	pthread_mutex_lock(&progress_lock);
+	progress_stop = 1;
+	pthread_cond_signal(&progress_cond);
+	pthread_mutex_unlock(&progress_lock);
+	pthread_join(progress_tid, NULL);
+}
+
+static int skip_top_files(int depth);
+
+static int iter_names(iter_op op, int dirfd, int depth, xid_t parent)
 {
 	int ret;
 	int i, start = depth ? 0 : leaf_start;
@@ -169,18 +470,25 @@ static int iter_names(iter_op op, int depth, xid_t parent)
 
 	name[NAME_MAX] = 0;
 iter_files:
-	for (i = start; i < count; i++) {
+	for (i = start; i < count && !iter_stopped; i++) {
 		id = create_name(name, NAME_MAX, depth, parent, i);
 		if (skip_id(depth, id))
 			continue;
-		ret = op(name, depth, id);
+		ret = LAT(LAT_OP, op(dirfd, name, depth, id));
+		if (!depth)
+			iter_seq++;
 		if (ret && errno != EEXIST && errno != ENOENT) {
 			perror(name);
 			return ret;
 		}
+		if (!ret && depth)
+			iter_stats.dirs++;
+		else if (!ret)
+			iter_stats.files++;
+		progress_publish(0);
 	}
 
-	if (depth && node_count) {
+	if (depth && node_count && !skip_top_files(depth)) {
 		depth = 0;
 		parent += count;
 		count = node_count;
@@ -209,8 +517,8 @@ static int trace_begin(char *name, int depth, xid_t id)
 	int tabs = tree_depth - abs(depth);
 	int len, ret = 0;
 
-	len = sprintf(base, "%s/", name);
-	base += len;
+	len = sprintf(rel_path + rel_len, "%s/", name);
+	rel_len += len;
 
 	if (tabs >= trace_depth)
 		return len;
@@ -225,15 +533,559 @@ static int trace_begin(char *name, int depth, xid_t id)
 
 static void trace_end(char *name, int depth, int ret, int len)
 {
-	base -= len;
-	base[0] = 0;
+	rel_len -= len;
+	rel_path[rel_len] = 0;
 	if (ret < 0) trace_print(name, depth, ret);
 }
 
-int iter_dirs(iter_op op, int depth, xid_t parent)
+/*
+ * Parallel iteration: the top split_level levels of the tree are iterated
+ * by the main thread and every directory at split_level becomes a subtree
+ * task, keyed by its xid. Tasks are handed out to workers in contiguous
+ * chunks, so each worker walks a neighbourhood of the tree, and an idle
+ * worker steals tasks from the tail of a busy worker's chunk.
+ *
+ * Each task also carries the serial index of its first file (iter_seq),
+ * so ops can produce the same per-file content as a single threaded run.
+ */
+struct iter_task {
+	char *path;		/* subtree root relative to tree root */
+	int depth;		/* iter depth of subtree root */
+	xid_t parent;		/* parent id of subtree root entries */
+	xid_t seq;		/* serial index of first file in subtree */
+	xid_t nfiles;		/* number of files in subtree */
+};
+
+struct iter_worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int id;
+	int head, tail;		/* remaining tasks of this worker */
+	int ntasks, nstolen;
+	int ret;
+	double secs;
+	struct iter_stats stats;
+};
+
+int iter_dirs(iter_op op, int dirfd, int depth, xid_t parent);
+
+static iter_op task_op;
+static int root_fd = -1;
+static int split_level;
+static struct iter_task *tasks, *next_task;
+static int ntasks, max_tasks;
+static struct iter_worker *workers;
+static volatile int iter_abort;
+
+/*
+ * With -K, the longest prefix of completed tasks is recorded in a checkpoint
+ * file after syncing the filesystem, so a restarted run skips the tasks whose
+ * entries are already on disk. With -S, every shard runs a contiguous range
+ * of tasks. The split level with -K or -S depends only on the tree geometry,
+ * so it is the same for any number of threads, processes and hosts.
+ */
+#define CHECKPOINT_TASKS 1024
+#define CHECKPOINT_SECS 10
+
+static int task_lo, task_hi;	/* range of tasks to run */
+static char *task_done;
+static int tasks_done;		/* all tasks in range before it are done */
+static uint64_t checkpoint_time;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Node files above subtree tasks are created only by shard 0 */
+static int skip_top_files(int depth)
+{
+	return shard_index && split_level && tree_depth - abs(depth) < split_level;
+}
+
+/* Does iteration of dir at depth stop at subtree tasks? */
+static int cut_tasks(int depth)
+{
+	return split_level && tree_depth - abs(depth) + 1 == split_level;
+}
+
+/* Number of files in subtree at depth (>= 0) if no ids are skipped */
+static xid_t subtree_files(int depth)
+{
+	if (!depth)
+		return leaf_count - leaf_start;
+
+	return node_count + tree_width * subtree_files(depth - 1);
+}
+
+/* Number of dirs in subtree at depth (>= 0), including skipped dirs */
+static xid_t subtree_dirs(int depth)
+{
+	if (!depth)
+		return 0;
+
+	return tree_width * (1 + subtree_dirs(depth - 1));
+}
+
+/* Number of files that iter_names() visits in dir at depth (>= 0) */
+static xid_t count_names(int depth, xid_t parent)
+{
+	int i, start = depth ? 0 : leaf_start;
+	int count = depth ? node_count : leaf_count;
+	xid_t n = 0;
+
+	if (depth)
+		parent += tree_width;
+	for (i = start; i < count; i++) {
+		if (!skip_id(0, xid ? parent + i : 0))
+			n++;
+	}
+	return n;
+}
+
+/* Number of files that iter_dirs() visits in subtree at depth (>= 0) */
+static xid_t count_files(int depth, xid_t parent)
+{
+	int i, next_id_log16 = depth > 1 ? node_id_log16 : leaf_id_log16;
+	xid_t n, id;
+
+	/* No ids are skipped below trace depth */
+	if (tree_depth - depth >= trace_depth)
+		return subtree_files(depth);
+
+	n = count_names(depth, parent);
+	for (i = 0; depth && i < tree_width; i++) {
+		id = xid ? parent + i : 0;
+		if (!skip_id(depth, id))
+			n += count_files(depth - 1, id << (next_id_log16*4));
+	}
+	return n;
+}
+
+static int add_task(const char *path, int depth, xid_t parent, xid_t seq)
+{
+	struct iter_task *task;
+
+	if (ntasks == max_tasks) {
+		max_tasks = max_tasks ? max_tasks * 2 : 1024;
+		task = realloc(tasks, max_tasks * sizeof(*task));
+		if (!task) {
+			perror("alloc tasks");
+			return -1;
+		}
+		tasks = task;
+	}
+
+	task = &tasks[ntasks++];
+	task->path = strdup(path);
+	task->depth = depth;
+	task->parent = parent;
+	task->seq = seq;
+	task->nfiles = count_files(abs(depth), parent);
+	return task->path ? 0 : -1;
+}
+
+/* Collect subtree tasks in the same order that iter_dirs() visits them */
+static int plan_tasks(char *path, int len, int depth, xid_t parent, xid_t *seq)
+{
+	int i, n, ret = 0;
+	int next_depth = depth > 0 ? depth - 1 : depth + 1;
+	int next_id_log16 = next_depth ? node_id_log16 : leaf_id_log16;
+	char name[NAME_MAX+1];
+	xid_t id;
+
+	if (depth >= 0) // BFS
+		*seq += count_names(depth, parent);
+
+	for (i = 0; !ret && i < tree_width; i++) {
+		id = create_name(name, NAME_MAX, 1, parent, i);
+		if (skip_id(depth, id))
+			continue;
+
+		n = snprintf(path + len, PATH_MAX - len, "%s/", name);
+		if (n >= PATH_MAX - len) {
+			fprintf(stderr, "path too long: %s\n", path);
+			return -1;
+		}
+		if (cut_tasks(depth)) {
+			ret = add_task(path, next_depth, id << (next_id_log16*4), *seq);
+			if (!ret)
+				*seq += tasks[ntasks-1].nfiles;
+		} else {
+			ret = plan_tasks(path, len + n, next_depth,
+					 id << (next_id_log16*4), seq);
+		}
+	}
+	path[len] = 0;
+
+	if (depth < 0) // DFS
+		*seq += count_names(-depth, parent);
+
+	return ret;
+}
+
+/*
+ * Number of entries in the top dirs and in the tasks in range. Skipped dirs
+ * are counted, so ETA may be pessimistic with -x/-X.
+ */
+static xid_t progress_tasks(xid_t root)
+{
+	xid_t files = count_files(tree_depth, root);
+	xid_t dirs = subtree_dirs(tree_depth);
+	xid_t task_dirs = ntasks ? subtree_dirs(abs(tasks[0].depth)) : 0;
+	int t;
+
+	for (t = 0; t < ntasks; t++)
+		files -= tasks[t].nfiles;
+	dirs -= ntasks * task_dirs;
+	if (shard_index)
+		files = 0;
+
+	/* With -K, task_lo is after the tasks that are already done */
+	for (t = task_lo; t < task_hi; t++)
+		files += tasks[t].nfiles;
+	return files + dirs + (task_hi - task_lo) * task_dirs;
+}
+
+/* First task of shard, so that shards have about the same number of files */
+static int shard_bound(int shard)
+{
+	xid_t total = 0, n = 0;
+	int t;
+
+	if (shard >= shard_count)
+		return ntasks;
+
+	for (t = 0; t < ntasks; t++)
+		total += tasks[t].nfiles;
+	if (!total)
+		return (long long)ntasks * shard / shard_count;
+
+	for (t = 0; t < ntasks && n * shard_count < total * shard; t++)
+		n += tasks[t].nfiles;
+	return t;
+}
+
+static int read_checkpoint(void)
+{
+	int level, n, shard, shards, done, ret;
+	FILE *f = fopen(checkpoint_file, "r");
+
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		perror(checkpoint_file);
+		return -1;
+	}
+
+	ret = fscanf(f, "split_level=%d\nntasks=%d\nshard=%d/%d\ntasks_done=%d\n",
+		     &level, &n, &shard, &shards, &done);
+	fclose(f);
+	if (ret != 5 || level != split_level || n != ntasks ||
+	    shard != shard_index || shards != shard_count ||
+	    done < task_lo || done > task_hi) {
+		fprintf(stderr, "checkpoint %s does not match tree\n", checkpoint_file);
+		return -1;
+	}
+
+	task_lo = done;
+	return 0;
+}
+
+/* Sync completed entries to disk before recording them in checkpoint */
+static int write_checkpoint(void)
+{
+	char tmp[PATH_MAX + 8];
+	FILE *f;
+	int fd, ret;
+
+	fd = openat(root_fd, ".", O_RDONLY|O_DIRECTORY);
+	if (fd < 0 || syncfs(fd)) {
+		perror("syncfs");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_file);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return -1;
+	}
+	fprintf(f, "split_level=%d\nntasks=%d\nshard=%d/%d\ntasks_done=%d\nlast_done=%s\n",
+		split_level, ntasks, shard_index, shard_count, tasks_done,
+		tasks_done ? tasks[tasks_done - 1].path : "");
+	ret = fflush(f) || fsync(fileno(f));
+	if (fclose(f) || ret || rename(tmp, checkpoint_file)) {
+		perror(checkpoint_file);
+		return -1;
+	}
+	return 0;
+}
+
+static void task_complete(struct iter_task *task)
+{
+	uint64_t now = iter_now_ns();
+
+	pthread_mutex_lock(&checkpoint_lock);
+	task_done[task - tasks] = 1;
+	while (tasks_done < task_hi && task_done[tasks_done])
+		tasks_done++;
+	if (now - checkpoint_time >= CHECKPOINT_SECS * 1000000000ULL) {
+		checkpoint_time = now;
+		write_checkpoint();
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+static struct iter_task *get_task(struct iter_worker *w)
+{
+	struct iter_worker *v;
+	int i, t = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail)
+		t = w->head++;
+	pthread_mutex_unlock(&w->lock);
+
+	/* Steal from the tail of another worker's chunk */
+	for (i = 1; t < 0 && i < iter_threads; i++) {
+		v = &workers[(w->id + i) % iter_threads];
+		pthread_mutex_lock(&v->lock);
+		if (v->head < v->tail)
+			t = --v->tail;
+		pthread_mutex_unlock(&v->lock);
+		if (t >= 0)
+			w->nstolen++;
+	}
+
+	return t < 0 ? NULL : &tasks[t];
+}
+
+/* Open subtree root or nearest existing ancestor like iter_dirs() does */
+static int open_task_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *p;
+	int fd;
+
+	strcpy(dir, path);
+	for (;;) {
+		fd = openat(root_fd, dir, O_PATH|O_DIRECTORY);
+		if (fd >= 0 || errno != ENOENT)
+			break;
+		/* Strip trailing slash and last component */
+		p = dir + strlen(dir) - 1;
+		*p = 0;
+		p = strrchr(dir, '/');
+		if (!p)
+			return root_fd;
+		p[1] = 0;
+	}
+	if (fd < 0)
+		perror(path);
+	return fd;
+}
+
+static int run_task(struct iter_task *task)
+{
+	int fd, ret;
+
+	fd = open_task_dir(task->path);
+	if (fd < 0)
+		return fd;
+
+	rel_len = sprintf(rel_path, "%s", task->path);
+	iter_seq = task->seq;
+	ret = iter_dirs(task_op, fd, task->depth, task->parent);
+	if (ret)
+		fprintf(stderr, "task %s ABORTED!\n", task->path);
+	if (fd != root_fd)
+		close(fd);
+	return ret;
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *iter_worker(void *arg)
+{
+	struct iter_worker *w = arg;
+	struct iter_task *task;
+	struct timespec start;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!iter_abort && !iter_stopped && (task = get_task(w))) {
+		w->ntasks++;
+		ret = run_task(task);
+		/* Do not record a task whose writes may still fail */
+		if (!ret && checkpoint_file && iter_drain)
+			ret = iter_drain();
+		if (ret) {
+			w->ret = ret;
+			iter_abort = 1;
+		} else if (checkpoint_file && !iter_stopped) {
+			task_complete(task);
+		}
+	}
+	if (iter_flush && iter_flush() && !w->ret) {
+		w->ret = -1;
+		iter_abort = 1;
+	}
+	w->secs = elapsed(&start);
+	w->stats = iter_stats;
+	progress_publish(1);
+	lat_merge();
+	return NULL;
+}
+
+static void print_stats(const char *who, struct iter_stats *stats, double secs)
+{
+	if (secs <= 0)
+		secs = 1e-9;
+	printf("%s files=%lld dirs=%lld (%.0f files/s, %.1f MB/s)\n", who,
+		stats->files, stats->dirs, stats->files / secs,
+		stats->bytes / secs / (1024 * 1024));
+}
+
+static void add_stats(struct iter_stats *to, struct iter_stats *from)
+{
+	to->files += from->files;
+	to->dirs += from->dirs;
+	to->bytes += from->bytes;
+}
+
+static int run_workers(void)
+{
+	struct iter_stats total = { 0 };
+	struct timespec start;
+	char who[64];
+	int i, ret = 0;
+
+	workers = calloc(iter_threads, sizeof(*workers));
+	if (!workers) {
+		perror("alloc workers");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iter_threads; i++) {
+		struct iter_worker *w = &workers[i];
+
+		w->id = i;
+		w->head = task_lo + (long long)(task_hi - task_lo) * i / iter_threads;
+		w->tail = task_lo + (long long)(task_hi - task_lo) * (i + 1) / iter_threads;
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	for (i = 0; i < iter_threads; i++) {
+		ret = pthread_create(&workers[i].thread, NULL, iter_worker, &workers[i]);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			iter_abort = 1;
+			break;
+		}
+	}
+	while (i--) {
+		struct iter_worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		if (w->ret)
+			ret = w->ret;
+		add_stats(&total, &w->stats);
+	}
+
+	for (i = 0; i < iter_threads; i++) {
+		struct iter_worker *w = &workers[i];
+
+		snprintf(who, sizeof(who), "thread %d: tasks=%d stolen=%d",
+			 i, w->ntasks, w->nstolen);
+		print_stats(who, &w->stats, w->secs);
+		pthread_mutex_destroy(&w->lock);
+	}
+	print_stats("total:", &total, elapsed(&start));
+	add_stats(&iter_total, &total);
+
+	if (checkpoint_file && write_checkpoint() && !ret)
+		ret = -1;
+
+	free(workers);
+	return ret;
+}
+
+static int iter_parallel(iter_op op, int dirfd, int depth, xid_t root)
+{
+	char path[PATH_MAX] = "";
+	xid_t seq = 0;
+	int i, ret;
+
+	/* Split to at least 8 tasks per worker, so stealing can balance */
+	int min_tasks = iter_threads * 8;
+
+	if (checkpoint_file || shard_count > 1)
+		min_tasks = CHECKPOINT_TASKS;
+	split_level = 1;
+	for (i = tree_width; split_level < tree_depth && i < min_tasks; i *= tree_width)
+		split_level++;
+
+	ret = plan_tasks(path, 0, depth, root, &seq);
+	printf("split_level=%d,tasks=%d,threads=%d\n", split_level, ntasks, iter_threads);
+
+	task_op = op;
+	root_fd = dirfd;
+	task_lo = shard_bound(shard_index);
+	task_hi = shard_bound(shard_index + 1);
+	if (!ret && checkpoint_file) {
+		task_done = calloc(ntasks, 1);
+		ret = task_done ? read_checkpoint() : -1;
+		tasks_done = task_lo;
+		checkpoint_time = iter_now_ns();
+	}
+	if (checkpoint_file || shard_count > 1)
+		printf("shard=%d/%d,first_task=%d,end_task=%d,first_path=%s\n",
+			shard_index, shard_count, task_lo, task_hi,
+			task_lo < task_hi ? tasks[task_lo].path : "");
+	if (progress_secs)
+		progress_start(progress_tasks(root));
+
+	if (!ret && depth < 0) // DFS
+		ret = run_workers();
+	/* Top dirs are not empty until all shards are done */
+	if (!ret && depth < 0 && shard_count > 1)
+		goto out;
+	if (!ret) {
+		next_task = tasks;
+		iter_seq = 0;
+		ret = iter_dirs(op, dirfd, depth, root);
+	}
+	if (!ret && depth >= 0) // BFS
+		ret = run_workers();
+
+out:
+	free(task_done);
+	task_done = NULL;
+	for (i = 0; i < ntasks; i++)
+		free(tasks[i].path);
+	free(tasks);
+	tasks = next_task = NULL;
+	ntasks = max_tasks = 0;
+	split_level = 0;
+	return ret;
+}
+
+/*
+ * Iterate the subtree under dirfd. Child directories are opened with O_PATH
+ * relative to their parent and every op is called with the parent dirfd, so
+ * the walk never changes the process cwd.
+ */
+int iter_dirs(iter_op op, int dirfd, int depth, xid_t parent)
 {
 	int len, ret = 0;
-	int fd = open(".", O_PATH);
+	int fd;
 	int i, count = tree_width;
 	char name[NAME_MAX+1];
 	int next_depth = depth > 0 ? depth - 1 : depth + 1;
@@ -242,46 +1094,49 @@ int iter_dirs(iter_op op, int depth, xid_t parent)
 
 	name[NAME_MAX] = 0;
 
-	if (fd < 0) {
-		perror("open(.)");
-		return fd;
-	}
-
 	if (depth >= 0) // BFS
-		ret = iter_names(op, depth, parent);
+		ret = iter_names(op, dirfd, depth, parent);
 
 	if (ret || depth == 0)
 		goto out;
 
-	for (i = 0; i < count; i++) {
+	for (i = 0; i < count && !iter_stopped; i++) {
 		id = create_name(name, NAME_MAX, 1, parent, i);
-		ret = chdir(name);
-		if (ret && errno != ENOENT) {
-			perror("chdir");
-			goto out;
+		len = trace_begin(name, depth, id);
+		if (len <= 0) {
+			/* Skipped trace id */
+			trace_end(name, depth, 0, -len);
+			continue;
+		}
+		if (cut_tasks(depth)) {
+			/* Subtree is iterated by a parallel task */
+			iter_seq = next_task->seq + next_task->nfiles;
+			next_task++;
+			trace_end(name, depth, 0, len);
+			continue;
 		}
 
-		ret = 0;
-		len = trace_begin(name, depth, id);
-		if (len > 0)
-			ret = iter_dirs(op, next_depth, id << (next_id_log16*4));
-		trace_end(name, depth, ret, abs(len));
+		fd = openat(dirfd, name, O_PATH|O_DIRECTORY);
+		if (fd < 0 && errno != ENOENT) {
+			ret = fd;
+			perror("open dir");
+		} else {
+			/* Missing dir (e.g. dry-run) is iterated relative to parent */
+			ret = iter_dirs(op, fd < 0 ? dirfd : fd, next_depth,
+					id << (next_id_log16*4));
+		}
+		trace_end(name, depth, ret, len);
+		if (fd >= 0)
+			close(fd);
 		if (ret < 0)
 			goto out;
-
-		ret = fchdir(fd);
-		if (ret) {
-			perror("fchdir");
-			goto out;
-		}
 	}
 	if (depth < 0) // DFS
-		ret = iter_names(op, depth, parent);
+		ret = iter_names(op, dirfd, depth, parent);
 
 out:
 	if (ret)
 		fprintf(stderr, "name=%s depth=%d ret=%d\n", name, depth, ret);
-	close(fd);
 	return ret;
 }
 
@@ -296,6 +1151,7 @@ static unsigned int log16(unsigned int x)
 int iter_tree(iter_op op, int depth)
 {
 	int tree_id_log16 = 0;
+	int dirfd, ret;
 	xid_t root = 1;
 
 	// Calc number of hexa digits per tree level
@@ -321,6 +1177,30 @@ int iter_tree(iter_op op, int depth)
 		}
 	}
 
+	dirfd = open(".", O_PATH|O_DIRECTORY);
+	if (dirfd < 0) {
+		perror("open(.)");
+		return dirfd;
+	}
+
 	printf("-----------------\n");
-	return iter_dirs(op, depth, root);
+	memset(&iter_total, 0, sizeof(iter_total));
+	memset(&iter_stats, 0, sizeof(iter_stats));
+	if ((iter_threads > 1 || checkpoint_file || shard_count > 1) && tree_depth > 0) {
+		ret = iter_parallel(op, dirfd, depth, root);
+	} else {
+		if (progress_secs)
+			progress_start(count_files(tree_depth, root) +
+				       subtree_dirs(tree_depth));
+		ret = iter_dirs(op, dirfd, depth, root);
+	}
+	if (iter_flush && iter_flush() && !ret)
+		ret = -1;
+	add_stats(&iter_total, &iter_stats);
+	progress_publish(1);
+	progress_finish();
+	lat_merge();
+	lat_report();
+	close(dirfd);
+	return ret;
 }
@@ -1,6 +1,8 @@
 #ifndef _ITER_H
 #define _ITER_H
 
+#include <stdint.h>
+
 extern int tree_id;
 extern int tree_depth;
 extern int tree_width;
@@ -11,10 +13,23 @@ extern char *file_prefix;
 extern char *dir_prefix;
 extern int data_seed;
 extern int keep_data;
+extern int seekable_data;
+extern int max_errors;
+extern int clone_percent;
+extern int direct_io;
+extern int io_size;
+extern int generic_rm;
+extern int incremental;
 extern int copy_root_acls;
 extern int copy_root_mtime;
 extern int dry_run;
-extern char rel_path[];
+extern int iter_threads;
+extern int uring_depth;
+extern int xid;
+extern int lat_enabled;
+extern int progress_secs;
+extern char *lat_json;
+extern __thread char rel_path[];
 
 void iter_usage();
 int iter_parseopt(int argc, char *argv[]);
@@ -33,7 +48,77 @@ typedef long long int xid_t;
 
 extern int file_blocks;
 
-typedef int (*iter_op)(const char *, int, xid_t);
+/* Per thread iteration stats, ops may account bytes */
+struct iter_stats {
+	xid_t files;
+	xid_t dirs;
+	xid_t bytes;
+};
+
+extern __thread struct iter_stats iter_stats;
+
+/* Stats of all threads after iter_tree() */
+extern struct iter_stats iter_total;
+
+/*
+ * Per syscall class latency histograms (-L). Ops wrap syscalls with
+ * LAT(class, call), which only reads the clock if histograms are enabled.
+ */
+enum lat_class {
+	LAT_OP,		/* a whole op call */
+	LAT_MKDIR,
+	LAT_OPEN,
+	LAT_TRUNCATE,
+	LAT_FALLOCATE,
+	LAT_WRITE,
+	LAT_READ,
+	LAT_STAT,
+	LAT_XATTR,
+	LAT_UTIMES,
+	LAT_CLOSE,
+	LAT_UNLINK,
+	LAT_RMDIR,
+	LAT_MARK,
+	LAT_MAX
+};
+
+uint64_t iter_now_ns(void);
+void lat_record(int class, uint64_t ns);
+void lat_merge(void);
+void lat_report(void);
+
+static inline uint64_t lat_start(void)
+{
+	return lat_enabled ? iter_now_ns() : 0;
+}
+
+static inline void lat_end(int class, uint64_t start)
+{
+	if (start)
+		lat_record(class, iter_now_ns() - start);
+}
+
+#define LAT(class, call) ({ \
+	uint64_t __lat = lat_start(); \
+	__typeof__(call) __ret = (call); \
+	lat_end(class, __lat); \
+	__ret; \
+})
+
+/* Serial index of the file passed to op, same with any number of threads */
+extern __thread xid_t iter_seq;
+
+/* Set by an op to end the iteration early without an error */
+extern volatile int iter_stopped;
+
+/* op(parent dirfd, name, depth, id) - name is relative to parent dirfd */
+typedef int (*iter_op)(int, const char *, int, xid_t);
+
+/* Called by every iterating thread when done, e.g. to wait for async ops */
+extern int (*iter_flush)(void);
+
+/* Called before a task is recorded in the checkpoint, to wait for its async ops */
+extern int (*iter_drain)(void);
 
 int iter_tree(iter_op op, int depth);
 #endif
@@ -0,0 +1,374 @@
+/*
+ * journal - memory mapped binary change journal
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+
+#define RECORD_ALIGN(len) (((len) + 7) & ~7UL)
+
+static void segment_path(char *path, const char *dir, uint64_t seq)
+{
+	snprintf(path, PATH_MAX, "%s/%016llx.jnl", dir, (unsigned long long)seq);
+}
+
+/*
+ * Returns the first seq of the segment that holds seq, of the oldest
+ * segment if seq is 0, or 0 if there is no such segment.
+ */
+static uint64_t find_segment(const char *dir, uint64_t seq)
+{
+	uint64_t found = 0, first;
+	struct dirent *d;
+	char *end;
+	DIR *dirp = opendir(dir);
+
+	if (!dirp)
+		return 0;
+	while ((d = readdir(dirp))) {
+		first = strtoull(d->d_name, &end, 16);
+		if (strcmp(end, ".jnl") || end - d->d_name != 16 || !first)
+			continue;
+		if (!seq ? (!found || first < found) : (first <= seq && first > found))
+			found = first;
+	}
+	closedir(dirp);
+	return found;
+}
+
+static int map_segment(struct journal_segment *seg, const char *dir,
+		       uint64_t first_seq, int flags, size_t size)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	struct stat st;
+	void *map;
+
+	/* New segment is published by rename after its header is written */
+	segment_path(path, dir, first_seq);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	/* Left over by a writer that died before publishing the segment */
+	if (flags & O_CREAT)
+		unlink(tmp);
+	seg->fd = open((flags & O_CREAT) ? tmp : path, flags | O_CLOEXEC, 0644);
+	if (seg->fd < 0)
+		return -1;
+	if ((flags & O_CREAT) && ftruncate(seg->fd, size))
+		goto out_close;
+	if (fstat(seg->fd, &st))
+		goto out_close;
+	if (st.st_size < JOURNAL_HEADER_SIZE) {
+		errno = EINVAL;
+		goto out_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | ((flags & O_ACCMODE) == O_RDWR ?
+						 PROT_WRITE : 0),
+		   MAP_SHARED, seg->fd, 0);
+	if (map == MAP_FAILED)
+		goto out_close;
+	seg->hdr = map;
+	seg->handle_len = 0;
+	seg->off = JOURNAL_HEADER_SIZE;
+
+	if (flags & O_CREAT) {
+		seg->hdr->magic = JOURNAL_MAGIC;
+		seg->hdr->version = JOURNAL_VERSION;
+		seg->hdr->first_seq = first_seq;
+		seg->hdr->size = st.st_size;
+		seg->hdr->end = JOURNAL_HEADER_SIZE;
+		if (renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE)) {
+			munmap(map, st.st_size);
+			goto out_close;
+		}
+	} else if (seg->hdr->magic != JOURNAL_MAGIC ||
+		   seg->hdr->version != JOURNAL_VERSION ||
+		   seg->hdr->size != st.st_size) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		goto out_close;
+	}
+	return 0;
+
+out_close:
+	if (flags & O_CREAT)
+		unlink(tmp);
+	close(seg->fd);
+	seg->fd = -1;
+	return -1;
+}
+
+static void unmap_segment(struct journal_segment *seg)
+{
+	if (seg->hdr)
+		munmap(seg->hdr, seg->hdr->size);
+	if (seg->fd >= 0)
+		close(seg->fd);
+	seg->hdr = NULL;
+	seg->fd = -1;
+}
+
+/*
+ * Returns the seq after the last published record of the segment. The
+ * last_seq header field may be behind end if the writer died between the
+ * two stores, so the records are walked.
+ */
+static uint64_t segment_next_seq(struct journal_segment *seg)
+{
+	struct journal_record *rec;
+	uint64_t seq = seg->hdr->first_seq;
+	size_t off = JOURNAL_HEADER_SIZE;
+
+	while (off + sizeof(*rec) <= seg->hdr->end) {
+		rec = (struct journal_record *)((char *)seg->hdr + off);
+		if (!rec->len)
+			break;
+		seq = rec->seq + 1;
+		off += rec->len;
+	}
+	return seq;
+}
+
+static int seal_segment(const char *dir, uint64_t seq)
+{
+	struct journal_segment seg;
+	uint64_t first = find_segment(dir, seq);
+
+	if (!first)
+		return 0;
+	if (map_segment(&seg, dir, first, O_RDWR, 0)) {
+		perror("journal segment");
+		return -1;
+	}
+	__atomic_store_n(&seg.hdr->sealed, 1, __ATOMIC_RELEASE);
+	unmap_segment(&seg);
+	return 0;
+}
+
+int journal_open(struct journal *j, const char *dir, size_t segment_size)
+{
+	struct journal_segment last = { .fd = -1 };
+	uint64_t first;
+
+	memset(j, 0, sizeof(*j));
+	j->seg.fd = -1;
+	snprintf(j->dir, sizeof(j->dir), "%s", dir);
+	j->segment_size = segment_size ?: JOURNAL_SEGMENT_SIZE;
+	j->seq = 1;
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		perror(dir);
+		return -1;
+	}
+
+	/* Continue after the last record of an existing journal */
+	first = find_segment(dir, UINT64_MAX);
+	if (first) {
+		if (map_segment(&j->seg, dir, first, O_RDWR, 0)) {
+			perror("journal segment");
+			return -1;
+		}
+		if (j->seg.hdr->end == JOURNAL_HEADER_SIZE && !j->seg.hdr->sealed) {
+			/* Empty last segment - append to it */
+			j->seq = first;
+			j->segments++;
+			/* Writer may have died in rotate() before the seal */
+			return first > 1 ? seal_segment(dir, first - 1) : 0;
+		}
+		j->seq = segment_next_seq(&j->seg);
+		j->seg.hdr->last_seq = j->seq - 1;
+		last = j->seg;
+		j->seg.hdr = NULL;
+		j->seg.fd = -1;
+	}
+
+	/* Like rotate(), readers find the next segment when the last is sealed */
+	if (map_segment(&j->seg, dir, j->seq, O_RDWR | O_CREAT | O_EXCL,
+			j->segment_size)) {
+		perror("journal segment");
+		unmap_segment(&last);
+		return -1;
+	}
+	if (last.hdr)
+		__atomic_store_n(&last.hdr->sealed, 1, __ATOMIC_RELEASE);
+	unmap_segment(&last);
+	j->segments++;
+	return 0;
+}
+
+/* Create the next segment before sealing the full one */
+static int rotate(struct journal *j)
+{
+	struct journal_segment next;
+
+	if (map_segment(&next, j->dir, j->seq, O_RDWR | O_CREAT | O_EXCL,
+			j->segment_size)) {
+		perror("journal segment");
+		return -1;
+	}
+	__atomic_store_n(&j->seg.hdr->sealed, 1, __ATOMIC_RELEASE);
+	msync(j->seg.hdr, j->seg.off, MS_ASYNC);
+	unmap_segment(&j->seg);
+	j->seg = next;
+	j->segments++;
+	return 0;
+}
+
+uint64_t journal_append(struct journal *j, uint64_t mask, int pid,
+			uint64_t fsid, int handle_type,
+			const unsigned char *handle, int handle_len,
+			const char *name, int name_len)
+{
+	struct journal_segment *seg = &j->seg;
+	struct journal_record *rec;
+	struct timespec ts;
+	size_t len;
+	int prefix = 0;
+
+	if (handle_len > JOURNAL_HANDLE_MAX)
+		handle_len = 0;
+	len = RECORD_ALIGN(sizeof(*rec) + handle_len + name_len);
+	if (len > j->segment_size - JOURNAL_HEADER_SIZE || name_len > UINT16_MAX) {
+		errno = EMSGSIZE;
+		return 0;
+	}
+	if (seg->off + len > seg->hdr->size && rotate(j))
+		return 0;
+
+	while (prefix < handle_len && prefix < seg->handle_len &&
+	       handle[prefix] == seg->handle[prefix])
+		prefix++;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec = (struct journal_record *)((char *)seg->hdr + seg->off);
+	len = RECORD_ALIGN(sizeof(*rec) + handle_len - prefix + name_len);
+	rec->len = len;
+	rec->handle_prefix = prefix;
+	rec->handle_suffix = handle_len - prefix;
+	rec->name_len = name_len;
+	rec->seq = j->seq;
+	rec->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->mask = mask;
+	rec->fsid = fsid;
+	rec->pid = pid;
+	rec->handle_type = handle_type;
+	memcpy(rec->data, handle + prefix, handle_len - prefix);
+	memcpy(rec->data + handle_len - prefix, name, name_len);
+
+	memcpy(seg->handle + prefix, handle + prefix, handle_len - prefix);
+	seg->handle_len = handle_len;
+	seg->off += len;
+
+	/* Publish the record to readers */
+	__atomic_store_n(&seg->hdr->end, seg->off, __ATOMIC_RELEASE);
+	seg->hdr->last_seq = j->seq;
+
+	j->records++;
+	j->bytes += len;
+	j->handle_bytes += handle_len;
+	j->handle_saved += prefix;
+	return j->seq++;
+}
+
+int journal_sync(struct journal *j)
+{
+	return msync(j->seg.hdr, j->seg.off, MS_SYNC);
+}
+
+void journal_print_stats(struct journal *j)
+{
+	printf("Journal %s: records=%llu bytes=%llu (%.1f bytes/record) segments=%llu handle bytes=%llu delta saved=%.1f%%\n",
+		j->dir, j->records, j->bytes,
+		j->records ? (double)j->bytes / j->records : 0, j->segments,
+		j->handle_bytes,
+		j->handle_bytes ? 100.0 * j->handle_saved / j->handle_bytes : 0);
+}
+
+void journal_close(struct journal *j)
+{
+	if (j->seg.hdr)
+		msync(j->seg.hdr, j->seg.off, MS_ASYNC);
+	unmap_segment(&j->seg);
+}
+
+int journal_reader_open(struct journal_reader *r, const char *dir, uint64_t seq)
+{
+	struct journal_event ev;
+	uint64_t first;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->seg.fd = -1;
+	snprintf(r->dir, sizeof(r->dir), "%s", dir);
+
+	first = find_segment(dir, seq);
+	if (!first) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (map_segment(&r->seg, dir, first, O_RDONLY, 0))
+		return -1;
+	r->seq = first;
+
+	/* Handles are delta encoded, so decode the records before seq */
+	while (r->seq < seq) {
+		ret = journal_read(r, &ev);
+		if (ret <= 0)
+			return ret;
+	}
+	return 0;
+}
+
+int journal_read(struct journal_reader *r, struct journal_event *ev)
+{
+	struct journal_segment *seg = &r->seg;
+	struct journal_record *rec;
+	uint64_t end;
+
+	end = __atomic_load_n(&seg->hdr->end, __ATOMIC_ACQUIRE);
+	if (seg->off >= end) {
+		if (!__atomic_load_n(&seg->hdr->sealed, __ATOMIC_ACQUIRE))
+			return 0;
+		/* Records published before the seal are visible now */
+		end = __atomic_load_n(&seg->hdr->end, __ATOMIC_ACQUIRE);
+		if (seg->off >= end) {
+			unmap_segment(seg);
+			if (map_segment(seg, r->dir, r->seq, O_RDONLY, 0))
+				return -1;
+			return journal_read(r, ev);
+		}
+	}
+
+	rec = (struct journal_record *)((char *)seg->hdr + seg->off);
+	memcpy(seg->handle + rec->handle_prefix, rec->data, rec->handle_suffix);
+	seg->handle_len = rec->handle_prefix + rec->handle_suffix;
+	seg->off += rec->len;
+
+	ev->seq = rec->seq;
+	ev->time_ns = rec->time_ns;
+	ev->mask = rec->mask;
+	ev->fsid = rec->fsid;
+	ev->pid = rec->pid;
+	ev->handle_type = rec->handle_type;
+	ev->handle_len = seg->handle_len;
+	ev->handle = seg->handle;
+	ev->name_len = rec->name_len;
+	ev->name = (const char *)rec->data + rec->handle_suffix;
+	r->seq = rec->seq + 1;
+	return 1;
+}
+
+void journal_reader_close(struct journal_reader *r)
+{
+	unmap_segment(&r->seg);
+}
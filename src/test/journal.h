@@ -0,0 +1,110 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include <limits.h>
+
+/*
+ * Binary change journal in memory mapped, rotated segment files.
+ *
+ * The writer appends records to the mapped segment and publishes them by
+ * a release store of the segment end offset, so readers in other processes
+ * can map the same segment file and tail it without copies or syscalls.
+ * When a segment is full, the next segment is created before the full one
+ * is sealed, so a reader that sees the seal can always open the next one.
+ * Segment files are named by the sequence number of their first record.
+ *
+ * File handles are delta encoded: a record stores only the handle bytes
+ * that differ from the handle of the previous record in the segment,
+ * which for events on the same or nearby inodes is a few bytes. Records
+ * are durable when the writer process dies; call journal_sync() to also
+ * survive a crash of the system.
+ */
+#define JOURNAL_MAGIC 0x4c4e524a	/* "JRNL" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_SEGMENT_SIZE (64 << 20)
+#define JOURNAL_HANDLE_MAX 128		/* MAX_HANDLE_SZ */
+#define JOURNAL_HEADER_SIZE 64
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t first_seq;
+	uint64_t size;		/* of segment file */
+	uint64_t end;		/* offset after last published record */
+	uint64_t last_seq;	/* of last published record */
+	uint32_t sealed;	/* continued in the next segment */
+};
+
+struct journal_record {
+	uint32_t len;		/* of record, 8 byte aligned */
+	uint8_t handle_prefix;	/* handle bytes shared with previous record */
+	uint8_t handle_suffix;	/* handle bytes stored in data */
+	uint16_t name_len;
+	uint64_t seq;
+	uint64_t time_ns;	/* CLOCK_REALTIME */
+	uint64_t mask;
+	uint64_t fsid;
+	int32_t pid;
+	int32_t handle_type;
+	unsigned char data[];	/* handle suffix, then name (not terminated) */
+};
+
+/* A decoded record - name points into the mapped segment */
+struct journal_event {
+	uint64_t seq;
+	uint64_t time_ns;
+	uint64_t mask;
+	uint64_t fsid;
+	int pid;
+	int handle_type;
+	int handle_len;
+	const unsigned char *handle;
+	int name_len;
+	const char *name;
+};
+
+/* Segment mapping and delta decoding state, of writer or reader */
+struct journal_segment {
+	int fd;
+	struct journal_header *hdr;
+	size_t off;
+	unsigned char handle[JOURNAL_HANDLE_MAX];
+	int handle_len;
+};
+
+struct journal {
+	char dir[PATH_MAX];
+	size_t segment_size;
+	uint64_t seq;		/* of next record */
+	struct journal_segment seg;
+	unsigned long long records, bytes, segments, handle_bytes, handle_saved;
+};
+
+/* Zero segment_size selects JOURNAL_SEGMENT_SIZE */
+int journal_open(struct journal *j, const char *dir, size_t segment_size);
+
+/* Returns sequence number of appended record, 0 on error */
+uint64_t journal_append(struct journal *j, uint64_t mask, int pid,
+			uint64_t fsid, int handle_type,
+			const unsigned char *handle, int handle_len,
+			const char *name, int name_len);
+
+int journal_sync(struct journal *j);
+void journal_print_stats(struct journal *j);
+void journal_close(struct journal *j);
+
+struct journal_reader {
+	char dir[PATH_MAX];
+	uint64_t seq;		/* of next record */
+	struct journal_segment seg;
+};
+
+/* Start at seq or at the oldest record if seq is 0 */
+int journal_reader_open(struct journal_reader *r, const char *dir, uint64_t seq);
+
+/* Returns 1 with the next event, 0 if there is no new event, -1 on error */
+int journal_read(struct journal_reader *r, struct journal_event *ev);
+void journal_reader_close(struct journal_reader *r);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * jtail - print or follow the records of a binary change journal
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "journal.h"
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static void print_event(struct journal_event *ev)
+{
+	int i;
+
+	printf("seq=%llu time=%llu.%09llu mask=0x%llx pid=%d fsid=%llx handle=%d:",
+		(unsigned long long)ev->seq,
+		(unsigned long long)ev->time_ns / 1000000000ULL,
+		(unsigned long long)ev->time_ns % 1000000000ULL,
+		(unsigned long long)ev->mask, ev->pid,
+		(unsigned long long)ev->fsid, ev->handle_type);
+	for (i = 0; i < ev->handle_len; i++)
+		printf("%02x", ev->handle[i]);
+	printf(" name=%.*s\n", ev->name_len, ev->name);
+}
+
+static void usage(const char *progname)
+{
+	printf("usage: %s [-f] [-q] [-s <seq>] <journal dir>\n", progname);
+	printf("-f                    follow the journal until interrupted\n");
+	printf("-q                    only count records\n");
+	printf("-s <seq>              start at record <seq> (default = oldest)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct journal_reader r;
+	struct journal_event ev;
+	struct timespec start, end;
+	unsigned long long count = 0;
+	uint64_t seq = 0;
+	int follow = 0, quiet = 0;
+	double secs;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "fqs:")) != -1) {
+		switch (c) {
+			case 'f':
+				follow = 1;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 's':
+				seq = strtoull(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	/* Wait for the writer to create the journal */
+	while ((ret = journal_reader_open(&r, argv[optind], seq)) && follow &&
+	       errno == ENOENT && !stop)
+		usleep(10000);
+	if (ret) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!stop) {
+		ret = journal_read(&r, &ev);
+		if (ret < 0) {
+			perror("journal_read");
+			exit(EXIT_FAILURE);
+		}
+		if (!ret) {
+			if (!follow)
+				break;
+			usleep(1000);
+			continue;
+		}
+		count++;
+		if (!quiet)
+			print_event(&ev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "Read %llu records in %.3f sec (%.0f records/s), next seq=%llu\n",
+		count, secs, count / (secs ?: 1e-9), (unsigned long long)r.seq);
+	journal_reader_close(&r);
+	return 0;
+}
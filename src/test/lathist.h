@@ -0,0 +1,106 @@
+#ifndef _LATHIST_H
+#define _LATHIST_H
+
+/*
+ * Latency histograms are log-linear: values below LAT_SUB ns have their
+ * own bucket and every power of 2 above that is split to LAT_SUB buckets,
+ * so a percentile is reported with less than 1/LAT_SUB relative error.
+ * Histograms are not thread safe - every thread records into its own
+ * histograms and merges them when done.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[LAT_BUCKETS];
+};
+
+static inline uint64_t lat_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int lat_bucket(uint64_t ns)
+{
+	int e;
+
+	if (ns < LAT_SUB)
+		return ns;
+
+	e = 63 - __builtin_clzll(ns);
+	return (e - LAT_SUB_BITS + 1) * LAT_SUB +
+		((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* Upper bound of values in bucket */
+static inline uint64_t lat_value(int b)
+{
+	int e;
+
+	if (b < LAT_SUB)
+		return b;
+
+	e = b / LAT_SUB + LAT_SUB_BITS - 1;
+	return ((uint64_t)(LAT_SUB + b % LAT_SUB + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+static inline void lat_hist_add(struct lat_hist *h, uint64_t ns)
+{
+	h->count++;
+	h->buckets[lat_bucket(ns)]++;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static inline void lat_hist_merge(struct lat_hist *to, struct lat_hist *from)
+{
+	int b;
+
+	if (!from->count)
+		return;
+	to->count += from->count;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (b = 0; b < LAT_BUCKETS; b++)
+		to->buckets[b] += from->buckets[b];
+}
+
+/* Percentile q (0..1) in usec */
+static inline double lat_percentile(struct lat_hist *h, double q)
+{
+	uint64_t n = 0, rank = q * h->count;
+	int b;
+
+	if (!h->count)
+		return 0;
+	if (rank >= h->count)
+		rank = h->count - 1;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		n += h->buckets[b];
+		if (n > rank)
+			break;
+	}
+	/* Bucket upper bound may be above the max seen value */
+	return (lat_value(b) < h->max ? lat_value(b) : h->max) / 1000.0;
+}
+
+static inline void lat_hist_print(const char *name, struct lat_hist *h)
+{
+	printf("latency %-10s count=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+		name, (unsigned long long)h->count,
+		lat_percentile(h, 0.5), lat_percentile(h, 0.99),
+		lat_percentile(h, 0.999), h->max / 1000.0);
+}
+
+#endif
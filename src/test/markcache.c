@@ -0,0 +1,331 @@
+/*
+ * markcache - budgeted LRU of fanotify directory marks
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "markcache.h"
+
+#ifndef FAN_MARK_EVICTABLE
+#define FAN_MARK_EVICTABLE	0x00000200
+#endif
+
+struct mark_entry {
+	struct mark_entry *hnext;		/* hash chain */
+	struct mark_entry *prev, *next;		/* LRU list, most recent first */
+	time_t armed;		/* when children were armed, 0 if not all are */
+	dev_t dev, pdev;	/* of the dir and its parent */
+	ino_t ino, pino;
+	struct file_handle fh;	/* to remove the mark of the dir by inode */
+};
+
+struct mark_cache_stats mark_cache_stats;
+
+static int fanotify_fd = -1;
+static int mount_fd = -1;
+static uint64_t mark_mask;
+static unsigned int mark_flags = FAN_MARK_EVICTABLE;
+static int budget;
+static struct mark_entry **hash;
+static unsigned int hash_mask;
+static struct mark_entry lru = { .prev = &lru, .next = &lru };
+static struct mark_entry *root;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int ino_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ull;
+
+	return (h >> 32) & hash_mask;
+}
+
+static struct mark_entry **find(dev_t dev, ino_t ino)
+{
+	struct mark_entry **p = &hash[ino_hash(dev, ino)];
+
+	while (*p && ((*p)->ino != ino || (*p)->dev != dev))
+		p = &(*p)->hnext;
+	return p;
+}
+
+static void lru_del(struct mark_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_add(struct mark_entry *e)
+{
+	e->next = lru.next;
+	e->prev = &lru;
+	lru.next->prev = e;
+	lru.next = e;
+}
+
+/* Flag parent dir, so its children are re-armed on its next event */
+static void flag_parent(dev_t dev, ino_t ino)
+{
+	struct mark_entry *e = *find(dev, ino);
+
+	if (e)
+		e->armed = 0;
+}
+
+static void flag_all(void)
+{
+	struct mark_entry *e;
+
+	for (e = lru.next; e != &lru; e = e->next)
+		e->armed = 0;
+	root->armed = 0;
+}
+
+/* Mark the dir of O_PATH fd, which is not an open that reports events */
+static int add_mark(int fd)
+{
+	int ret;
+
+	ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD | mark_flags, mark_mask,
+			    fd, ".");
+	if (ret && errno == EINVAL && (mark_flags & FAN_MARK_EVICTABLE)) {
+		printf("Evictable marks are not supported - using only mark budget\n");
+		mark_flags &= ~FAN_MARK_EVICTABLE;
+		return add_mark(fd);
+	}
+	return ret;
+}
+
+/*
+ * Remove the mark by file handle, so it is removed from the evicted inode
+ * even if the dir was renamed or another dir took its name.
+ */
+static void remove_mark(struct mark_entry *e)
+{
+	int fd = open_by_handle_at(mount_fd, &e->fh, O_PATH);
+
+	if (fd < 0 || fanotify_mark(fanotify_fd, FAN_MARK_REMOVE, mark_mask,
+				    fd, "."))
+		mark_cache_stats.stale++;
+	if (fd >= 0)
+		close(fd);
+}
+
+static void evict_lru(void)
+{
+	struct mark_entry *e = lru.prev;
+
+	lru_del(e);
+	*find(e->dev, e->ino) = e->hnext;
+	remove_mark(e);
+	flag_parent(e->pdev, e->pino);
+	mark_cache_stats.evicted++;
+	mark_cache_stats.count--;
+	free(e);
+}
+
+/* Entry for dir of O_PATH fd, which is inserted to hash by the caller */
+static struct mark_entry *new_entry(int fd, const struct stat *parent)
+{
+	struct mark_entry *e = malloc(sizeof(*e) + MAX_HANDLE_SZ);
+	struct stat st;
+	int mnt_id;
+
+	if (!e) {
+		perror("alloc mark");
+		return NULL;
+	}
+	e->fh.handle_bytes = MAX_HANDLE_SZ;
+	if (fstat(fd, &st) ||
+	    name_to_handle_at(fd, "", &e->fh, &mnt_id, AT_EMPTY_PATH)) {
+		free(e);
+		return NULL;
+	}
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->pdev = parent->st_dev;
+	e->pino = parent->st_ino;
+	e->armed = 0;
+	e->hnext = NULL;
+	return e;
+}
+
+int mark_cache_init(int fd, uint64_t mask, int max)
+{
+	unsigned int size = 1;
+	struct stat st;
+	int dfd;
+
+	fanotify_fd = fd;
+	mark_mask = mask;
+	budget = max;
+	while (size < budget * 2)
+		size <<= 1;
+	hash = calloc(size, sizeof(*hash));
+	if (!hash) {
+		perror("alloc mark cache");
+		return -1;
+	}
+	hash_mask = size - 1;
+
+	/* open_by_handle_at() fails with EBADF on an O_PATH mount fd */
+	mount_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dfd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (mount_fd < 0 || dfd < 0 || fstat(dfd, &st)) {
+		perror("open root");
+		return -1;
+	}
+
+	/* Root is never evicted, so children of root can always be re-armed */
+	if (add_mark(dfd)) {
+		perror("fanotify_mark root");
+		close(dfd);
+		return -1;
+	}
+	root = new_entry(dfd, &st);
+	close(dfd);
+	if (!root) {
+		perror("file handle of root");
+		return -1;
+	}
+	*find(root->dev, root->ino) = root;
+	root->armed = time(NULL);
+	mark_cache_stats.added++;
+	return 0;
+}
+
+static int add_child(int dirfd, const struct stat *parent,
+		     const char *name, int walk)
+{
+	struct mark_entry **p, *e;
+	int fd, ret = 0;
+
+	/* The marked dir is pinned by fd, so it cannot be renamed under us */
+	fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	e = new_entry(fd, parent);
+	if (!e) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&lock);
+	p = find(e->dev, e->ino);
+	if (*p) {
+		/* Re-add, because kernel may have evicted the mark */
+		if (mark_flags & FAN_MARK_EVICTABLE)
+			ret = add_mark(fd);
+		goto out;
+	}
+
+	if (mark_cache_stats.count >= budget) {
+		if (walk) {
+			/* Walk stops here, so children of any dir may be unmarked */
+			flag_all();
+			ret = 1;
+			goto out;
+		}
+		evict_lru();
+		/* Eviction may have unlinked the hash chain we were on */
+		p = find(e->dev, e->ino);
+	}
+
+	ret = add_mark(fd);
+	if (ret)
+		goto out;
+
+	*p = e;
+	/* Children of walked dirs are added by the walk */
+	e->armed = walk ? time(NULL) : 0;
+	lru_add(e);
+	e = NULL;
+	mark_cache_stats.added++;
+	if (++mark_cache_stats.count > mark_cache_stats.peak)
+		mark_cache_stats.peak = mark_cache_stats.count;
+out:
+	pthread_mutex_unlock(&lock);
+	free(e);
+	close(fd);
+	return ret;
+}
+
+int mark_cache_add(int dirfd, const char *name, int walk)
+{
+	struct stat parent;
+
+	if (fstat(dirfd, &parent))
+		return -1;
+	return add_child(dirfd, &parent, name, walk);
+}
+
+static void arm_children(int fd, const struct stat *st)
+{
+	struct dirent *d;
+	DIR *dir;
+	/* Opening the marked dir would generate events for ourselves */
+	int dfd = dup(fd);
+
+	if (dfd < 0 || !(dir = fdopendir(dfd))) {
+		perror("open dir");
+		if (dfd >= 0)
+			close(dfd);
+		return;
+	}
+	rewinddir(dir);
+	while ((d = readdir(dir))) {
+		if (d->d_type != DT_DIR || !strcmp(d->d_name, ".") ||
+		    !strcmp(d->d_name, ".."))
+			continue;
+		/* Child may have been removed or renamed since readdir */
+		if (add_child(fd, st, d->d_name, 0) < 0 && errno != ENOENT)
+			perror(d->d_name);
+	}
+	closedir(dir);
+	mark_cache_stats.rearmed++;
+}
+
+void mark_cache_touch(int fd, const struct stat *st)
+{
+	struct mark_entry *e;
+	time_t now = time(NULL);
+	int rearm = 0;
+
+	pthread_mutex_lock(&lock);
+	e = *find(st->st_dev, st->st_ino);
+	if (e) {
+		if (e != root) {
+			lru_del(e);
+			lru_add(e);
+		}
+		rearm = !e->armed || ((mark_flags & FAN_MARK_EVICTABLE) &&
+				      now - e->armed >= MARK_REFRESH_SECS);
+		if (rearm)
+			e->armed = now;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (rearm)
+		arm_children(fd, st);
+}
+
+void mark_cache_print_stats(void)
+{
+	printf("Mark cache: budget=%d marks=%d peak=%d added=%llu evicted=%llu stale=%llu rearmed=%llu evictable=%d\n",
+		budget, mark_cache_stats.count, mark_cache_stats.peak,
+		mark_cache_stats.added, mark_cache_stats.evicted,
+		mark_cache_stats.stale, mark_cache_stats.rearmed,
+		!!(mark_flags & FAN_MARK_EVICTABLE));
+}
@@ -0,0 +1,47 @@
+#ifndef _MARKCACHE_H
+#define _MARKCACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Budgeted LRU of directory marks, keyed by inode. The tree root must be
+ * the cwd and the root itself is always marked. Marks are added relative
+ * to the parent dir fd and removed by file handle, so a renamed dir keeps
+ * its entry and a dir that takes the name of an evicted dir keeps its mark.
+ *
+ * When the budget is full, the mark of the least recently active dir is
+ * removed and its parent is flagged, so the children of the parent are
+ * re-armed on the next event on the parent. Marks are evictable if the
+ * kernel supports it, so the kernel may also drop marks of cold inodes
+ * under memory pressure. Children of an active dir with evictable marks
+ * are therefore re-armed again every MARK_REFRESH_SECS.
+ */
+#define MARK_REFRESH_SECS 30
+
+struct mark_cache_stats {
+	unsigned long long added;
+	unsigned long long evicted;
+	unsigned long long rearmed;	/* dirs whose children were re-armed */
+	unsigned long long stale;	/* evicted mark was already gone */
+	int count, peak;
+};
+
+extern struct mark_cache_stats mark_cache_stats;
+
+int mark_cache_init(int fanotify_fd, uint64_t mask, int budget);
+
+/*
+ * Add mark on dir name relative to dirfd - returns 1 if the budget is full
+ * during the initial walk (no eviction), in which case the walk should stop
+ * and all marked dirs are flagged for re-arm. Safe to call from multiple
+ * walk threads.
+ */
+int mark_cache_add(int dirfd, const char *name, int walk);
+
+/* Event on marked dir fd with stat st - keep it marked, re-arm children */
+void mark_cache_touch(int fd, const struct stat *st);
+
+void mark_cache_print_stats(void);
+
+#endif
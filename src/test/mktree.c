@@ -15,9 +15,21 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
 #include <attr/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <search.h>
+#include <linux/fs.h>
 #include "iter.h"
+#include "uring.h"
 #include "xorshift.h"
+#include "blockrand.h"
 
 
 static off64_t file_size;
@@ -25,10 +37,40 @@ static off64_t file_size;
 #define KB (1024)
 #define MB (KB * KB)
 
-static uint32_t state[4];
-static char data[MB];
+/*
+ * Random data of file with serial index iter_seq starts at offset
+ * iter_seq * file_words of the seeded stream. Every thread keeps its own
+ * stream state and seeks it when the next file is not the one it expects.
+ */
+static uint32_t seed_state[4];
+static __thread uint32_t state[4];
+static __thread xid_t state_seq = -1;
+static xorshift128_mat_t jump_state[64];
+static off64_t file_words;
+static blockrand_words_t blockrand_words;
+static uint64_t blockrand_seed;
+
+/*
+ * With -F, the first shared_blocks of every file are cloned from a golden
+ * file, whose seekable random data is keyed by GOLDEN_KEY.
+ */
+#define GOLDEN_KEY (~0ULL)
+static off64_t shared_blocks;
+static int golden_fd = -1;
+static int reflink = 1;
+static xid_t nclones, ncopies;
+static __thread char data[MB];
 static off_t block_size = 1;
 
+/*
+ * With -D or -I, io_blocks generated blocks are written by a single pwritev()
+ * from an aligned per thread buffer, with an iovec per block.
+ */
+static int io_blocks;
+static __thread char *io_buf;
+static __thread struct iovec *io_vec;
+static xid_t direct_fallbacks;
+
 struct xattr_t {
 	const char *name;
 	char *val;
@@ -88,6 +130,9 @@ static mode_t file_mode = 0666;
 
 static struct timespec times[2];
 
+static int verify;
+static int nerrors;
+
 /* Fix DOSATTRIB of dir so they could be applied to files */
 static int fix_dos_attrib(char *buf, size_t len)
 {
@@ -153,7 +198,8 @@ static int read_acls(const char *name)
 			} else if (res > 0) {
 				/* Try to set the fixed DOSATTRIB on rootdir as well */
 				fprintf(stderr, "removed directory attribute from '%s'.\n", name);
-				(void)fsetxattr(fd, xattr->name, xattr->val, xattr->len, 0);
+				if (!verify)
+					(void)fsetxattr(fd, xattr->name, xattr->val, xattr->len, 0);
 			}
 		}
 
@@ -170,7 +216,7 @@ static int write_xattrs(int fd, xid_t id, struct xattr_t *xattrs)
 	int ret;
 
 	if (id) {
-		ret = fsetxattr(fd, XATTR_XID, &id, sizeof(id), 0);
+		ret = LAT(LAT_XATTR, fsetxattr(fd, XATTR_XID, &id, sizeof(id), 0));
 		if (ret) {
 			perror("fsetxattr xid");
 			return ret;
@@ -179,7 +225,7 @@ static int write_xattrs(int fd, xid_t id, struct xattr_t *xattrs)
 	for (xattr = xattrs; copy_root_acls && xattr->name; xattr++) {
 		if (!xattr->val)
 			continue;
-		ret = fsetxattr(fd, xattr->name, xattr->val, xattr->len, 0);
+		ret = LAT(LAT_XATTR, fsetxattr(fd, xattr->name, xattr->val, xattr->len, 0));
 		if (ret) {
 			perror(xattr->name);
 			return ret;
@@ -189,99 +235,1171 @@ static int write_xattrs(int fd, xid_t id, struct xattr_t *xattrs)
 	return 0;
 }
 
-static int write_random_block(int fd)
+static void seek_random_data(xid_t seq)
+{
+	memcpy(state, seed_state, sizeof(state));
+	xorshift128_jump(jump_state, state, seq * file_words);
+	state_seq = seq;
+}
+
+/*
+ * Seekable random data of a file is keyed by file id, or by the serial
+ * file index if files have no id, and by block offset.
+ */
+static void fill_random_block(char *buf, xid_t id, off64_t block)
 {
 	int i;
-	uint32_t *p = (uint32_t *)data;
+	uint32_t *p = (uint32_t *)buf;
+
+	if (seekable_data) {
+		blockrand_fill(blockrand_words, buf, block_size, blockrand_seed,
+			       block < shared_blocks ? GOLDEN_KEY : id ?: iter_seq,
+			       block * block_size);
+		return;
+	}
 
 	for (i = 0; i < block_size >> 2; i++)
 		*p++ = xorshift128(state);
+}
+
+static void start_random_data(void)
+{
+	if (seekable_data)
+		return;
+	if (state_seq != iter_seq)
+		seek_random_data(iter_seq);
+	state_seq = iter_seq + 1;
+}
+
+static int write_random_block(int fd, xid_t id, off64_t block)
+{
+	fill_random_block(data, id, block);
 
-	return write(fd, data, block_size);
+	return LAT(LAT_WRITE, write(fd, data, block_size));
+}
+
+/* Clear O_DIRECT for unaligned io or for filesystem that does not support it */
+static int direct_fallback(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || !(flags & O_DIRECT))
+		return -1;
+	__sync_add_and_fetch(&direct_fallbacks, 1);
+	return fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+}
+
+static int alloc_io_buf(void)
+{
+	int i;
+
+	if (posix_memalign((void **)&io_buf, 4096, io_blocks * block_size) ||
+	    !(io_vec = calloc(io_blocks, sizeof(*io_vec)))) {
+		perror("alloc io buffer");
+		return -1;
+	}
+	for (i = 0; i < io_blocks; i++) {
+		io_vec[i].iov_base = io_buf + i * block_size;
+		io_vec[i].iov_len = block_size;
+	}
+	return 0;
+}
+
+/* Write random data of file blocks from block to end of file */
+static int write_random_data(int fd, xid_t id, off64_t block)
+{
+	ssize_t len, res;
+	int i, n;
+
+	if (!io_blocks) {
+		if (block)
+			lseek64(fd, block * block_size, SEEK_SET);
+		for (; block < file_size; block++) {
+			if (write_random_block(fd, id, block) < block_size) {
+				perror("write_random_block");
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if (!io_buf && alloc_io_buf())
+		return -1;
+
+	for (; block < file_size; block += n) {
+		n = file_size - block < io_blocks ? file_size - block : io_blocks;
+		for (i = 0; i < n; i++)
+			fill_random_block(io_vec[i].iov_base, id, block + i);
+		len = n * block_size;
+		res = LAT(LAT_WRITE, pwritev64(fd, io_vec, n, block * block_size));
+		if (res < 0 && errno == EINVAL && !direct_fallback(fd))
+			res = LAT(LAT_WRITE, pwritev64(fd, io_vec, n, block * block_size));
+		if (res < len) {
+			perror("pwritev");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int create_golden(void)
+{
+	off64_t i;
+
+	golden_fd = open(".", O_TMPFILE|O_RDWR, 0600);
+	if (golden_fd < 0) {
+		/* No O_TMPFILE support - use an unlinked file */
+		golden_fd = open(".mktree.golden", O_CREAT|O_EXCL|O_RDWR, 0600);
+		if (golden_fd >= 0)
+			unlink(".mktree.golden");
+	}
+	if (golden_fd < 0) {
+		perror("create golden file");
+		return -1;
+	}
+
+	for (i = 0; i < shared_blocks; i++) {
+		if (write_random_block(golden_fd, 0, i) < block_size) {
+			perror("write golden file");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Clone the shared blocks from the golden file. If the filesystem does not
+ * support reflink or the range is not aligned to fs blocks, copy the range
+ * with copy_file_range(), which may still be offloaded by the filesystem.
+ */
+static int clone_golden(int fd)
+{
+	off64_t len = shared_blocks * block_size;
+	struct file_clone_range range = {
+		.src_fd = golden_fd,
+		.src_length = len,
+	};
+	loff_t in = 0, out = 0;
+	ssize_t res;
+	int ret;
+
+	if (reflink) {
+		if (shared_blocks == file_size)
+			ret = ioctl(fd, FICLONE, golden_fd);
+		else
+			ret = ioctl(fd, FICLONERANGE, &range);
+		if (!ret) {
+			__sync_add_and_fetch(&nclones, 1);
+			return 0;
+		}
+		if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+			/* Filesystem does not support reflink */
+			reflink = 0;
+		} else if (errno != EINVAL) {
+			perror("clone golden file");
+			return ret;
+		}
+	}
+
+	while (len > 0) {
+		res = copy_file_range(golden_fd, &in, fd, &out, len, 0);
+		if (res <= 0) {
+			perror("copy_file_range");
+			return -1;
+		}
+		len -= res;
+	}
+	__sync_add_and_fetch(&ncopies, 1);
+	return 0;
+}
+
+/* Room for the longest value and one more byte */
+static __thread char xattr_buf[XATTR_SIZE_MAX + 1];
+
+/* Returns the name of the first xattr that is different from spec or NULL */
+static const char *check_xattrs(int fd, xid_t id, struct xattr_t *xattrs)
+{
+	struct xattr_t *xattr;
+	xid_t val;
+	ssize_t res;
+
+	if (id) {
+		res = LAT(LAT_XATTR, fgetxattr(fd, XATTR_XID, &val, sizeof(val)));
+		if (res != sizeof(val) || val != id)
+			return XATTR_XID;
+	}
+	for (xattr = xattrs; copy_root_acls && xattr->name; xattr++) {
+		if (!xattr->val)
+			continue;
+		/* Read one more byte to detect longer value */
+		res = LAT(LAT_XATTR, fgetxattr(fd, xattr->name, xattr_buf, xattr->len + 1));
+		if (res != xattr->len || memcmp(xattr_buf, xattr->val, res))
+			return xattr->name;
+	}
+
+	return NULL;
+}
+
+/*
+ * With -i, existing entries are checked against the spec and only the parts
+ * that diverge are rewritten, so a top up run over a mostly complete tree
+ * does not generate writes (and fsnotify events) for good entries.
+ */
+enum {
+	FIX_DATA = 1,
+	FIX_XATTRS = 2,
+	FIX_TIMES = 4,
+	FIX_NEW = 8,
+	FIX_ALL = 15,
+};
+
+static xid_t nskipped, nrepaired, ncreated;
+
+static void count_fix(int fix)
+{
+	if (!incremental)
+		return;
+	if (!fix)
+		__sync_add_and_fetch(&nskipped, 1);
+	else if (fix & FIX_NEW)
+		__sync_add_and_fetch(&ncreated, 1);
+	else
+		__sync_add_and_fetch(&nrepaired, 1);
+}
+
+/* Returns the FIX_* parts of file that diverge from spec or -1 on error */
+static int check_file(int dirfd, const char *name, xid_t id)
+{
+	off64_t size = file_size * block_size;
+	struct stat st;
+	int fix = 0;
+	int fd = LAT(LAT_OPEN, openat(dirfd, name, O_RDONLY|O_NOFOLLOW));
+
+	if (fd < 0 && errno == ENOENT)
+		return FIX_ALL;
+	if (fd < 0 || LAT(LAT_STAT, fstat(fd, &st))) {
+		perror(name);
+		fix = -1;
+		goto out;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: not a regular file\n", name);
+		fix = -1;
+		goto out;
+	}
+	if (st.st_size != size)
+		fix |= FIX_DATA;
+	/* fallocate mode also promises allocated blocks */
+	else if (!data_seed && st.st_blocks * 512 < size)
+		fix |= FIX_DATA;
+	if (check_xattrs(fd, id, file_xattrs))
+		fix |= FIX_XATTRS;
+	if (copy_root_mtime && (st.st_mtim.tv_sec != times[1].tv_sec ||
+				st.st_mtim.tv_nsec != times[1].tv_nsec))
+		fix |= FIX_TIMES;
+out:
+	if (fd >= 0)
+		LAT(LAT_CLOSE, close(fd));
+	return fd < 0 ? -1 : fix;
 }
 
 static int set_times(int fd)
 {
-	if (copy_root_mtime && futimens(fd, times) < 0) {
+	if (copy_root_mtime && LAT(LAT_UTIMES, futimens(fd, times)) < 0) {
 		perror("set mtime");
 		return -1;
 	}
 	return 0;
 }
 
-static int create_file(const char *name, xid_t id)
+static int create_file(int dirfd, const char *name, xid_t id)
 {
-	int i, ret = 0;
+	int ret = 0;
 	int flags = O_CREAT|O_WRONLY|(keep_data ? 0 : O_TRUNC);
-	int fd = open(name, flags, file_mode);
+	int fd, fix = FIX_ALL;
+
+	if (incremental) {
+		fix = check_file(dirfd, name, id);
+		if (fix < 0)
+			return fix;
+		count_fix(fix);
+		if (!fix)
+			return 0;
+		/* Only re-tag or touch file if data is good */
+		if (!(fix & FIX_DATA))
+			flags = O_RDONLY;
+	}
 
+	if (direct_io && file_size && data_seed > 0 && (fix & FIX_DATA))
+		flags |= O_DIRECT;
+	fd = LAT(LAT_OPEN, openat(dirfd, name, flags, file_mode));
+	if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+		__sync_add_and_fetch(&direct_fallbacks, 1);
+		fd = LAT(LAT_OPEN, openat(dirfd, name, flags & ~O_DIRECT, file_mode));
+	}
 	if (fd < 0) {
 		perror("create file");
 		return fd;
 	}
 
-	if (!file_size || data_seed < 0) {
-		ret = ftruncate64(fd, file_size * block_size);
+	if (!(fix & FIX_DATA)) {
+		ret = 0;
+	} else if (!file_size || data_seed < 0) {
+		ret = LAT(LAT_TRUNCATE, ftruncate64(fd, file_size * block_size));
 		if (ret)
 			perror("ftruncate64");
 	} else if (data_seed == 0) {
-		ret = fallocate64(fd, 0, 0, file_size * block_size);
+		ret = LAT(LAT_FALLOCATE, fallocate64(fd, 0, 0, file_size * block_size));
 		if (ret)
 			perror("fallocate64");
 	} else {
-		for (i = 0; i < file_size; i++) {
-			ret = write_random_block(fd);
-			if (ret < block_size) {
-				perror("write_random_block");
+		start_random_data();
+		if (shared_blocks) {
+			ret = clone_golden(fd);
+			if (ret)
 				goto out;
-			}
 		}
-		ret = 0;
+		ret = write_random_data(fd, id, shared_blocks);
+		if (ret)
+			goto out;
 	}
-	if (ret >= 0)
+	if (ret >= 0 && data_seed >= 0 && (fix & FIX_DATA))
+		iter_stats.bytes += file_size * block_size;
+	if (ret >= 0 && (fix & FIX_XATTRS))
 		ret = write_xattrs(fd, id, file_xattrs);
-	if (ret >= 0)
+	if (ret >= 0 && (fix & (FIX_DATA|FIX_TIMES)))
 		ret = set_times(fd);
 out:
-	close(fd);
+	LAT(LAT_CLOSE, close(fd));
 	return ret;
 }
 
-static int create_dir(const char *name, xid_t id)
+static int create_dir(int dirfd, const char *name, xid_t id)
 {
-	int fd;
-	int ret = mkdir(name, dir_mode);
+	int fd, exists;
+	int ret = LAT(LAT_MKDIR, mkdirat(dirfd, name, dir_mode));
 
-	if (ret < 0 && errno != EEXIST)
+	exists = ret < 0 && errno == EEXIST;
+	if (ret < 0 && !exists)
 		return ret;
 
-	fd = open(name, O_RDONLY);
+	fd = LAT(LAT_OPEN, openat(dirfd, name, O_RDONLY|O_DIRECTORY));
 	if (fd < 0) {
 		perror("open dir");
 		return fd;
 	}
 
-	ret = write_xattrs(fd, id, all_xattrs);
-	close(fd);
+	if (incremental && exists && !check_xattrs(fd, id, all_xattrs)) {
+		count_fix(0);
+		ret = 0;
+	} else {
+		count_fix(exists ? FIX_XATTRS : FIX_NEW);
+		ret = write_xattrs(fd, id, all_xattrs);
+	}
+	LAT(LAT_CLOSE, close(fd));
+	return ret;
+}
+
+/*
+ * io_uring engine: a file is created by a chain of linked sqes
+ * openat -> fallocate/write -> fsetxattr... -> close, which pass the open
+ * file in the fixed file slot of the chain. Up to uring_depth chains are
+ * in flight and they are submitted in batches, so the syscall round trip
+ * is paid per batch and not per file operation.
+ *
+ * The iterated dirfds may be closed before a chain is issued, so chains
+ * use the path relative to the tree root, which is the cwd.
+ */
+#define CHAIN_MAX_OPS 16
+
+struct file_chain {
+	char path[PATH_MAX];
+	xid_t id;
+	char *data;		/* random data of file */
+	int depth;		/* abs depth of entry */
+	int nsqes;		/* sqes in chain */
+	int nops;		/* sqes in flight */
+	const char *ops[CHAIN_MAX_OPS];
+	unsigned int lens[CHAIN_MAX_OPS];	/* expected res of writes */
+	struct file_chain *next;
+};
+
+static int uring_files;
+static __thread struct uring ring;
+static __thread struct file_chain *chains, *free_chains;
+static __thread int chains_inflight;
+static __thread int *depth_inflight;
+static __thread int ring_err;
+
+static int uring_thread_init(void)
+{
+	int i;
+
+	if (ring.fd > 0)
+		return 0;
+
+	if (uring_init(&ring, uring_depth * CHAIN_MAX_OPS, uring_depth))
+		return -1;
+
+	chains = calloc(uring_depth, sizeof(*chains));
+	depth_inflight = calloc(tree_depth + 1, sizeof(int));
+	if (!chains || !depth_inflight) {
+		perror("alloc chains");
+		return -1;
+	}
+	free_chains = NULL;
+	for (i = uring_depth - 1; i >= 0; i--) {
+		chains[i].next = free_chains;
+		free_chains = &chains[i];
+	}
+	return 0;
+}
+
+static void chain_error(struct file_chain *c, int op, int err)
+{
+	/* Linked sqe canceled after failure of previous sqe in chain */
+	if (err == ECANCELED)
+		return;
+	/* Like the sync path, do not complain about removing missing entries */
+	if (err == ENOENT && c->ops[op] == NULL)
+		return;
+
+	fprintf(stderr, "%s: %s: %s\n", c->path, c->ops[op] ?: "remove",
+		strerror(err));
+	if (err != EEXIST && err != ENOENT)
+		ring_err = err;
+}
+
+/*
+ * Submit prepared chains and reap completions, waiting for wait_nr.
+ * After a short submit, the rest of the sqes are resubmitted once the
+ * completions that are ready were reaped, until the sq ring is empty.
+ */
+static int uring_reap(unsigned wait_nr)
+{
+	struct io_uring_cqe *cqe;
+	struct file_chain *c;
+	int ret, reaped;
+
+again:
+	ret = uring_submit(&ring, wait_nr);
+	if (ret < 0 && errno != EAGAIN && errno != EBUSY) {
+		perror("io_uring_enter");
+		return ret;
+	}
+
+	reaped = 0;
+	while ((cqe = uring_peek_cqe(&ring))) {
+		reaped++;
+		c = &chains[cqe->user_data >> 8];
+		if (cqe->res < 0)
+			chain_error(c, cqe->user_data & 0xff, -cqe->res);
+		/* Short write is an error, like in the sync path */
+		else if ((unsigned int)cqe->res < c->lens[cqe->user_data & 0xff])
+			chain_error(c, cqe->user_data & 0xff, EIO);
+		uring_cqe_seen(&ring);
+		if (--c->nops)
+			continue;
+
+		chains_inflight--;
+		depth_inflight[c->depth]--;
+		c->next = free_chains;
+		free_chains = c;
+	}
+
+	if (uring_sq_pending(&ring)) {
+		/* Kernel is out of resources and no completion made room */
+		if (!reaped)
+			sched_yield();
+		wait_nr = 0;
+		goto again;
+	}
+	return 0;
+}
+
+static struct file_chain *get_chain(const char *name, int depth)
+{
+	struct file_chain *c;
+
+	if (uring_thread_init())
+		return NULL;
+
+	while (!free_chains) {
+		if (uring_reap(1))
+			return NULL;
+	}
+
+	if (ring_err) {
+		errno = ring_err;
+		return NULL;
+	}
+
+	c = free_chains;
+	free_chains = c->next;
+	snprintf(c->path, sizeof(c->path), "%s%s", rel_path, name);
+	c->depth = depth;
+	c->nsqes = 0;
+	return c;
+}
+
+static struct io_uring_sqe *chain_sqe(struct file_chain *c, int opcode,
+				      const char *opname, int flags)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+
+	/* The sq has room for all sqes of all chains */
+	sqe->opcode = opcode;
+	sqe->flags = flags;
+	sqe->user_data = ((c - chains) << 8) | c->nsqes;
+	c->lens[c->nsqes] = 0;
+	c->ops[c->nsqes++] = opname;
+	return sqe;
+}
+
+static void queue_chain(struct file_chain *c)
+{
+	c->nops = c->nsqes;
+	chains_inflight++;
+	depth_inflight[c->depth]++;
+}
+
+static int uring_create_file(const char *name, xid_t id)
+{
+	int i, slot, flags = O_CREAT|O_WRONLY|(keep_data ? 0 : O_TRUNC);
+	struct io_uring_sqe *sqe;
+	struct xattr_t *xattr;
+	struct file_chain *c;
+	off64_t len = file_size * block_size;
+
+	c = get_chain(name, 0);
+	if (!c)
+		return -1;
+
+	slot = c - chains;
+	/* Open into fixed file slot and pass it to the linked sqes */
+	sqe = chain_sqe(c, IORING_OP_OPENAT, "create file", IOSQE_IO_LINK);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)c->path;
+	sqe->len = file_mode;
+	sqe->open_flags = flags;
+	sqe->file_index = slot + 1;
+
+	if (len && data_seed == 0) {
+		sqe = chain_sqe(c, IORING_OP_FALLOCATE, "fallocate64",
+				IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+		sqe->fd = slot;
+		sqe->addr = len;
+	} else if (len) {
+		if (!c->data)
+			c->data = malloc(MB);
+		if (!c->data) {
+			perror("alloc data");
+			return -1;
+		}
+		start_random_data();
+		for (i = 0; i < file_size; i++)
+			fill_random_block(c->data + i * block_size, id, i);
+		sqe = chain_sqe(c, IORING_OP_WRITE, "write_random_block",
+				IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+		sqe->fd = slot;
+		sqe->addr = (unsigned long)c->data;
+		sqe->len = len;
+		c->lens[c->nsqes - 1] = len;
+	}
+	iter_stats.bytes += len;
+
+	c->id = id;
+	if (id) {
+		sqe = chain_sqe(c, IORING_OP_FSETXATTR, "fsetxattr xid",
+				IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+		sqe->fd = slot;
+		sqe->addr = (unsigned long)XATTR_XID;
+		sqe->addr2 = (unsigned long)&c->id;
+		sqe->len = sizeof(c->id);
+	}
+	for (xattr = file_xattrs; copy_root_acls && xattr->name; xattr++) {
+		if (!xattr->val)
+			continue;
+		sqe = chain_sqe(c, IORING_OP_FSETXATTR, xattr->name,
+				IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK);
+		sqe->fd = slot;
+		sqe->addr = (unsigned long)xattr->name;
+		sqe->addr2 = (unsigned long)xattr->val;
+		sqe->len = xattr->len;
+	}
+
+	sqe = chain_sqe(c, IORING_OP_CLOSE, "close", 0);
+	sqe->file_index = slot + 1;
+	queue_chain(c);
+	return 0;
+}
+
+static int uring_rm(const char *name, int depth)
+{
+	struct io_uring_sqe *sqe;
+	struct file_chain *c;
+	int i;
+
+	/* Wait for removal of entries inside the dir */
+	depth = abs(depth);
+	for (i = 0; i < depth; i++) {
+		while (depth_inflight && depth_inflight[i]) {
+			if (uring_reap(1))
+				return -1;
+		}
+	}
+
+	c = get_chain(name, depth);
+	if (!c)
+		return -1;
+
+	sqe = chain_sqe(c, IORING_OP_UNLINKAT, NULL, 0);
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)c->path;
+	sqe->unlink_flags = depth ? AT_REMOVEDIR : 0;
+	queue_chain(c);
+	return 0;
+}
+
+/* Wait for all chains in flight, returns -1 if any of them failed */
+static int uring_drain(void)
+{
+	int ret = 0;
+
+	if (ring.fd <= 0)
+		return 0;
+
+	while (chains_inflight && !ret)
+		ret = uring_reap(1);
+
+	if (!ret && ring_err) {
+		errno = ring_err;
+		ret = -1;
+	}
+	return ret;
+}
+
+static int uring_flush(void)
+{
+	int i, ret;
+
+	if (ring.fd <= 0)
+		return 0;
+
+	ret = uring_drain();
+	for (i = 0; i < uring_depth; i++)
+		free(chains[i].data);
+	free(chains);
+	free(depth_inflight);
+	chains = free_chains = NULL;
+	depth_inflight = NULL;
+	uring_exit(&ring);
 	return ret;
 }
 
-static int do_rm(const char *name, int depth, xid_t __attribute__((__unused__)) id)
+/*
+ * Generic rmtree (-G) lists dirs with getdents64() instead of generating
+ * names, so it also removes entries that were not created by mktree.
+ * Dirs are queued to a pool of workers and every dir is removed by the
+ * worker that completes the last of its subdirs.
+ */
+#define DENTS_BUF_SIZE MB
+
+struct rm_dir {
+	struct rm_dir *parent, *next;
+	int pending;	/* subdirs not yet removed + 1 while listing */
+	char path[];
+};
+
+struct rm_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_dir *queue;
+	int busy;	/* workers that are purging a dir */
+	int err;
+	xid_t files, dirs;
+};
+
+static __thread char *dents_buf;
+
+static struct rm_dir *new_rm_dir(struct rm_dir *parent, const char *name)
 {
-	return depth ? rmdir(name) : unlink(name);
+	size_t len = (parent ? strlen(parent->path) + 1 : 0) + strlen(name) + 1;
+	struct rm_dir *d = malloc(sizeof(*d) + len);
+
+	if (!d) {
+		perror("alloc rm dir");
+		return NULL;
+	}
+	if (parent)
+		snprintf(d->path, len, "%s/%s", parent->path, name);
+	else
+		strcpy(d->path, name);
+	d->parent = parent;
+	d->next = NULL;
+	d->pending = 1;
+	return d;
 }
 
-static int do_create(const char *name, int depth, xid_t id)
+static void queue_rm_dir(struct rm_pool *pool, struct rm_dir *d)
 {
-	return depth ? create_dir(name, id) : create_file(name, id);
+	pthread_mutex_lock(&pool->lock);
+	d->next = pool->queue;
+	pool->queue = d;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
 }
 
-static int do_print(const char *name, int depth, xid_t id)
+/* Drop a reference to dir and remove dirs whose subdirs are all removed */
+static void put_rm_dir(struct rm_pool *pool, struct rm_dir *d)
+{
+	struct rm_dir *parent;
+
+	while (d && __sync_sub_and_fetch(&d->pending, 1) == 0) {
+		parent = d->parent;
+		/* The purge root is removed by the caller */
+		if (!parent)
+			break;
+		if (LAT(LAT_RMDIR, rmdir(d->path))) {
+			perror(d->path);
+			pool->err = 1;
+		} else {
+			__sync_add_and_fetch(&pool->dirs, 1);
+		}
+		free(d);
+		d = parent;
+	}
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+/*
+ * Unlink the non-dir entries of dir and queue its subdirs.
+ * Unlinking entries while listing a dir may make getdents64 skip entries
+ * on some filesystems, so like rm -rf, the dir is rewound and listed again
+ * until a pass removes nothing. Every subdir is queued only once.
+ */
+static void purge_dir(struct rm_pool *pool, struct rm_dir *d)
+{
+	struct dirent64 *de;
+	struct rm_dir *child;
+	struct stat st;
+	ssize_t n, off;
+	void *queued = NULL;
+	char *name;
+	int type, removed;
+	int fd = open(d->path, O_RDONLY|O_DIRECTORY);
+
+	if (fd < 0) {
+		perror(d->path);
+		pool->err = 1;
+		goto out;
+	}
+	if (!dents_buf && !(dents_buf = malloc(DENTS_BUF_SIZE))) {
+		perror("alloc dents buffer");
+		pool->err = 1;
+		goto out;
+	}
+
+	do {
+		removed = 0;
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			perror(d->path);
+			pool->err = 1;
+			break;
+		}
+		while ((n = getdents64(fd, dents_buf, DENTS_BUF_SIZE)) > 0) {
+			for (off = 0; off < n; off += de->d_reclen) {
+				de = (struct dirent64 *)(dents_buf + off);
+				if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+					continue;
+				type = de->d_type;
+				if (type == DT_UNKNOWN &&
+				    !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+					type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+				if (type == DT_DIR) {
+					/* Listed again while it is purged */
+					if (tfind(de->d_name, &queued, cmp_name))
+						continue;
+					name = strdup(de->d_name);
+					if (!name || !tsearch(name, &queued, cmp_name)) {
+						perror("alloc rm dir name");
+						free(name);
+						pool->err = 1;
+						continue;
+					}
+					child = new_rm_dir(d, de->d_name);
+					if (!child) {
+						pool->err = 1;
+						continue;
+					}
+					__sync_add_and_fetch(&d->pending, 1);
+					queue_rm_dir(pool, child);
+					removed++;
+				} else if (LAT(LAT_UNLINK, unlinkat(fd, de->d_name, 0))) {
+					perror(de->d_name);
+					pool->err = 1;
+				} else {
+					__sync_add_and_fetch(&pool->files, 1);
+					removed++;
+				}
+			}
+		}
+		if (n < 0) {
+			perror("getdents64");
+			pool->err = 1;
+			break;
+		}
+	} while (removed);
+	tdestroy(queued, free);
+out:
+	if (fd >= 0)
+		close(fd);
+	put_rm_dir(pool, d);
+}
+
+static void *rm_worker(void *arg)
+{
+	struct rm_pool *pool = arg;
+	struct rm_dir *d;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->queue && pool->busy)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		d = pool->queue;
+		if (!d)
+			break;
+		pool->queue = d->next;
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		purge_dir(pool, d);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+	}
+	/* Queue is empty and nobody can refill it */
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	free(dents_buf);
+	dents_buf = NULL;
+	lat_merge();
+	return NULL;
+}
+
+/* Remove all entries under path (relative to tree root) with nthreads */
+static int purge_tree(const char *path, int nthreads, xid_t *files, xid_t *dirs)
+{
+	struct rm_pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	struct rm_dir *root = new_rm_dir(NULL, path);
+	int i, n = 0;
+
+	if (!threads || !root) {
+		perror("alloc rm workers");
+		free(threads);
+		free(root);
+		return -1;
+	}
+
+	pool.queue = root;
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[n], NULL, rm_worker, &pool)) {
+			perror("pthread_create");
+			break;
+		}
+		n++;
+	}
+	rm_worker(&pool);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	free(root);
+	if (files)
+		*files += pool.files;
+	if (dirs)
+		*dirs += pool.dirs;
+	return pool.err ? -1 : 0;
+}
+
+static int rm_tree(void)
+{
+	struct timespec start, end;
+	xid_t files = 0, dirs = 0;
+	double secs;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = purge_tree(".", iter_threads, &files, &dirs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("removed files=%lld dirs=%lld in %.3fs (%.0f entries/s)\n",
+		files, dirs, secs, (files + dirs) / (secs ?: 1));
+	lat_report();
+	return ret;
+}
+
+static int do_rm(int dirfd, const char *name, int depth, xid_t __attribute__((__unused__)) id)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (uring_depth)
+		return uring_rm(name, depth);
+
+	ret = LAT(depth ? LAT_RMDIR : LAT_UNLINK,
+		  unlinkat(dirfd, name, depth ? AT_REMOVEDIR : 0));
+	if (ret && errno == ENOTEMPTY && generic_rm) {
+		/* Purge entries that were not created by mktree and retry */
+		snprintf(path, sizeof(path), "%s%s", rel_path, name);
+		if (purge_tree(path, 1, NULL, NULL))
+			return -1;
+		ret = LAT(LAT_RMDIR, unlinkat(dirfd, name, AT_REMOVEDIR));
+	}
+	return ret;
+}
+
+static int do_create(int dirfd, const char *name, int depth, xid_t id)
+{
+	if (depth)
+		return create_dir(dirfd, name, id);
+
+	if (uring_files)
+		return uring_create_file(name, id);
+
+	return create_file(dirfd, name, id);
+}
+
+/* Check that kernel supports io_uring ops or fall back to sync path */
+static void uring_setup(int rm)
+{
+	static const int create_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_FALLOCATE, IORING_OP_WRITE,
+		IORING_OP_FSETXATTR, IORING_OP_CLOSE
+	};
+	static const int rm_ops[] = { IORING_OP_UNLINKAT };
+
+	if (!uring_depth)
+		return;
+
+	if (uring_thread_init() ||
+	    (rm ? uring_probe(&ring, rm_ops, 1) : uring_probe(&ring, create_ops, 5))) {
+		perror("io_uring");
+		fprintf(stderr, "io_uring not available - falling back to sync I/O.\n");
+		uring_flush();
+		uring_depth = 0;
+		return;
+	}
+	uring_flush();
+
+	/* Chains do not ftruncate, futimens, clone, batch, check or write more than 1MB */
+	if (rm || copy_root_mtime || shared_blocks || io_blocks || incremental)
+		return;
+	if (!file_size)
+		uring_files = !keep_data;
+	else if (data_seed == 0)
+		uring_files = 1;
+	else if (data_seed > 0)
+		uring_files = file_size * block_size <= MB;
+}
+
+static int do_print(int dirfd, const char *name, int depth, xid_t id)
 {
 	printf("%s%s%s\n", rel_path, name, depth ? "/" : "");
 	return 0;
 }
 
+/*
+ * verifytree: check a tree created by mktree with the same parameters.
+ * A mismatch is reported and fails the op only after max_errors
+ * mismatches, so the walk can continue to report all mismatches.
+ */
+#define VERIFY_BUF_SIZE (4 * MB)
+
+static __thread char *verify_buf, *expect_buf;
+static __thread int entry_mismatch;	/* current entry has a mismatch */
+static xid_t good_files, good_dirs, bad_files, bad_dirs;
+
+static int mismatch(const char *name, const char *fmt, ...)
+{
+	va_list ap;
+	int n = __sync_add_and_fetch(&nerrors, 1);
+
+	entry_mismatch = 1;
+	printf("%s%s: ", rel_path, name);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+
+	if (max_errors && n >= max_errors) {
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+}
+
+static int verify_xattrs(int fd, const char *name, xid_t id, struct xattr_t *xattrs)
+{
+	const char *bad = check_xattrs(fd, id, xattrs);
+
+	if (bad && !strcmp(bad, XATTR_XID))
+		return mismatch(name, "bad xid (expected %llx)", id);
+	if (bad)
+		return mismatch(name, "bad %s", bad);
+	return 0;
+}
+
+static int verify_data(int fd, const char *name, xid_t id)
+{
+	off64_t i, n, blocks = VERIFY_BUF_SIZE / block_size;
+	ssize_t len, res;
+
+	if (!verify_buf) {
+		if (posix_memalign((void **)&verify_buf, 4096, VERIFY_BUF_SIZE) ||
+		    posix_memalign((void **)&expect_buf, 4096, VERIFY_BUF_SIZE)) {
+			perror("alloc verify buffers");
+			return -1;
+		}
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	start_random_data();
+	/* Random stream is in sync for next file only if all data was read */
+	state_seq = -1;
+	for (i = 0; i < file_size; i += n) {
+		n = file_size - i < blocks ? file_size - i : blocks;
+		len = n * block_size;
+		res = LAT(LAT_READ, pread(fd, verify_buf, len, i * block_size));
+		if (res < 0)
+			return mismatch(name, "read at offset %lld: %s",
+					i * block_size, strerror(errno));
+		iter_stats.bytes += res;
+		if (res < len)
+			return mismatch(name, "short read at offset %lld", i * block_size + res);
+		for (len = 0; len < n; len++)
+			fill_random_block(expect_buf + len * block_size, id, i + len);
+		if (memcmp(verify_buf, expect_buf, res))
+			return mismatch(name, "bad data in blocks %lld-%lld", i, i + n - 1);
+	}
+	state_seq = iter_seq + 1;
+
+	return 0;
+}
+
+static int verify_file(int dirfd, const char *name, xid_t id)
+{
+	struct stat st;
+	int ret;
+	int fd = LAT(LAT_OPEN, openat(dirfd, name, O_RDONLY));
+
+	if (fd < 0)
+		return mismatch(name, "%s", strerror(errno));
+
+	if (LAT(LAT_STAT, fstat(fd, &st)))
+		ret = mismatch(name, "%s", strerror(errno));
+	else if (!S_ISREG(st.st_mode))
+		ret = mismatch(name, "not a regular file");
+	else if (st.st_size != file_size * block_size)
+		ret = mismatch(name, "bad size %lld (expected %lld)",
+			       (long long)st.st_size, (long long)(file_size * block_size));
+	else if (copy_root_mtime && (st.st_mtim.tv_sec != times[1].tv_sec ||
+				     st.st_mtim.tv_nsec != times[1].tv_nsec))
+		ret = mismatch(name, "bad mtime");
+	else if (!(ret = verify_xattrs(fd, name, id, file_xattrs)) &&
+		 file_size && data_seed > 0)
+		ret = verify_data(fd, name, id);
+
+	LAT(LAT_CLOSE, close(fd));
+	return ret;
+}
+
+static int verify_dir(int dirfd, const char *name, xid_t id)
+{
+	int ret;
+	int fd = LAT(LAT_OPEN, openat(dirfd, name, O_RDONLY|O_DIRECTORY));
+
+	if (fd < 0)
+		return mismatch(name, "%s", strerror(errno));
+
+	ret = verify_xattrs(fd, name, id, all_xattrs);
+	LAT(LAT_CLOSE, close(fd));
+	return ret;
+}
+
+static int do_verify(int dirfd, const char *name, int depth, xid_t id)
+{
+	int ret;
+
+	entry_mismatch = 0;
+	ret = depth ? verify_dir(dirfd, name, id) : verify_file(dirfd, name, id);
+	if (entry_mismatch)
+		__sync_add_and_fetch(depth ? &bad_dirs : &bad_files, 1);
+	else if (!ret)
+		__sync_add_and_fetch(depth ? &good_dirs : &good_files, 1);
+	return ret;
+}
+
+static int verify_tree(void)
+{
+	struct timespec start, end;
+	double secs;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = iter_tree(do_verify, tree_depth);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	/* Only entries with no mismatch count as verified */
+	printf("verified files=%lld dirs=%lld bytes=%lld in %.3fs (%.1f MB/s), bad files=%lld dirs=%lld, mismatches=%d\n",
+		good_files, good_dirs,
+		iter_total.bytes, secs, iter_total.bytes / (secs ?: 1) / MB,
+		bad_files, bad_dirs, nerrors);
+	return ret || nerrors;
+}
+
+/*
+ * With -D, data is on disk when files are closed, so sync the remaining
+ * metadata and report the device level throughput.
+ */
+static int create_tree(void)
+{
+	struct timespec start, end;
+	double secs;
+	int fd, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = iter_tree(do_create, tree_depth);
+	/* Only the filesystem of the tree, which is the cwd */
+	if (direct_io) {
+		fd = open(".", O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || syncfs(fd)) {
+			perror("syncfs");
+			ret = ret ?: -1;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("created files=%lld dirs=%lld bytes=%lld in %.3fs (%.1f MB/s), direct_fallbacks=%lld\n",
+		iter_total.files, iter_total.dirs, iter_total.bytes, secs,
+		iter_total.bytes / (secs ?: 1) / MB, direct_fallbacks);
+	return ret;
+}
+
 static const char *progname;
 
 void usage()
@@ -302,6 +1420,7 @@ int main(int argc, char *argv[])
 
 	umask(0);
 	progname = basename(argv[0]);
+	verify = strcmp(progname, "verifytree") == 0;
 	if (argc < 4)
 		usage();
 
@@ -387,6 +1506,12 @@ int main(int argc, char *argv[])
 		tree_id, tree_width, leaf_start, leaf_count, node_count,
 		file_prefix, dir_prefix, data_seed);
 
+	if (clone_percent && data_seed > 0) {
+		/* Cloned blocks must be regenerated without the golden file */
+		seekable_data = 1;
+		shared_blocks = file_size * clone_percent / 100;
+	}
+
 	if (data_seed > 0) {
 		// mix params with random seed
 		mixseed(state, strhash(basename(path)));
@@ -406,18 +1531,59 @@ int main(int argc, char *argv[])
 		if (tree_id)
 			mixseed(state, tree_id);
 		printf("mixed_seed=%u\n", state[0]);
+		memcpy(seed_state, state, sizeof(state));
+		file_words = file_size * (block_size >> 2);
+		if (seekable_data) {
+			blockrand_seed = ((uint64_t)state[1] << 32) | state[0];
+			blockrand_words = blockrand_impl(NULL);
+		} else {
+			xorshift128_jump_init(jump_state);
+		}
+	}
+
+	if ((direct_io || io_size) && data_seed > 0 && file_size) {
+		off64_t n = (off64_t)(io_size ?: 1024) * KB / block_size;
+
+		io_blocks = n < 1 ? 1 : n > IOV_MAX ? IOV_MAX : n;
+	}
+
+	/* Generic rmtree may need to purge a dir before removing it */
+	if (generic_rm)
+		uring_depth = 0;
+
+	if (!dry_run && !verify) {
+		uring_setup(strcmp(progname, "rmtree") == 0);
+		iter_flush = uring_flush;
+		iter_drain = uring_drain;
 	}
 
 	// Print parameters that are not mixed into random seed
-	printf("keep_data=%d\ncopy_root_acls=%d\ncopy_root_mtime=%d\n",
-		keep_data, copy_root_acls, copy_root_mtime);
+	printf("keep_data=%d\ncopy_root_acls=%d\ncopy_root_mtime=%d\nseekable_data=%d\n"
+		"clone_percent=%d\ndirect_io=%d\nio_size=%lld\nthreads=%d\nuring_depth=%d\n",
+		keep_data, copy_root_acls, copy_root_mtime, seekable_data,
+		shared_blocks ? clone_percent : 0, direct_io,
+		(long long)(io_blocks * block_size), iter_threads, uring_depth);
 
 	if (dry_run)
 		ret = iter_tree(do_print, tree_depth);
+	else if (verify)
+		ret = verify_tree();
+	else if (strcmp(progname, "rmtree") == 0 && generic_rm && !xid)
+		ret = rm_tree();
 	else if (strcmp(progname, "rmtree") == 0)
 		ret = iter_tree(do_rm, -tree_depth);
+	else if (shared_blocks && create_golden())
+		ret = -1;
+	else if (io_blocks)
+		ret = create_tree();
 	else
 		ret = iter_tree(do_create, tree_depth);
 
+	if (shared_blocks && !dry_run && !verify)
+		printf("cloned=%lld copied=%lld\n", nclones, ncopies);
+	if (incremental && !dry_run && !verify)
+		printf("incremental created=%lld repaired=%lld skipped=%lld\n",
+			ncreated, nrepaired, nskipped);
+
 	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,538 @@
+/*
+ * multiwatch - watch many directories, each with its own notification
+ *              group, from a single event loop
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE     /* Needed to get O_LARGEFILE definition */
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "evloop.h"
+#include "coalesce.h"
+#include "rescan.h"
+#include "journal.h"
+#include "fidres.h"
+
+#define FAN_EVENTS (FAN_MODIFY | FAN_CLOSE_WRITE | FAN_EVENT_ON_CHILD)
+#define IN_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVE)
+
+/* Events that change the namespace are not reordered by coalescing */
+#define IN_BARRIER_EVENTS (IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | \
+			   IN_MOVE_SELF | IN_IGNORED | IN_Q_OVERFLOW)
+
+static unsigned long long noverflow;
+static unsigned long long nhandled;
+static int coalesce_ms = -1, coalesce_count;
+static int rescan_threads, rescan_pending;
+static const char *journal_dir;
+static int fid_mode;
+static struct journal journal;
+static struct file_handle *event_fh;
+
+/* Per group state */
+struct watch {
+	struct rescan_dir *rescan;
+	uint64_t fsid;
+	struct file_handle *dir;	/* of the watched dir */
+};
+
+/* Objects of different groups must not be merged */
+struct fan_key {
+	struct evgroup *g;
+	uint64_t dev, ino;
+};
+
+struct in_key {
+	struct evgroup *g;
+	int wd;
+	char name[NAME_MAX + 1];
+};
+
+static void journal_write(uint64_t mask, int pid, uint64_t fsid,
+			  const struct file_handle *fh, const char *name)
+{
+	if (!journal_append(&journal, mask, pid, fsid,
+			    fh ? fh->handle_type : 0, fh ? fh->f_handle : NULL,
+			    fh ? fh->handle_bytes : 0, name, name ? strlen(name) : 0)) {
+		perror("journal");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Append raw event to the journal before coalescing. Events with a name
+ * are recorded with the handle of the watched dir.
+ */
+static void journal_event(struct evgroup *g, uint64_t mask, int pid, int fd,
+			  const char *name)
+{
+	struct watch *w = g->data;
+	struct file_handle *fh = w->dir;
+	int mnt_id;
+
+	if (!journal_dir)
+		return;
+	if (fd >= 0) {
+		event_fh->handle_bytes = MAX_HANDLE_SZ;
+		fh = name_to_handle_at(fd, "", event_fh, &mnt_id, AT_EMPTY_PATH) ?
+			NULL : event_fh;
+	}
+	journal_write(mask, pid, w->fsid, fh, name);
+}
+
+/*
+ * In FID mode, the event itself has the dir handle and name of the object,
+ * or the handle of the object if it has no name, also after the object was
+ * deleted or moved, so they are recorded as reported.
+ */
+static void journal_fid_event(struct evgroup *g, struct fanotify_event_metadata *md)
+{
+	struct fan_info info;
+	uint64_t fsid;
+
+	if (!journal_dir)
+		return;
+	if (!fan_info_find(md, FAN_EVENT_INFO_TYPE_DFID_NAME, &info) &&
+	    !fan_info_find(md, FAN_EVENT_INFO_TYPE_FID, &info) &&
+	    !fan_info_find(md, FAN_EVENT_INFO_TYPE_DFID, &info)) {
+		journal_event(g, md->mask, md->pid, -1, NULL);
+		return;
+	}
+	memcpy(&fsid, info.fsid, sizeof(fsid));
+	journal_write(md->mask, md->pid, fsid, info.fh, info.name);
+}
+
+/* Consumer of (coalesced) events */
+static void handle_event(struct coal_event *ev)
+{
+	nhandled++;
+	if (ev->fd >= 0)
+		close(ev->fd);
+}
+
+/*
+ * Differences found by rescan after overflow are delivered as events.
+ * FAN_CREATE/FAN_DELETE/FAN_MODIFY have the same values as the inotify
+ * flags.
+ */
+static void handle_rescan(struct rescan_dir *dir, const char *name,
+			  enum rescan_event event)
+{
+	static const uint32_t rescan_mask[] = {
+		[RESCAN_CREATE] = IN_CREATE,
+		[RESCAN_DELETE] = IN_DELETE,
+		[RESCAN_MODIFY] = IN_MODIFY,
+	};
+	struct coal_event ev = { .mask = rescan_mask[event], .count = 1, .fd = -1,
+				 .data = dir->data };
+
+	journal_event(dir->data, ev.mask, 0, -1, name);
+	handle_event(&ev);
+}
+
+static void overflow(struct evgroup *g)
+{
+	struct watch *w = g->data;
+
+	noverflow++;
+	if (coalesce_ms >= 0)
+		coal_flush_all();
+	if (w->rescan) {
+		rescan_overflow(w->rescan);
+		rescan_pending = 1;
+	}
+}
+
+/*
+ * Rescan after all events of the batch that had the overflow. After a batch
+ * that drained the queue without overflow, the snapshot of the group dir is
+ * refreshed, so the next overflow does not report the delivered changes.
+ */
+static void rescan(struct evgroup *g, int overflowed)
+{
+	struct watch *w = g->data;
+
+	if (w->rescan && !overflowed && g->events.drained) {
+		rescan_refresh(w->rescan);
+		rescan_pending = 1;
+	}
+	if (!rescan_pending)
+		return;
+	rescan_pending = 0;
+	if (rescan_run() < 0)
+		exit(EXIT_FAILURE);
+}
+
+static void fanotify_event(struct evgroup *g, struct fanotify_event_metadata *metadata)
+{
+	struct coal_event ev = { .mask = metadata->mask, .count = 1, .fd = metadata->fd };
+	struct fan_key key = { .g = g };
+	struct stat st;
+
+	if (fid_mode) {
+		journal_fid_event(g, metadata);
+		/* Open the event object like the kernel does in fd mode */
+		if (ev.fd == FAN_NOFD)
+			ev.fd = fidres_open_event(metadata, O_RDONLY | O_NONBLOCK);
+	} else {
+		journal_event(g, metadata->mask, metadata->pid, ev.fd, NULL);
+	}
+	if (coalesce_ms < 0 || ev.fd < 0) {
+		handle_event(&ev);
+		return;
+	}
+	if (fstat(ev.fd, &st)) {
+		perror("fstat");
+		handle_event(&ev);
+		return;
+	}
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	/*
+	 * Records are keyed by dev/ino, so do not keep the event fd open
+	 * while it is pending - up to COAL_MAX_PENDING fds would exceed
+	 * the open files limit.
+	 */
+	close(ev.fd);
+	coal_add(&key, sizeof(key), metadata->mask, -1, g, 0);
+}
+
+static int handle_fanotify(struct evgroup *g, char *buf, ssize_t len)
+{
+	struct fanotify_event_metadata *metadata;
+	int overflowed = 0;
+
+	metadata = (struct fanotify_event_metadata *)buf;
+	while (FAN_EVENT_OK(metadata, len)) {
+		if (metadata->mask & FAN_Q_OVERFLOW) {
+			overflow(g);
+			overflowed = 1;
+		} else {
+			fanotify_event(g, metadata);
+		}
+		metadata = FAN_EVENT_NEXT(metadata, len);
+	}
+	rescan(g, overflowed);
+	return 0;
+}
+
+static int handle_inotify(struct evgroup *g, char *buf, ssize_t len)
+{
+	struct coal_event ev = { .count = 1, .fd = -1 };
+	struct inotify_event *event;
+	struct in_key key = { .g = g };
+	int keylen, overflowed = 0;
+	char *p;
+
+	for (p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+		event = (struct inotify_event *)p;
+		if (event->mask & IN_Q_OVERFLOW) {
+			overflow(g);
+			overflowed = 1;
+			continue;
+		}
+		journal_event(g, event->mask, 0, -1, event->len ? event->name : NULL);
+		if (coalesce_ms < 0) {
+			ev.mask = event->mask;
+			handle_event(&ev);
+			continue;
+		}
+		key.wd = event->wd;
+		keylen = offsetof(struct in_key, name);
+		if (event->len) {
+			strcpy(key.name, event->name);
+			keylen += strlen(event->name);
+		}
+		coal_add(&key, keylen, event->mask, -1, g,
+			 !!(event->mask & IN_BARRIER_EVENTS));
+	}
+	rescan(g, overflowed);
+	return 0;
+}
+
+/* Quit on enter key or end of input */
+static int handle_stdin(struct evgroup *g, char *buf, ssize_t len)
+{
+	char c;
+	ssize_t ret;
+
+	while ((ret = read(g->fd, &c, 1)) > 0) {
+		if (c == '\n')
+			return -1;
+	}
+	return (ret == 0 || errno != EAGAIN) ? -1 : 0;
+}
+
+/* Quit on SIGINT/SIGTERM */
+static int handle_signal(struct evgroup *g, char *buf, ssize_t len)
+{
+	struct signalfd_siginfo si;
+	int ret = 0;
+
+	while (read(g->fd, &si, sizeof(si)) == sizeof(si))
+		ret = -1;
+	return ret;
+}
+
+static int handle_timer(struct evgroup *g, char *buf, ssize_t len)
+{
+	uint64_t expirations;
+
+	while (read(g->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		evloop_print_stats(0);
+	return 0;
+}
+
+/* Deliver coalesced events when their time window expires */
+static int handle_coalesce_timer(struct evgroup *g, char *buf, ssize_t len)
+{
+	uint64_t expirations;
+
+	while (read(g->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		coal_flush_due();
+	return 0;
+}
+
+static int init_watch(struct watch *w, const char *path)
+{
+	struct statfs sfs;
+	int mnt_id;
+
+	if (statfs(path, &sfs)) {
+		perror(path);
+		return -1;
+	}
+	memcpy(&w->fsid, &sfs.f_fsid, sizeof(w->fsid));
+	w->dir = malloc(sizeof(*w->dir) + MAX_HANDLE_SZ);
+	if (!w->dir) {
+		perror("alloc handle");
+		return -1;
+	}
+	w->dir->handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, path, w->dir, &mnt_id, 0)) {
+		perror("name_to_handle_at");
+		return -1;
+	}
+	return 0;
+}
+
+static int add_group(const char *path, int use_inotify)
+{
+	struct evgroup *g;
+	struct watch *w;
+	int fd;
+
+	if (use_inotify) {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0) {
+			perror("inotify_init1");
+			return -1;
+		}
+		if (inotify_add_watch(fd, path, IN_EVENTS) < 0) {
+			perror(path);
+			goto out_close;
+		}
+	} else {
+		fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+				   (fid_mode ? FAN_REPORT_DFID_NAME | FAN_REPORT_FID : 0),
+				   O_RDONLY | O_LARGEFILE);
+		if (fd < 0) {
+			perror("fanotify_init");
+			return -1;
+		}
+		if (fid_mode && fidres_add_mount(path))
+			goto out_close;
+		if (fanotify_mark(fd, FAN_MARK_ADD, FAN_EVENTS, AT_FDCWD, path)) {
+			perror(path);
+			goto out_close;
+		}
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		perror("alloc watch");
+		goto out_close;
+	}
+	g = evloop_add(fd, use_inotify ? EVGROUP_INOTIFY : EVGROUP_FANOTIFY,
+		       use_inotify ? handle_inotify : handle_fanotify, w, path);
+	if (!g) {
+		free(w);
+		goto out_close;
+	}
+	/* Snapshot of the dir is taken after all groups are added */
+	if (rescan_threads && !(w->rescan = rescan_add(path, g)))
+		return -1;
+	if (journal_dir && init_watch(w, path))
+		return -1;
+	return 0;
+
+out_close:
+	close(fd);
+	return -1;
+}
+
+static int add_control(int fd, evgroup_fn fn, const char *name)
+{
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+	if (!evloop_add(fd, EVGROUP_CONTROL, fn, NULL, name)) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	printf("usage: %s [-i] [-t <stats interval sec>] [-c <window ms>] [-n <count>] [-r <threads>] [-J <dir>] [-f] <dir>...\n", progname);
+	printf("-i                    use inotify groups (default fanotify)\n");
+	printf("-t <seconds>          print totals every <seconds>\n");
+	printf("-c <window ms>        coalesce events on the same object within window\n");
+	printf("-n <count>            (default = 0, deliver coalesced event after <count> events)\n");
+	printf("-r <threads>          rescan dirs with <threads> after queue overflow\n");
+	printf("-J <journal dir>      append events to a binary journal\n");
+	printf("-f                    use fanotify FID mode and open event files by handle\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct itimerspec its = { };
+	int use_inotify = 0, interval = 0;
+	int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+	sigset_t mask;
+	int c, i, ret;
+
+	while ((c = getopt(argc, argv, "it:c:n:r:J:f")) != -1) {
+		switch (c) {
+			case 'i':
+				use_inotify = 1;
+				break;
+			case 't':
+				interval = atoi(optarg);
+				break;
+			case 'c':
+				coalesce_ms = atoi(optarg);
+				break;
+			case 'n':
+				coalesce_count = atoi(optarg);
+				break;
+			case 'r':
+				rescan_threads = atoi(optarg);
+				break;
+			case 'J':
+				journal_dir = optarg;
+				break;
+			case 'f':
+				fid_mode = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	if (evloop_init())
+		exit(EXIT_FAILURE);
+
+	if (rescan_threads && rescan_init(rescan_threads, handle_rescan))
+		exit(EXIT_FAILURE);
+
+	if (fid_mode && fidres_init(0))
+		exit(EXIT_FAILURE);
+
+	if (journal_dir) {
+		event_fh = malloc(sizeof(*event_fh) + MAX_HANDLE_SZ);
+		if (!event_fh || journal_open(&journal, journal_dir, 0))
+			exit(EXIT_FAILURE);
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (add_group(argv[i], use_inotify))
+			exit(EXIT_FAILURE);
+	}
+
+	if (rescan_threads && rescan_run() < 0)
+		exit(EXIT_FAILURE);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	/* stdin file is shared with the shell - restore flags on exit */
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK);
+	if (add_control(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC),
+			handle_signal, "signalfd") ||
+	    add_control(dup(STDIN_FILENO), handle_stdin, "stdin"))
+		exit(EXIT_FAILURE);
+
+	if (interval) {
+		its.it_interval.tv_sec = its.it_value.tv_sec = interval;
+		c = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (c >= 0 && timerfd_settime(c, 0, &its, NULL)) {
+			close(c);
+			c = -1;
+		}
+		if (add_control(c, handle_timer, "timerfd"))
+			exit(EXIT_FAILURE);
+	}
+
+	if (coalesce_ms >= 0) {
+		/* Check for due records at least 4 times per window */
+		long ns = (coalesce_ms ?: 1) * 1000000LL / 4;
+
+		its.it_interval.tv_sec = its.it_value.tv_sec = ns / 1000000000L;
+		its.it_interval.tv_nsec = its.it_value.tv_nsec = ns % 1000000000L;
+		c = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (c >= 0 && timerfd_settime(c, 0, &its, NULL)) {
+			close(c);
+			c = -1;
+		}
+		if (coal_init(coalesce_ms, coalesce_count, handle_event) ||
+		    add_control(c, handle_coalesce_timer, "coalesce timer"))
+			exit(EXIT_FAILURE);
+	}
+
+	printf("Press enter key to terminate.\n");
+	printf("Listening for events. (groups=%d, %s)\n", argc - optind,
+			use_inotify ? "inotify" : "fanotify");
+
+	ret = evloop_run();
+	fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+
+	if (coalesce_ms >= 0)
+		coal_flush_all();
+
+	printf("Listening for events stopped. (overflows=%llu, handled=%llu)\n",
+			noverflow, nhandled);
+	if (coalesce_ms >= 0)
+		coal_print_stats();
+	if (rescan_threads)
+		rescan_print_stats();
+	if (fid_mode)
+		fidres_print_stats();
+	if (journal_dir) {
+		journal_print_stats(&journal);
+		journal_close(&journal);
+	}
+	evloop_print_stats(1);
+	evloop_free();
+	return ret < 0 ? EXIT_FAILURE : 0;
+}
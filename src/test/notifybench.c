@@ -0,0 +1,678 @@
+/*
+ * notifybench - compare the cost of dnotify, inotify and fanotify watches
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ *
+ * Builds a tree with mktree and runs a fixed mutation workload on random
+ * dirs of the tree, first with no listener and then once per backend:
+ *
+ *   dnotify  F_NOTIFY on an fd of every dir
+ *   inotify  recursive inotify watches on every dir (inotree)
+ *   inode    fanotify inode mark on every dir
+ *   mount    fanotify mount mark
+ *   fs       fanotify filesystem mark
+ *
+ * The listener of every backend runs in a child process, which reports the
+ * setup time, the events it read, the events it lost, the queue overflows
+ * and its CPU time during the workload. The parent reports the kernel slab growth from the
+ * setup and the slowdown of the workload compared to the run with no
+ * listener. Every workload op creates, writes, chmods, renames and unlinks
+ * a file and every MKDIR_EVERY ops a dir is also created and removed, so
+ * the tree is left as it was.
+ *
+ * Lost events are the expected event types of the workload that were not
+ * delivered. fanotify merges the events of an object that are queued
+ * together into one event with all their types, so delivered event types
+ * are counted rather than events. Mount and filesystem marks also get
+ * events from outside the tree, which may hide lost events. The watched
+ * event types are printed as the mask of the row.
+ * Requires CAP_SYS_ADMIN for the fanotify backends.
+ */
+
+#define _GNU_SOURCE
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "evread.h"
+#include "inotree.h"
+#include "xorshift.h"
+
+#define DENTS_BUF_SIZE (32 * 1024)
+#define MKDIR_EVERY 16
+#define WRITE_SIZE 4096
+/* Let the kernel free the marks of the last listener before reading slab */
+#define SETTLE_USECS 200000
+
+#define DNOTIFY_MASK (DN_MODIFY | DN_CREATE | DN_DELETE | DN_RENAME | \
+		      DN_ATTRIB | DN_MULTISHOT)
+#define INOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+		      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define FANOTIFY_MASK (FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | \
+		       FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+		       FAN_MOVED_TO | FAN_ONDIR)
+/*
+ * The kernel rejects dirent and attrib events on mount marks, so the mount
+ * backend watches fewer event types and its slowdown is not comparable.
+ */
+#define FANOTIFY_MOUNT_MASK (FAN_MODIFY | FAN_CLOSE_WRITE)
+/* dnotify has no close_write and reports a rename on both dirs */
+#define DNOTIFY_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+			IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Event types of a workload op, with the same values in inotify and fanotify */
+#define OP_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+		   IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define DIR_OP_EVENTS (IN_CREATE | IN_DELETE)
+
+enum backend {
+	BACKEND_NONE,
+	BACKEND_DNOTIFY,
+	BACKEND_INOTIFY,
+	BACKEND_INODE,
+	BACKEND_MOUNT,
+	BACKEND_FS,
+	BACKEND_MAX
+};
+
+static const char *backend_names[] = {
+	"none", "dnotify", "inotify", "inode", "mount", "fs",
+};
+
+/* Reported by the listener after setup and after the workload */
+struct result {
+	int error;
+	double setup_secs;
+	double cpu_secs;	/* listener user+sys during the workload */
+	unsigned long long events;
+	unsigned long long delivered;	/* event types of the workload */
+	unsigned long long expected;
+	unsigned long long overflows;
+	unsigned long long mask;	/* watched event types */
+};
+
+static int tree_depth = 3, tree_width = 10, leaf_files;
+static int ops = 100000, seed;
+static char *dir_names;
+static size_t names_len, names_size;
+static size_t *dir_offs;
+static int ndirs, dirs_size;
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double cpu_secs(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Slab from /proc/meminfo in KB */
+static long read_slab(void)
+{
+	char line[128];
+	long kb = -1;
+	FILE *f = fopen("/proc/meminfo", "r");
+
+	if (!f) {
+		perror("/proc/meminfo");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Slab: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+static int add_dir(const char *path, size_t len)
+{
+	void *p;
+
+	if (ndirs == dirs_size) {
+		dirs_size = dirs_size ? dirs_size * 2 : 1024;
+		p = realloc(dir_offs, dirs_size * sizeof(*dir_offs));
+		if (!p)
+			goto nomem;
+		dir_offs = p;
+	}
+	if (names_len + len + 1 > names_size) {
+		names_size = names_size ? names_size * 2 : 64 * 1024;
+		p = realloc(dir_names, names_size);
+		if (!p)
+			goto nomem;
+		dir_names = p;
+	}
+	dir_offs[ndirs++] = names_len;
+	memcpy(dir_names + names_len, path, len + 1);
+	names_len += len + 1;
+	return 0;
+
+nomem:
+	perror("alloc dir list");
+	return -1;
+}
+
+/* List the dirs of the tree under path, relative to the tree root */
+static int walk_dir(char *path, size_t len)
+{
+	char *buf;
+	struct dirent64 *de;
+	struct stat st;
+	ssize_t n, off;
+	size_t nlen;
+	int fd, type, ret = 0;
+
+	if (add_dir(path, len))
+		return -1;
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	buf = malloc(DENTS_BUF_SIZE);
+	if (!buf) {
+		perror("alloc dents buffer");
+		close(fd);
+		return -1;
+	}
+	while (!ret && (n = getdents64(fd, buf, DENTS_BUF_SIZE)) > 0) {
+		for (off = 0; !ret && off < n; off += de->d_reclen) {
+			de = (struct dirent64 *)(buf + off);
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			type = de->d_type;
+			if (type == DT_UNKNOWN &&
+			    !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+			if (type != DT_DIR)
+				continue;
+			/* Paths under the root "." are listed without "./" */
+			nlen = strcmp(path, ".") ? len + 1 : 0;
+			if (nlen + strlen(de->d_name) >= PATH_MAX) {
+				fprintf(stderr, "%s/%s: path too long\n", path, de->d_name);
+				ret = -1;
+				break;
+			}
+			if (nlen)
+				path[len] = '/';
+			strcpy(path + nlen, de->d_name);
+			ret = walk_dir(path, nlen + strlen(de->d_name));
+			if (nlen)
+				path[len] = 0;
+			else
+				strcpy(path, ".");
+		}
+	}
+	if (n < 0) {
+		perror("getdents64");
+		ret = -1;
+	}
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+static int build_tree(const char *progname, const char *root)
+{
+	char mktree[PATH_MAX], depth[16], width[16], files[16];
+	const char *slash = strrchr(progname, '/');
+	int status, null;
+	pid_t pid;
+
+	/* mktree is expected next to notifybench, or in PATH */
+	if (slash)
+		snprintf(mktree, sizeof(mktree), "%.*s/mktree",
+			 (int)(slash - progname), progname);
+	else
+		strcpy(mktree, "mktree");
+	snprintf(depth, sizeof(depth), "%d", tree_depth);
+	snprintf(width, sizeof(width), "%d", tree_width);
+	snprintf(files, sizeof(files), "%d", leaf_files);
+
+	if (mkdir(root, 0755) && errno != EEXIST) {
+		perror(root);
+		return -1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		null = open("/dev/null", O_WRONLY);
+		if (null >= 0)
+			dup2(null, STDOUT_FILENO);
+		execlp(mktree, "mktree", root, depth, "0", "-w", width,
+		       "-c", files, NULL);
+		perror(mktree);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "%s %s failed\n", mktree, root);
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns the wall time of the workload or -1 */
+static double workload(void)
+{
+	static char data[WRITE_SIZE];
+	char path[PATH_MAX], to[PATH_MAX];
+	uint32_t state[4] = { 1, 2, 3, 4 };
+	struct timespec start;
+	const char *dir;
+	int i, fd;
+
+	mixseed(state, seed);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < ops; i++) {
+		dir = dir_names + dir_offs[xorshift128(state) % ndirs];
+		snprintf(path, sizeof(path), "%s/nb%d", dir, i);
+		snprintf(to, sizeof(to), "%s/nb%d.r", dir, i);
+		fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, data, sizeof(data)) != sizeof(data) ||
+		    close(fd) || chmod(path, 0600) || rename(path, to) ||
+		    unlink(to))
+			goto fail;
+		if (!(i % MKDIR_EVERY) && (mkdir(path, 0755) || rmdir(path)))
+			goto fail;
+	}
+	return elapsed(&start);
+
+fail:
+	perror(path);
+	return -1;
+}
+
+static int setup_dnotify(void)
+{
+	struct rlimit rl = { ndirs + 64, ndirs + 64 };
+	sigset_t set;
+	int i, fd, sfd;
+
+	/* dnotify needs an open fd per dir */
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		fprintf(stderr, "dnotify: cannot raise open files limit to %d: %s\n",
+			ndirs + 64, strerror(errno));
+		return -1;
+	}
+	/* Events are queued RT signals, SIGIO when the signal queue is full */
+	sigemptyset(&set);
+	sigaddset(&set, SIGRTMIN);
+	sigaddset(&set, SIGIO);
+	if (sigprocmask(SIG_BLOCK, &set, NULL)) {
+		perror("sigprocmask");
+		return -1;
+	}
+	sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0) {
+		perror("signalfd");
+		return -1;
+	}
+	for (i = 0; i < ndirs; i++) {
+		fd = open(dir_names + dir_offs[i], O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || fcntl(fd, F_SETSIG, SIGRTMIN) ||
+		    fcntl(fd, F_NOTIFY, DNOTIFY_MASK)) {
+			perror(dir_names + dir_offs[i]);
+			return -1;
+		}
+	}
+	return sfd;
+}
+
+static int setup_inotify(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (fd < 0) {
+		perror("inotify_init1");
+		return -1;
+	}
+	if (inotree_init(fd, INOTIFY_MASK, NULL) || inotree_add(".") < 0)
+		return -1;
+	return fd;
+}
+
+/* Event types that the workload generates for the watched event mask */
+static unsigned long long expected_events(uint64_t mask)
+{
+	unsigned long long dir_ops = (ops + MKDIR_EVERY - 1) / MKDIR_EVERY;
+
+	return (unsigned long long)ops * __builtin_popcountll(mask & OP_EVENTS) +
+		dir_ops * __builtin_popcountll(mask & DIR_OP_EVENTS);
+}
+
+static int setup_fanotify(enum backend b, uint64_t *mask)
+{
+	unsigned int flags = FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+			     FAN_NONBLOCK | FAN_CLOEXEC;
+	int i, fd;
+
+	/* The default max_user_marks is far below the dirs of large trees */
+	if (b == BACKEND_INODE)
+		flags |= FAN_UNLIMITED_MARKS;
+	fd = fanotify_init(flags, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		perror("fanotify_init");
+		return -1;
+	}
+	if (b == BACKEND_INODE) {
+		*mask = FANOTIFY_MASK;
+		for (i = 0; i < ndirs; i++) {
+			if (fanotify_mark(fd, FAN_MARK_ADD,
+					  FANOTIFY_MASK | FAN_EVENT_ON_CHILD, AT_FDCWD,
+					  dir_names + dir_offs[i])) {
+				perror(dir_names + dir_offs[i]);
+				return -1;
+			}
+		}
+		return fd;
+	}
+	flags = FAN_MARK_ADD |
+		(b == BACKEND_MOUNT ? FAN_MARK_MOUNT : FAN_MARK_FILESYSTEM);
+	*mask = b == BACKEND_MOUNT ? FANOTIFY_MOUNT_MASK : FANOTIFY_MASK;
+	if (!fanotify_mark(fd, flags, *mask, AT_FDCWD, "."))
+		return fd;
+	perror("fanotify_mark");
+	return -1;
+}
+
+/* Read and count the queued events, returns -1 on error */
+static int read_events(enum backend b, int fd, struct evread *er,
+		       struct result *res)
+{
+	struct signalfd_siginfo si[64];
+	struct fanotify_event_metadata *md;
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int i;
+
+	if (b == BACKEND_DNOTIFY) {
+		while ((len = read(fd, si, sizeof(si))) > 0) {
+			for (i = 0; i < len / (ssize_t)sizeof(si[0]); i++) {
+				if (si[i].ssi_signo == SIGIO) {
+					res->overflows++;
+				} else {
+					res->events++;
+					res->delivered++;
+				}
+			}
+		}
+		return len < 0 && errno != EAGAIN ? -1 : 0;
+	}
+
+	while ((len = evread(er)) > 0) {
+		res->events += er->events;
+		if (b == BACKEND_INOTIFY) {
+			for (p = er->buf; p < er->buf + len;
+			     p += sizeof(*ev) + ev->len) {
+				ev = (struct inotify_event *)p;
+				if (ev->mask & IN_Q_OVERFLOW)
+					res->overflows++;
+				if (ev->mask & OP_EVENTS)
+					res->delivered++;
+				inotree_event(ev);
+			}
+			inotree_flush();
+			continue;
+		}
+		md = (struct fanotify_event_metadata *)er->buf;
+		for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+			if (md->mask & FAN_Q_OVERFLOW)
+				res->overflows++;
+			/* Merged event has all the types of the merged events */
+			res->delivered += __builtin_popcountll(md->mask & OP_EVENTS);
+			if (md->fd >= 0)
+				close(md->fd);
+		}
+	}
+	return len;
+}
+
+/*
+ * Set up the backend, report the setup result on out and count events
+ * until ctl is closed, then drain the queue and report the counts.
+ */
+static void listener(enum backend b, int out, int ctl)
+{
+	struct result res = { 0 };
+	struct pollfd fds[2];
+	struct timespec start;
+	struct evread er;
+	uint64_t mask = 0;
+	double cpu;
+	int fd = -1, nfds = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	switch (b) {
+		case BACKEND_NONE:
+			break;
+		case BACKEND_DNOTIFY:
+			fd = setup_dnotify();
+			mask = DNOTIFY_EVENTS;
+			break;
+		case BACKEND_INOTIFY:
+			fd = setup_inotify();
+			mask = INOTIFY_MASK;
+			break;
+		default:
+			fd = setup_fanotify(b, &mask);
+			break;
+	}
+	res.mask = mask;
+	res.expected = expected_events(mask);
+	res.error = b != BACKEND_NONE && fd < 0;
+	if (!res.error && b >= BACKEND_INOTIFY &&
+	    evread_init(&er, fd, b == BACKEND_INOTIFY ? EVREAD_INOTIFY :
+			EVREAD_FANOTIFY, 0, 0))
+		res.error = 1;
+	res.setup_secs = elapsed(&start);
+	cpu = cpu_secs();
+	if (write(out, &res, sizeof(res)) != sizeof(res) || res.error)
+		_exit(1);
+
+	fds[0].fd = ctl;
+	fds[0].events = POLLIN;
+	if (fd >= 0) {
+		fds[1].fd = fd;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			_exit(1);
+		}
+		/* The workload is done when ctl is closed */
+		if (fds[0].revents) {
+			if (fd >= 0 && read_events(b, fd, &er, &res) < 0)
+				perror("read events");
+			break;
+		}
+		if (nfds > 1 && fds[1].revents &&
+		    read_events(b, fd, &er, &res) < 0) {
+			perror("read events");
+			_exit(1);
+		}
+	}
+	res.cpu_secs = cpu_secs() - cpu;
+	if (write(out, &res, sizeof(res)) != sizeof(res))
+		_exit(1);
+	_exit(0);
+}
+
+/* Returns the workload wall time or -1 */
+static double run(enum backend b, double base)
+{
+	struct result res;
+	int out[2], ctl[2], status;
+	long slab0, slab1;
+	double secs;
+	pid_t pid;
+
+	if (pipe(out)) {
+		perror("pipe");
+		return -1;
+	}
+	if (pipe(ctl)) {
+		perror("pipe");
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+	usleep(SETTLE_USECS);
+	slab0 = read_slab();
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		close(out[0]);
+		close(ctl[1]);
+		listener(b, out[1], ctl[0]);
+	}
+	close(out[1]);
+	close(ctl[0]);
+
+	secs = -1;
+	if (read(out[0], &res, sizeof(res)) != sizeof(res) || res.error) {
+		fprintf(stderr, "%s: setup failed\n", backend_names[b]);
+		close(ctl[1]);
+		goto out;
+	}
+	slab1 = read_slab();
+	secs = workload();
+	close(ctl[1]);
+	if (read(out[0], &res, sizeof(res)) != sizeof(res)) {
+		fprintf(stderr, "%s: listener failed\n", backend_names[b]);
+		secs = -1;
+		goto out;
+	}
+	if (secs < 0)
+		goto out;
+
+	printf("%-8s mask=0x%llx setup=%.3fs slab=%+ld KB events=%llu lost=%llu/%llu overflows=%llu listener cpu=%.3fs workload=%.3fs (%.0f ops/s) slowdown=%+.1f%%\n",
+		backend_names[b], res.mask, res.setup_secs, slab1 - slab0, res.events,
+		res.delivered < res.expected ? res.expected - res.delivered : 0,
+		res.expected, res.overflows, res.cpu_secs, secs, ops / secs,
+		base > 0 ? (secs / base - 1) * 100 : 0);
+	fflush(stdout);
+out:
+	close(out[0]);
+	waitpid(pid, &status, 0);
+	return secs;
+}
+
+static void usage(const char *progname)
+{
+	printf("usage: %s [options] <tree root>\n", progname);
+	printf("-d <depth>            tree depth (default = 3)\n");
+	printf("-w <width>            subdirs per dir (default = 10)\n");
+	printf("-c <files>            files per leaf dir (default = 0)\n");
+	printf("-n                    use the existing tree, do not run mktree\n");
+	printf("-o <ops>              workload ops (default = 100000)\n");
+	printf("-s <seed>             seed of the workload dirs (default = 0)\n");
+	printf("-b <backends>         comma separated list of dnotify,inotify,inode,mount,fs (default = all)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[PATH_MAX] = ".";
+	int selected[BACKEND_MAX] = { 0 };
+	int build = 1, all = 1;
+	char *name, *list;
+	double base;
+	int c, b;
+
+	while ((c = getopt(argc, argv, "d:w:c:no:s:b:")) != -1) {
+		switch (c) {
+			case 'd':
+				tree_depth = atoi(optarg);
+				break;
+			case 'w':
+				tree_width = atoi(optarg);
+				break;
+			case 'c':
+				leaf_files = atoi(optarg);
+				break;
+			case 'n':
+				build = 0;
+				break;
+			case 'o':
+				ops = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			case 'b':
+				all = 0;
+				for (list = optarg; (name = strsep(&list, ","));) {
+					for (b = 1; b < BACKEND_MAX; b++) {
+						if (!strcmp(name, backend_names[b]))
+							break;
+					}
+					if (b == BACKEND_MAX)
+						usage(argv[0]);
+					selected[b] = 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind >= argc || ops <= 0)
+		usage(argv[0]);
+
+	if (build && build_tree(argv[0], argv[optind]))
+		exit(EXIT_FAILURE);
+	if (chdir(argv[optind])) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	if (walk_dir(path, 1))
+		exit(EXIT_FAILURE);
+	printf("tree %s: %d dirs, workload: %d ops (%llu inotify events)\n",
+		argv[optind], ndirs, ops, expected_events(INOTIFY_MASK));
+	fflush(stdout);
+
+	base = run(BACKEND_NONE, 0);
+	if (base < 0)
+		exit(EXIT_FAILURE);
+	for (b = 1; b < BACKEND_MAX; b++) {
+		if (all || selected[b])
+			run(b, base);
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * pathbench - fanotify event fd path resolution benchmark
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ *
+ * Opens files at the bottom of a deep tree and measures the cost per event
+ * of readlink() of /proc/self/fd, of fdpath_get() on a warm cache and of
+ * revalidating a cached path with a statx() of the path.
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "fdpath.h"
+
+#define NFILES 64
+#define DEPTH 8
+
+/* Leave room in path buffers for the "/fileN" suffix */
+static char dir[PATH_MAX - 16];
+static int fds[NFILES];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void setup(const char *root)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (snprintf(dir, sizeof(dir), "%s/pathbench.%d", root, getpid()) +
+	    DEPTH * strlen("/subdir") >= sizeof(dir)) {
+		fprintf(stderr, "%s: path too long\n", root);
+		exit(EXIT_FAILURE);
+	}
+	if (mkdir(dir, 0755)) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < DEPTH; i++) {
+		strcat(dir, "/subdir");
+		if (mkdir(dir, 0755)) {
+			perror(dir);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		fds[i] = open(path, O_RDONLY | O_CREAT, 0644);
+		if (fds[i] < 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void cleanup(const char *root)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "%s/file%d", dir, i);
+		close(fds[i]);
+		unlink(path);
+	}
+	for (i = 0; i <= DEPTH; i++) {
+		rmdir(dir);
+		*strrchr(dir, '/') = 0;
+	}
+}
+
+static void report(const char *name, double start, int loops)
+{
+	printf("%-20s %.0f ns/event\n", name,
+		(now() - start) * 1e9 / ((double)loops * NFILES));
+}
+
+int main(int argc, char *argv[])
+{
+	const char *root = argc > 1 ? argv[1] : "/tmp";
+	int loops = argc > 2 ? atoi(argv[2]) : 10000;
+	char procfd_path[64], path[PATH_MAX];
+	struct statx stx;
+	double start;
+	int i, j;
+
+	setup(root);
+
+	start = now();
+	for (j = 0; j < loops; j++) {
+		for (i = 0; i < NFILES; i++) {
+			snprintf(procfd_path, sizeof(procfd_path),
+				 "/proc/self/fd/%d", fds[i]);
+			if (readlink(procfd_path, path, sizeof(path) - 1) < 0) {
+				perror("readlink");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	report("readlink", start, loops);
+
+	fdpath_init(NFILES);
+	start = now();
+	for (j = 0; j < loops; j++) {
+		for (i = 0; i < NFILES; i++) {
+			if (!fdpath_get(fds[i]))
+				exit(EXIT_FAILURE);
+		}
+	}
+	report("fdpath_get", start, loops);
+
+	/* Cost of a cache hit that is also checked by a statx() of the path */
+	start = now();
+	for (j = 0; j < loops; j++) {
+		for (i = 0; i < NFILES; i++) {
+			const char *p = fdpath_get(fds[i]);
+
+			if (!p || statx(AT_FDCWD, p, AT_SYMLINK_NOFOLLOW,
+					STATX_INO | STATX_BTIME, &stx)) {
+				perror("statx");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	report("fdpath_get+statx", start, loops);
+
+	fdpath_print_stats();
+	cleanup(root);
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * permq - multi threaded fanotify permission event responder
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "permq.h"
+#include "lathist.h"
+
+#define PERM_QUEUE_SIZE 4096	/* must be a power of 2 */
+#define PERM_BATCH 64
+
+struct perm_req {
+	int fd;
+	int pid;
+	uint64_t mask;
+	uint64_t t_read;	/* when the event was read */
+	uint32_t response;
+};
+
+/* Bounded FIFO, which readers drain until it is closed and empty */
+struct perm_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct perm_req reqs[PERM_QUEUE_SIZE];
+	unsigned int head, tail;
+	int closed;
+};
+
+static struct perm_queue requests, completions;
+static int fanotify_fd = -1;
+static perm_decide_t perm_decide;
+static int nworkers;
+static pthread_t *workers, responder;
+
+/* Decision latency of all workers and response latency of responder */
+static struct lat_hist decision_hist, response_hist;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long nresponses, nwrites;
+
+static void queue_init(struct perm_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->head = q->tail = 0;
+	q->closed = 0;
+}
+
+static void queue_put(struct perm_queue *q, struct perm_req *req)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->tail - q->head == PERM_QUEUE_SIZE)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	q->reqs[q->tail++ & (PERM_QUEUE_SIZE - 1)] = *req;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Get up to max requests - returns 0 when queue is closed and empty */
+static int queue_get(struct perm_queue *q, struct perm_req *reqs, int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->head == q->tail && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	while (n < max && q->head != q->tail)
+		reqs[n++] = q->reqs[q->head++ & (PERM_QUEUE_SIZE - 1)];
+	if (n)
+		pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+static void queue_close(struct perm_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void *perm_worker(void *arg)
+{
+	struct lat_hist *hist = calloc(1, sizeof(*hist));
+	struct perm_req req;
+	uint64_t t;
+
+	while (queue_get(&requests, &req, 1)) {
+		t = lat_now_ns();
+		req.response = perm_decide(req.fd, req.mask, req.pid);
+		if (hist)
+			lat_hist_add(hist, lat_now_ns() - t);
+		queue_put(&completions, &req);
+	}
+
+	if (hist) {
+		pthread_mutex_lock(&hist_lock);
+		lat_hist_merge(&decision_hist, hist);
+		pthread_mutex_unlock(&hist_lock);
+		free(hist);
+	}
+	return NULL;
+}
+
+static void *perm_responder(void *arg)
+{
+	struct perm_req reqs[PERM_BATCH];
+	struct fanotify_response resp[PERM_BATCH];
+	struct iovec iov[PERM_BATCH];
+	ssize_t res;
+	uint64_t t;
+	int i, n, done;
+
+	while ((n = queue_get(&completions, reqs, PERM_BATCH))) {
+		for (i = 0; i < n; i++) {
+			resp[i].fd = reqs[i].fd;
+			resp[i].response = reqs[i].response;
+			iov[i].iov_base = &resp[i];
+			iov[i].iov_len = sizeof(resp[i]);
+		}
+		/*
+		 * fanotify has no write_iter, so writev() writes every iovec
+		 * as a separate response and stops at the first failed one.
+		 */
+		for (done = 0; done < n;) {
+			res = writev(fanotify_fd, iov + done, n - done);
+			nwrites++;
+			if (res < 0) {
+				perror("write response");
+				done++;
+				continue;
+			}
+			done += res / sizeof(struct fanotify_response);
+		}
+		t = lat_now_ns();
+		for (i = 0; i < n; i++) {
+			lat_hist_add(&response_hist, t - reqs[i].t_read);
+			close(reqs[i].fd);
+		}
+		nresponses += n;
+	}
+	return NULL;
+}
+
+int perm_start(int fd, int n, perm_decide_t decide)
+{
+	int i, ret;
+
+	fanotify_fd = fd;
+	perm_decide = decide;
+	queue_init(&requests);
+	queue_init(&completions);
+
+	workers = calloc(n, sizeof(pthread_t));
+	if (!workers) {
+		perror("alloc permission workers");
+		return -1;
+	}
+	ret = pthread_create(&responder, NULL, perm_responder, NULL);
+	for (i = 0; !ret && i < n; i++) {
+		ret = pthread_create(&workers[i], NULL, perm_worker, NULL);
+		if (!ret)
+			nworkers++;
+	}
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+void perm_submit(const struct fanotify_event_metadata *metadata)
+{
+	struct perm_req req = {
+		.fd = metadata->fd,
+		.pid = metadata->pid,
+		.mask = metadata->mask,
+		.t_read = lat_now_ns(),
+	};
+
+	queue_put(&requests, &req);
+}
+
+void perm_stop(void)
+{
+	int i;
+
+	queue_close(&requests);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	queue_close(&completions);
+	pthread_join(responder, NULL);
+	free(workers);
+	workers = NULL;
+
+	printf("Permission events: workers=%d responses=%llu writes=%llu (%.1f responses/write)\n",
+		nworkers, nresponses, nwrites, nwrites ? (double)nresponses / nwrites : 0);
+	lat_hist_print("decision", &decision_hist);
+	lat_hist_print("response", &response_hist);
+	nworkers = 0;
+}
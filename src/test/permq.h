@@ -0,0 +1,26 @@
+#ifndef _PERMQ_H
+#define _PERMQ_H
+
+#include <stdint.h>
+#include <sys/fanotify.h>
+
+/*
+ * Permission event responder: the thread that reads fanotify events submits
+ * permission events to a pool of workers that make the decisions, and a
+ * responder thread writes the decisions back in batches, so one slow
+ * decision does not stall the openers of other files.
+ *
+ * decide(event fd, event mask, pid) returns FAN_ALLOW or FAN_DENY and
+ * may be called concurrently from all workers.
+ */
+typedef int (*perm_decide_t)(int fd, uint64_t mask, int pid);
+
+int perm_start(int fanotify_fd, int nworkers, perm_decide_t decide);
+
+/* Takes ownership of the event fd, which is closed after the response */
+void perm_submit(const struct fanotify_event_metadata *metadata);
+
+/* Drain queued events, stop all threads and print stats */
+void perm_stop(void);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * randbench - benchmark mktree random data generators on one core
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include "xorshift.h"
+#include "blockrand.h"
+
+#define MB (1024 * 1024)
+
+static uint32_t state[4] = { 1, 2, 3, 4 };
+static uint32_t buf[MB / 4] __attribute__((aligned(64)));
+static uint32_t ref[MB / 4] __attribute__((aligned(64)));
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_xorshift(size_t len, uint64_t key)
+{
+	uint32_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < len >> 2; i++)
+		*p++ = xorshift128(state);
+}
+
+static blockrand_words_t words;
+
+static void fill_blockrand(size_t len, uint64_t key)
+{
+	blockrand_fill(words, buf, len, 0x5eed, key, 0);
+}
+
+static void bench(const char *name, void (*fill)(size_t, uint64_t),
+		  size_t len, double secs)
+{
+	double start = now(), t;
+	uint64_t n = 0;
+
+	do {
+		fill(len, n++);
+		t = now() - start;
+	} while (t < secs);
+
+	printf("%-12s %8.2f GB/s\n", name, (double)n * len / t / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *impls[] = { "scalar", "sse2", "avx2" };
+	const char *progname = basename(argv[0]);
+	double secs = 1;
+	size_t len = MB;
+	int i;
+
+	if (argc > 1)
+		secs = atof(argv[1]);
+	if (argc > 2)
+		len = atoi(argv[2]) * 1024;
+	if (len < 4 || len > MB) {
+		fprintf(stderr, "usage: %s [seconds] [buffer size KB (<= 1024)]\n", progname);
+		exit(1);
+	}
+
+	printf("%s seconds=%.1f buffer=%zuKB\n", progname, secs, len / 1024);
+
+	bench("xorshift128", fill_xorshift, len, secs);
+
+	blockrand_fill(blockrand_words_scalar, ref, len, 0x5eed, 0, 0);
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		words = blockrand_impl(impls[i]);
+		if (!words) {
+			printf("%-12s not supported\n", impls[i]);
+			continue;
+		}
+		/* All implementations must generate the same data */
+		blockrand_fill(words, buf, len, 0x5eed, 0, 0);
+		if (memcmp(buf, ref, len)) {
+			fprintf(stderr, "%s: data mismatch\n", impls[i]);
+			exit(1);
+		}
+		bench(impls[i], fill_blockrand, len, secs);
+	}
+
+	return 0;
+}
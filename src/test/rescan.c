@@ -0,0 +1,418 @@
+/*
+ * rescan - recover from event queue overflow by rescanning changed dirs
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "rescan.h"
+
+#define DENTS_BUF_SIZE (64 * 1024)
+#define NSEC_PER_SEC 1000000000LL
+#define RESCAN_MAX_THREADS 64
+
+struct rescan_stats rescan_stats;
+
+static int nthreads = 1;
+static rescan_fn emit_fn;
+static struct rescan_dir *dirs;
+static struct rescan_dir **work;
+static int nwork, next_work;
+static __thread char *dents_buf;
+
+/* Snapshot under construction */
+struct builder {
+	struct rescan_snap *s;
+	int size;
+	size_t names_len, names_size;
+};
+
+static int64_t ts_ns(const struct statx_timestamp *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int rescan_init(int threads, rescan_fn emit)
+{
+	if (threads < 1)
+		threads = 1;
+	nthreads = threads < RESCAN_MAX_THREADS ? threads : RESCAN_MAX_THREADS;
+	emit_fn = emit;
+	return 0;
+}
+
+struct rescan_dir *rescan_add(const char *path, void *data)
+{
+	struct rescan_dir *d = calloc(1, sizeof(*d));
+
+	if (!d || !(d->path = strdup(path))) {
+		perror("alloc rescan dir");
+		free(d);
+		return NULL;
+	}
+	d->data = data;
+	d->next = dirs;
+	dirs = d;
+	return d;
+}
+
+void rescan_overflow(struct rescan_dir *d)
+{
+	d->overflow = 1;
+}
+
+void rescan_refresh(struct rescan_dir *d)
+{
+	d->refresh = 1;
+}
+
+static void free_snap(struct rescan_snap *s)
+{
+	free(s->entries);
+	free(s->names);
+	memset(s, 0, sizeof(*s));
+}
+
+static int add_name(struct builder *b, const char *name, uint8_t type)
+{
+	struct rescan_snap *s = b->s;
+	size_t len = strlen(name) + 1;
+	struct rescan_entry *e;
+	void *p;
+
+	if (s->nentries == b->size) {
+		b->size = b->size ? b->size * 2 : 64;
+		p = realloc(s->entries, b->size * sizeof(*e));
+		if (!p)
+			return -1;
+		s->entries = p;
+	}
+	if (b->names_len + len > b->names_size) {
+		while (b->names_len + len > b->names_size)
+			b->names_size = b->names_size ? b->names_size * 2 : 4096;
+		p = realloc(s->names, b->names_size);
+		if (!p)
+			return -1;
+		s->names = p;
+	}
+	e = &s->entries[s->nentries++];
+	memset(e, 0, sizeof(*e));
+	e->name = b->names_len;
+	e->type = type;
+	memcpy(s->names + b->names_len, name, len);
+	b->names_len += len;
+	return 0;
+}
+
+static int cmp_entry(const void *a, const void *b, void *names)
+{
+	return strcmp((char *)names + ((const struct rescan_entry *)a)->name,
+		      (char *)names + ((const struct rescan_entry *)b)->name);
+}
+
+/* Returns 1 if entry does not exist */
+static int stat_entry(int dfd, struct rescan_dir *d, struct rescan_snap *s,
+		      struct rescan_entry *e)
+{
+	struct statx stx;
+
+	d->nstats++;
+	if (statx(dfd, s->names + e->name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+		  STATX_TYPE | STATX_INO | STATX_MTIME | STATX_SIZE, &stx))
+		return errno == ENOENT ? 1 : -1;
+
+	e->ino = stx.stx_ino;
+	e->mtime = ts_ns(&stx.stx_mtime);
+	e->size = stx.stx_size;
+	if (e->type == DT_UNKNOWN)
+		e->type = IFTODT(stx.stx_mode);
+	return 0;
+}
+
+/* List dir with getdents64 and stat all entries */
+static int list_dir(int dfd, struct rescan_dir *d)
+{
+	struct builder b = { .s = &d->scan };
+	struct rescan_entry *e;
+	struct dirent64 *de;
+	ssize_t n, off;
+	int i, j, ret;
+
+	if (!dents_buf && !(dents_buf = malloc(DENTS_BUF_SIZE)))
+		return -1;
+
+	while ((n = getdents64(dfd, dents_buf, DENTS_BUF_SIZE)) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct dirent64 *)(dents_buf + off);
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			if (add_name(&b, de->d_name, de->d_type))
+				return -1;
+		}
+	}
+	if (n < 0)
+		return -1;
+	d->scan.names_len = b.names_len;
+
+	qsort_r(d->scan.entries, d->scan.nentries, sizeof(*e), cmp_entry,
+		d->scan.names);
+
+	/* Drop entries that were removed while listing */
+	for (i = j = 0; i < d->scan.nentries; i++) {
+		e = &d->scan.entries[i];
+		ret = stat_entry(dfd, d, &d->scan, e);
+		if (ret < 0)
+			return -1;
+		if (!ret)
+			d->scan.entries[j++] = *e;
+	}
+	d->scan.nentries = j;
+	return 0;
+}
+
+/* Latest snapshot of dir, to check if it changed since */
+static struct rescan_snap *last_snap(struct rescan_dir *d)
+{
+	return d->has_fresh ? &d->fresh : &d->snap;
+}
+
+/* Stat known entries of unchanged dir - returns 1 if an entry is gone */
+static int restat_dir(int dfd, struct rescan_dir *d)
+{
+	struct rescan_snap *s = &d->scan, *last = last_snap(d);
+	int i, ret;
+
+	s->entries = malloc(last->nentries * sizeof(*s->entries) + 1);
+	s->names = malloc(last->names_len + 1);
+	if (!s->entries || !s->names)
+		return -1;
+	s->nentries = last->nentries;
+	s->names_len = last->names_len;
+	memcpy(s->entries, last->entries, s->nentries * sizeof(*s->entries));
+	memcpy(s->names, last->names, s->names_len);
+
+	for (i = 0; i < s->nentries; i++) {
+		ret = stat_entry(dfd, d, s, &s->entries[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void scan_dir(struct rescan_dir *d)
+{
+	struct statx stx;
+	int ret = -1;
+	int dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dfd < 0)
+		goto out;
+
+	/* Before listing, so a change while listing is seen by the next check */
+	if (statx(dfd, "", AT_EMPTY_PATH, STATX_MTIME | STATX_CTIME, &stx))
+		goto out;
+
+	d->scan.mtime = ts_ns(&stx.stx_mtime);
+	d->scan.ctime = ts_ns(&stx.stx_ctime);
+	d->listed = 0;
+	d->nstats = 0;
+	if (d->scanned && d->scan.mtime == last_snap(d)->mtime &&
+	    d->scan.ctime == last_snap(d)->ctime) {
+		ret = restat_dir(dfd, d);
+		if (ret <= 0)
+			goto out;
+	}
+
+	/* Entries are placed by names, so start over with an empty snapshot */
+	free(d->scan.entries);
+	free(d->scan.names);
+	d->scan.entries = NULL;
+	d->scan.names = NULL;
+	d->scan.nentries = 0;
+	d->scan.names_len = 0;
+	d->listed = 1;
+	ret = list_dir(dfd, d);
+out:
+	d->error = ret ? errno : 0;
+	if (dfd >= 0)
+		close(dfd);
+}
+
+static void *scan_worker(void *arg)
+{
+	int i;
+
+	while ((i = __sync_fetch_and_add(&next_work, 1)) < nwork)
+		scan_dir(work[i]);
+	free(dents_buf);
+	dents_buf = NULL;
+	return NULL;
+}
+
+static int emit(struct rescan_dir *d, struct rescan_snap *s,
+		struct rescan_entry *e, enum rescan_event event)
+{
+	switch (event) {
+		case RESCAN_CREATE:
+			rescan_stats.created++;
+			break;
+		case RESCAN_DELETE:
+			rescan_stats.deleted++;
+			break;
+		case RESCAN_MODIFY:
+			rescan_stats.modified++;
+			break;
+	}
+	emit_fn(d, s->names + e->name, event);
+	return 1;
+}
+
+/* Report the differences of the new scan from the snapshot */
+static int diff_dir(struct rescan_dir *d)
+{
+	struct rescan_snap *o = &d->snap, *n = &d->scan;
+	struct rescan_entry *oe, *ne;
+	int i = 0, j = 0, cmp, nevents = 0;
+
+	while (i < o->nentries || j < n->nentries) {
+		oe = i < o->nentries ? &o->entries[i] : NULL;
+		ne = j < n->nentries ? &n->entries[j] : NULL;
+		if (!oe)
+			cmp = 1;
+		else if (!ne)
+			cmp = -1;
+		else
+			cmp = strcmp(o->names + oe->name, n->names + ne->name);
+
+		if (cmp < 0) {
+			nevents += emit(d, o, oe, RESCAN_DELETE);
+			i++;
+		} else if (cmp > 0) {
+			nevents += emit(d, n, ne, RESCAN_CREATE);
+			j++;
+		} else {
+			if (oe->ino != ne->ino) {
+				/* Replaced by another object with the same name */
+				nevents += emit(d, o, oe, RESCAN_DELETE);
+				nevents += emit(d, n, ne, RESCAN_CREATE);
+			} else if (ne->type != DT_DIR && (oe->mtime != ne->mtime ||
+							 oe->size != ne->size)) {
+				nevents += emit(d, n, ne, RESCAN_MODIFY);
+			}
+			i++;
+			j++;
+		}
+	}
+	return nevents;
+}
+
+int rescan_run(void)
+{
+	pthread_t threads[RESCAN_MAX_THREADS];
+	struct rescan_dir *d;
+	int64_t start = now_ns();
+	int i, n, nevents = 0, overflow = 0;
+
+	nwork = next_work = 0;
+	for (d = dirs; d; d = d->next) {
+		if (!d->scanned || d->overflow || d->refresh)
+			nwork++;
+	}
+	if (!nwork)
+		return 0;
+	free(work);
+	work = malloc(nwork * sizeof(*work));
+	if (!work) {
+		perror("alloc rescan work");
+		return -1;
+	}
+	for (d = dirs, i = 0; d; d = d->next) {
+		if (!d->scanned || d->overflow || d->refresh)
+			work[i++] = d;
+	}
+
+	/* The calling thread scans too */
+	n = nwork < nthreads ? nwork : nthreads;
+	for (i = 0; i < n - 1; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, NULL)) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	n = i;
+	scan_worker(NULL);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nwork; i++) {
+		d = work[i];
+		if (d->error) {
+			fprintf(stderr, "rescan %s: %s\n", d->path, strerror(d->error));
+			free_snap(&d->scan);
+			d->refresh = 0;
+			continue;
+		}
+		if (d->overflow) {
+			rescan_stats.checked++;
+			rescan_stats.listed += d->listed;
+			rescan_stats.stats += d->nstats;
+			overflow = 1;
+			/* Dropped events may be in the fresh snapshot */
+			free_snap(&d->fresh);
+			d->has_fresh = 0;
+		} else if (d->scanned && d->refresh) {
+			rescan_stats.refreshed++;
+			/* No overflow since fresh snapshot was taken */
+			if (d->has_fresh) {
+				free_snap(&d->snap);
+				d->snap = d->fresh;
+			}
+			d->fresh = d->scan;
+			d->has_fresh = 1;
+			memset(&d->scan, 0, sizeof(d->scan));
+			d->refresh = 0;
+			continue;
+		}
+		if (d->scanned)
+			nevents += diff_dir(d);
+		free_snap(&d->snap);
+		d->snap = d->scan;
+		memset(&d->scan, 0, sizeof(d->scan));
+		d->scanned = 1;
+		d->overflow = 0;
+		d->refresh = 0;
+	}
+
+	if (overflow) {
+		rescan_stats.runs++;
+		rescan_stats.ns += now_ns() - start;
+	}
+	return nevents;
+}
+
+void rescan_print_stats(void)
+{
+	printf("Rescan: runs=%llu checked=%llu listed=%llu refreshed=%llu stats=%llu created=%llu deleted=%llu modified=%llu time=%.3f sec\n",
+		rescan_stats.runs, rescan_stats.checked, rescan_stats.listed,
+		rescan_stats.refreshed,
+		rescan_stats.stats, rescan_stats.created, rescan_stats.deleted,
+		rescan_stats.modified, rescan_stats.ns / 1e9);
+}
@@ -0,0 +1,93 @@
+#ifndef _RESCAN_H
+#define _RESCAN_H
+
+#include <stdint.h>
+
+/*
+ * Recovery from event queue overflow by targeted rescan.
+ *
+ * A compact snapshot is kept for every watched dir: the dir mtime/ctime
+ * and a sorted array of its entries with ino, mtime and size. After an
+ * overflow, the flagged dirs are checked by worker threads. Dirs whose
+ * mtime/ctime did not change are not listed again, only their known
+ * entries are stat'ed to find modified files. Changed dirs are listed with
+ * getdents64 and all entries are stat'ed with statx. The differences from
+ * the snapshot are reported as synthetic create/delete/modify events and
+ * the snapshot is updated.
+ *
+ * Changes that were delivered by events are not reported again if the
+ * listener calls rescan_refresh() after every drained read without an
+ * overflow. The refreshed snapshot becomes the base for the next overflow
+ * only after the next drained read without an overflow, because a change
+ * whose event was dropped may be in it. Changes delivered by events since
+ * the base snapshot may still be reported again.
+ */
+enum rescan_event {
+	RESCAN_CREATE,
+	RESCAN_DELETE,
+	RESCAN_MODIFY,
+};
+
+struct rescan_entry {
+	uint64_t ino;
+	int64_t mtime;		/* ns */
+	uint64_t size;
+	uint32_t name;		/* offset in names */
+	uint8_t type;		/* DT_* */
+};
+
+struct rescan_snap {
+	int64_t mtime, ctime;	/* ns, of the dir */
+	int nentries;
+	struct rescan_entry *entries;	/* sorted by name */
+	char *names;
+	size_t names_len;
+};
+
+struct rescan_dir {
+	struct rescan_dir *next;
+	char *path;
+	void *data;
+	int scanned;		/* snapshot was taken */
+	int overflow;		/* rescan on next rescan_run() */
+	int refresh;		/* take fresh snapshot on next rescan_run() */
+	int has_fresh;		/* fresh snapshot was taken */
+	int listed;		/* last scan listed the dir */
+	int nstats;		/* entries stat'ed by last scan */
+	int error;
+	struct rescan_snap snap, scan, fresh;
+};
+
+/* Called with name of entry in dir, from the thread that calls rescan_run() */
+typedef void (*rescan_fn)(struct rescan_dir *dir, const char *name,
+			  enum rescan_event event);
+
+struct rescan_stats {
+	unsigned long long runs;
+	unsigned long long checked;	/* dirs checked after overflow */
+	unsigned long long listed;	/* dirs listed with getdents64 */
+	unsigned long long refreshed;	/* snapshots taken after events */
+	unsigned long long stats;	/* entries stat'ed */
+	unsigned long long created, deleted, modified;
+	uint64_t ns;			/* time spent in rescans */
+};
+
+extern struct rescan_stats rescan_stats;
+
+int rescan_init(int threads, rescan_fn emit);
+
+/* Add a watched dir - its snapshot is taken on the next rescan_run() */
+struct rescan_dir *rescan_add(const char *path, void *data);
+
+/* Flag dir for rescan after a queue overflow */
+void rescan_overflow(struct rescan_dir *dir);
+
+/* Events of dir were read until the queue was drained without overflow */
+void rescan_refresh(struct rescan_dir *dir);
+
+/* Snapshot new dirs and rescan flagged dirs - returns number of events */
+int rescan_run(void);
+
+void rescan_print_stats(void);
+
+#endif
@@ -15,6 +15,12 @@
 #include <stdlib.h>
 #include <sys/fanotify.h>
 #include <unistd.h>
+#include "fdpath.h"
+#include "evread.h"
+#include "ignore.h"
+
+static struct evread events;
+static int ignore_threshold;
 
 /* Read all available fanotify events from the file descriptor 'fd' */
 
@@ -22,11 +28,8 @@ static void
 handle_events(int fd)
 {
     const struct fanotify_event_metadata *metadata;
-    struct fanotify_event_metadata buf[200];
     ssize_t len;
-    char path[PATH_MAX];
-    ssize_t path_len;
-    char procfd_path[PATH_MAX];
+    const char *path;
     struct fanotify_response response;
 
     /* Loop while events can be read from fanotify file descriptor */
@@ -35,8 +38,8 @@ handle_events(int fd)
 
         /* Read some events */
 
-        len = read(fd, (void *) &buf, sizeof(buf));
-        if (len == -1 && errno != EAGAIN) {
+        len = evread(&events);
+        if (len == -1) {
             perror("read");
             exit(EXIT_FAILURE);
         }
@@ -48,7 +51,7 @@ handle_events(int fd)
 
         /* Point to the first event in the buffer */
 
-        metadata = buf;
+        metadata = (struct fanotify_event_metadata *) events.buf;
 
         /* Loop over all events in the buffer */
 
@@ -64,7 +67,10 @@ handle_events(int fd)
 
             /* metadata->fd contains either FAN_NOFD, indicating a
                queue overflow, or a file descriptor (a nonnegative
-               integer). Here, we simply ignore queue overflow. */
+               integer). On queue overflow, cached paths may be stale. */
+
+            if (metadata->fd < 0 && (metadata->mask & FAN_Q_OVERFLOW))
+                fdpath_invalidate_all();
 
             if (metadata->fd >= 0) {
 
@@ -88,18 +94,17 @@ handle_events(int fd)
 
                 /* Retrieve and print pathname of the accessed file */
 
-                snprintf(procfd_path, sizeof(procfd_path),
-                         "/proc/self/fd/%d", metadata->fd);
-                path_len = readlink(procfd_path, path,
-                                    sizeof(path) - 1);
-                if (path_len == -1) {
-                    perror("readlink");
+                path = fdpath_get(metadata->fd);
+                if (!path)
                     exit(EXIT_FAILURE);
-                }
 
-                path[path_len] = '\0';
                 printf("File %s\n", path);
 
+                /* Suppress events of noisy dirs in the kernel */
+
+                if (ignore_threshold)
+                    ignore_event(path);
+
                 /* Close the file descriptor of the event */
 
                 close(metadata->fd);
@@ -122,10 +127,14 @@ main(int argc, char *argv[])
 
     /* Check mount point is supplied */
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s MOUNT\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s MOUNT [ignore threshold events/sec]\n", argv[0]);
+        fprintf(stderr, "Event paths are cached per inode and are not rename-safe:\n"
+                        "a file may be printed by its old path after it was renamed.\n");
         exit(EXIT_FAILURE);
     }
+    if (argc > 2)
+        ignore_threshold = atoi(argv[2]);
 
     printf("Press enter key to terminate.\n");
 
@@ -137,6 +146,11 @@ main(int argc, char *argv[])
         perror("fanotify_init");
         exit(EXIT_FAILURE);
     }
+    if (evread_init(&events, fd, EVREAD_FANOTIFY, 0, 0))
+        exit(EXIT_FAILURE);
+    if (ignore_threshold &&
+        ignore_init(fd, FAN_OPEN_PERM | FAN_CLOSE_WRITE, ignore_threshold))
+        exit(EXIT_FAILURE);
 
     /* Mark the mount for:
        - permission events before opening files
@@ -188,7 +202,11 @@ main(int argc, char *argv[])
     printf("Listening for events.\n");
 
     while (1) {
-        poll_num = poll(fds, nfds, -1);
+        /* Wake up every second to expire ignore marks */
+
+        poll_num = poll(fds, nfds, ignore_threshold ? 1000 : -1);
+        if (ignore_threshold)
+            ignore_expire();
         if (poll_num == -1) {
             if (errno == EINTR)     /* Interrupted by a signal */
                 continue;           /* Restart poll() */
@@ -217,5 +235,9 @@ main(int argc, char *argv[])
     }
 
     printf("Listening for events stopped.\n");
+    evread_print_stats(&events);
+    fdpath_print_stats();
+    if (ignore_threshold)
+        ignore_print_stats();
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,200 @@
+/*
+ * uring - minimal io_uring ring without liburing
+ *
+ * Copyright (C) 2016 CTERA Network by Amir Goldstein <amir73il@gmail.com>
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Setup a ring with at least entries sqes and nfiles empty fixed file
+ * slots, which ops may use to pass a file opened by a linked openat.
+ */
+int uring_init(struct uring *r, unsigned entries, unsigned nfiles)
+{
+	struct io_uring_params p;
+	int *files;
+	unsigned i;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = 0;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail;
+	r->cq_ptr = r->sq_ptr;
+	if (r->cq_len) {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->sq_entries = p.sq_entries;
+	r->sq_head = r->sq_ptr + p.sq_off.head;
+	r->sq_tail = r->sq_ptr + p.sq_off.tail;
+	r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ptr + p.sq_off.array;
+	r->cq_head = r->cq_ptr + p.cq_off.head;
+	r->cq_tail = r->cq_ptr + p.cq_off.tail;
+	r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+	r->cqes = r->cq_ptr + p.cq_off.cqes;
+	r->sqe_tail = *r->sq_tail;
+
+	if (!nfiles)
+		return 0;
+
+	/* Sparse fixed file table */
+	files = malloc(nfiles * sizeof(int));
+	if (!files)
+		goto fail;
+	for (i = 0; i < nfiles; i++)
+		files[i] = -1;
+	ret = sys_io_uring_register(r->fd, IORING_REGISTER_FILES, files, nfiles);
+	free(files);
+	if (ret < 0)
+		goto fail;
+
+	return 0;
+fail:
+	ret = errno;
+	uring_exit(r);
+	errno = ret;
+	return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_len && r->cq_ptr && r->cq_ptr != MAP_FAILED)
+		munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_len);
+	if (r->fd > 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+}
+
+/* Returns 0 if all ops are supported by the kernel */
+int uring_probe(struct uring *r, const int *ops, int nops)
+{
+	struct io_uring_probe *probe;
+	size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	int i, ret;
+
+	probe = calloc(1, len);
+	if (!probe)
+		return -1;
+
+	ret = sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256);
+	for (i = 0; !ret && i < nops; i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			errno = EOPNOTSUPP;
+			ret = -1;
+		}
+	}
+	free(probe);
+	return ret;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx;
+
+	if (r->sqe_tail - head >= r->sq_entries)
+		return NULL;
+
+	idx = r->sqe_tail++ & *r->sq_mask;
+	r->sq_array[idx] = idx;
+	memset(&r->sqes[idx], 0, sizeof(r->sqes[idx]));
+	return &r->sqes[idx];
+}
+
+/* Number of sqes in the sq ring that were not consumed by the kernel yet */
+unsigned uring_sq_pending(struct uring *r)
+{
+	return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Submit all prepared sqes, including sqes left in the ring by a previous
+ * short submit, and wait for at least wait_nr completions. Returns the
+ * number of submitted sqes, which may be less than pending, or -1 with
+ * errno EAGAIN/EBUSY if none could be submitted until completions are
+ * reaped.
+ */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned to_submit = uring_sq_pending(r);
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	if (!to_submit && !wait_nr)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(r->fd, to_submit, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,31 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring submission/completion ring on top of the raw syscalls,
+ * so tools do not depend on liburing being installed.
+ */
+struct uring {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqe_tail;	/* prepared but not yet submitted sqes */
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+
+int uring_init(struct uring *r, unsigned entries, unsigned nfiles);
+void uring_exit(struct uring *r);
+int uring_probe(struct uring *r, const int *ops, int nops);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+unsigned uring_sq_pending(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#endif
@@ -14,10 +14,15 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/fanotify.h>
 #include "iter.h"
+#include "fdpath.h"
+#include "evread.h"
+#include "permq.h"
+#include "markcache.h"
 
 
 static int nmarks = 0;
@@ -26,12 +31,17 @@ static int nclose = 0;
 static int nremoved = 0;
 static int ndeleted = 0;
 static int verbose = 0;
+static int perm_workers = 0;
+static int fs_mark = 0;
+static int setup_only = 0;
+static int mark_budget = 0;
 
 static int fanotify_fd = -1;
+static struct evread events;
 
 #define EVENT_MASK (FAN_OPEN_PERM | FAN_OPEN | FAN_CLOSE | FAN_ONDIR)
 
-static int do_add_mark(const char *name, int depth, xid_t id)
+static int do_add_mark(int dirfd, const char *name, int depth, xid_t id)
 {
 	if (!depth)
 		return 0;
@@ -41,32 +51,48 @@ static int do_add_mark(const char *name, int depth, xid_t id)
 	   - notification events after closing a dir
 	   file descriptor */
 
-	if (fanotify_mark(fanotify_fd, FAN_MARK_ADD, EVENT_MASK,
-			  AT_FDCWD, name) != 0)
+	if (LAT(LAT_MARK, fanotify_mark(fanotify_fd, FAN_MARK_ADD, EVENT_MASK,
+					dirfd, name)) != 0)
 		return -1;
 
-	nmarks++;
+	/* Marks are added from all walk threads (-j) */
+	__sync_fetch_and_add(&nmarks, 1);
 	return 0;
 }
 
-static int do_rm_mark(const char *name, int depth)
+/* With -m, marks are added in BFS until the mark budget is full */
+static int do_budget_mark(int dirfd, const char *name, int depth, xid_t id)
+{
+	int ret;
+
+	if (!depth)
+		return 0;
+
+	ret = LAT(LAT_MARK, mark_cache_add(dirfd, name, 1));
+	if (ret < 0)
+		return -1;
+	/* The rest of the tree is armed by events on the flagged dirs */
+	if (ret > 0)
+		iter_stopped = 1;
+
+	return 0;
+}
+
+static int do_rm_mark(int dirfd, const char *name, int depth)
 {
 	if (!depth)
 		return 0;
 
 	return fanotify_mark(fanotify_fd, FAN_MARK_REMOVE, EVENT_MASK,
-			  AT_FDCWD, name);
+			  dirfd, name);
 }
 
 static void
 handle_events(int fd)
 {
     const struct fanotify_event_metadata *metadata;
-    struct fanotify_event_metadata buf[200];
     ssize_t len;
-    char path[PATH_MAX];
-    ssize_t path_len;
-    char procfd_path[PATH_MAX];
+    const char *path;
     struct fanotify_response response;
     struct stat st;
 
@@ -76,8 +102,8 @@ handle_events(int fd)
 
         /* Read some events */
 
-        len = read(fd, (void *) &buf, sizeof(buf));
-        if (len == -1 && errno != EAGAIN) {
+        len = evread(&events);
+        if (len == -1) {
             perror("read");
             exit(EXIT_FAILURE);
         }
@@ -89,7 +115,7 @@ handle_events(int fd)
 
         /* Point to the first event in the buffer */
 
-        metadata = buf;
+        metadata = (struct fanotify_event_metadata *) events.buf;
 
         /* Loop over all events in the buffer */
 
@@ -105,7 +131,10 @@ handle_events(int fd)
 
             /* metadata->fd contains either FAN_NOFD, indicating a
                queue overflow, or a file descriptor (a nonnegative
-               integer). Here, we simply ignore queue overflow. */
+               integer). On queue overflow, cached paths may be stale. */
+
+            if (metadata->fd < 0 && (metadata->mask & FAN_Q_OVERFLOW))
+                fdpath_invalidate_all();
 
             if (metadata->fd >= 0) {
 
@@ -113,17 +142,21 @@ handle_events(int fd)
                 if (metadata->mask & FAN_OPEN_PERM) {
                     if (verbose) printf("FAN_OPEN_PERM: ");
 
-                    /* Allow file to be opened */
-                    response.fd = metadata->fd;
-                    response.response = FAN_ALLOW;
-                    write(fd, &response,
-                          sizeof(struct fanotify_response));
+                    /* Allow file to be opened - by workers in pool mode */
+                    if (!perm_workers) {
+                        response.fd = metadata->fd;
+                        response.response = FAN_ALLOW;
+                        write(fd, &response,
+                              sizeof(struct fanotify_response));
+                    }
                 }
 
                 /* Handle open of dir event */
                 if (metadata->mask & FAN_OPEN) {
                     if (verbose) printf("FAN_OPEN: ");
 		    nopen++;
+		    if (mark_budget && !fstat(metadata->fd, &st))
+			    mark_cache_touch(metadata->fd, &st);
 		    if ((nopen % 7) == 0)
 			    sleep(1);
 		}
@@ -139,6 +172,11 @@ handle_events(int fd)
 		    if (st.st_nlink == 0) {
 			    /* Deleted dir */
 			    ndeleted++;
+			    if (verbose)
+				    fdpath_invalidate(metadata->fd);
+		    } else if (mark_budget) {
+			    /* Mark is removed when evicted from mark budget */
+			    mark_cache_touch(metadata->fd, &st);
 		    } else {
 			    /* Remove mark */
 			    if (fanotify_mark(fanotify_fd, FAN_MARK_REMOVE, EVENT_MASK,
@@ -152,21 +190,19 @@ handle_events(int fd)
 			goto next;
 
                 /* Retrieve and print pathname of the accessed file */
-                snprintf(procfd_path, sizeof(procfd_path),
-                         "/proc/self/fd/%d", metadata->fd);
-                path_len = readlink(procfd_path, path,
-                                    sizeof(path) - 1);
-                if (path_len == -1) {
-                    perror("readlink");
+                path = fdpath_get(metadata->fd);
+                if (!path)
                     exit(EXIT_FAILURE);
-                }
 
-                path[path_len] = '\0';
                 printf("File %s, mask=0x%llx\n", path, metadata->mask);
 
                 /* Close the file descriptor of the event */
 next:
-                close(metadata->fd);
+                /* Permission events are never merged with other events */
+                if (perm_workers && (metadata->mask & FAN_OPEN_PERM))
+                    perm_submit(metadata);
+                else
+                    close(metadata->fd);
             }
 
             /* Advance to next event */
@@ -232,33 +268,110 @@ static void listen_events(int fd)
         }
     }
 
+    if (perm_workers)
+        perm_stop();
     printf("Listening for events stopped. (nopen=%d, nclose=%d, nremoved=%d, ndeleted=%d)\n",
 		    nopen, nclose, nremoved, ndeleted);
+    evread_print_stats(&events);
+    if (mark_budget)
+        mark_cache_print_stats();
+    if (verbose)
+        fdpath_print_stats();
     exit(EXIT_SUCCESS);
 }
 
+static int allow_all(int fd, uint64_t mask, int pid)
+{
+	return FAN_ALLOW;
+}
+
+/*
+ * Mark all non leaf dirs of the tree with -j walk threads, or the entire
+ * filesystem with a single mark with -F, and report the setup time.
+ */
+static void add_marks(int depth)
+{
+	struct timespec start, end;
+	double secs;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (fs_mark) {
+		ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				    EVENT_MASK, AT_FDCWD, ".");
+		if (ret)
+			perror("fanotify_mark filesystem");
+		else
+			nmarks++;
+	} else if (mark_budget) {
+		/*
+		 * Mark top levels first, so lazy re-arm of the rest starts near
+		 * the root. The walk opens dirs with O_PATH, which does not
+		 * trigger our own open permission events.
+		 */
+		ret = mark_cache_init(fanotify_fd, EVENT_MASK, mark_budget) ?:
+			iter_tree(do_budget_mark, depth);
+		nmarks = mark_cache_stats.count + 1;
+	} else {
+		/* Add marks in DFS so we won't trigger our own open permission events */
+		ret = iter_tree(do_add_mark, -depth);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Setup %s: marks=%d threads=%d time=%.3f sec (%.0f marks/s)\n",
+		ret ? "failed" : "done", nmarks, fs_mark ? 1 : iter_threads,
+		secs, nmarks / (secs ?: 1e-9));
+	if (ret)
+		exit(EXIT_FAILURE);
+}
+
 void main(int argc, char *argv[])
 {
 	const char *progname = basename(argv[0]);
 	const char *path = argv[1];
 	int depth = 0;
+	int i;
 
 	if (argc < 3) {
-		printf("usage: %s <root of directory tree> <directory tree depth> [-v]\n", progname);
+		printf("usage: %s <root of directory tree> <directory tree depth> [options]\n", progname);
+		printf("options:\n");
+		printf("-v                    print event paths (cached per inode, not rename-safe)\n");
+		printf("-p <workers>          answer permission events from a pool of workers\n");
+		printf("-w <dirtree width>    (default = 32)\n");
+		printf("-j <threads>          (default = 1, add marks from parallel walk threads)\n");
+		printf("-F                    add a single filesystem mark instead of marks on tree dirs\n");
+		printf("-m <budget>           keep at most <budget> marks on recently active dirs\n");
+		printf("-b                    benchmark setup time - exit after adding marks\n");
 		exit(1);
 	}
 
-	depth = atoi(argv[2]);
+	tree_depth = depth = atoi(argv[2]);
 
 	if (chdir(path)) {
 		perror(path);
 		exit(1);
 	}
 
-	if (argc > 3 && !strcmp(argv[3], "-v"))
-		verbose = 1;
+	for (i = 3; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else if (!strcmp(argv[i], "-F"))
+			fs_mark = 1;
+		else if (!strcmp(argv[i], "-b"))
+			setup_only = 1;
+		else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+			perm_workers = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+			tree_width = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-j") && i + 1 < argc)
+			iter_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+			mark_budget = atoi(argv[++i]);
+	}
 
-	printf("%s %s tree_depth=%d, verbose=%d\n", progname, path, depth, verbose);
+	printf("%s %s tree_depth=%d, tree_width=%d, verbose=%d, perm_workers=%d\n",
+			progname, path, depth, tree_width, verbose, perm_workers);
 
 	fanotify_fd = fanotify_init(FAN_CLOEXEC | FAN_CLASS_CONTENT | FAN_NONBLOCK,
 				    O_RDONLY | O_LARGEFILE);
@@ -267,8 +380,15 @@ void main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	/* Add marks in DFS so we won't trigger our own open permission events */
-	iter_tree(do_add_mark, -depth);
+	if (evread_init(&events, fanotify_fd, EVREAD_FANOTIFY, 0, 0))
+		exit(EXIT_FAILURE);
+
+	if (perm_workers && perm_start(fanotify_fd, perm_workers, allow_all))
+		exit(EXIT_FAILURE);
+
+	add_marks(depth);
+	if (setup_only)
+		exit(EXIT_SUCCESS);
 
 	/* Listen until user input - remove marks on dir close events */
 	listen_events(fanotify_fd);
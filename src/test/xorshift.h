@@ -20,6 +20,60 @@ static inline uint32_t xorshift128(uint32_t state[static 4])
 	return t;
 }
 
+/*
+ * xorshift128 is linear over GF(2), so n steps are a 128x128 bit matrix.
+ * jump[k] holds the columns of the matrix for 2^k steps, which lets us
+ * seek the generator to any offset in at most 64 matrix-vector products.
+ */
+typedef uint32_t xorshift128_mat_t[128][4];
+
+static inline void xorshift128_mat_vec(xorshift128_mat_t m, uint32_t v[static 4])
+{
+	uint32_t r[4] = { 0, 0, 0, 0 };
+	int j, k;
+
+	for (j = 0; j < 128; j++) {
+		if (!(v[j >> 5] & (1U << (j & 31))))
+			continue;
+		for (k = 0; k < 4; k++)
+			r[k] ^= m[j][k];
+	}
+	for (k = 0; k < 4; k++)
+		v[k] = r[k];
+}
+
+static inline void xorshift128_jump_init(xorshift128_mat_t jump[64])
+{
+	int j, k;
+
+	for (j = 0; j < 128; j++) {
+		for (k = 0; k < 4; k++)
+			jump[0][j][k] = 0;
+		jump[0][j][j >> 5] = 1U << (j & 31);
+		xorshift128(jump[0][j]);
+	}
+	for (k = 1; k < 64; k++) {
+		for (j = 0; j < 128; j++) {
+			int w;
+
+			for (w = 0; w < 4; w++)
+				jump[k][j][w] = jump[k-1][j][w];
+			xorshift128_mat_vec(jump[k-1], jump[k][j]);
+		}
+	}
+}
+
+static inline void xorshift128_jump(xorshift128_mat_t jump[64], uint32_t state[static 4],
+				    uint64_t n)
+{
+	int k;
+
+	for (k = 0; n; k++, n >>= 1) {
+		if (n & 1)
+			xorshift128_mat_vec(jump[k], state);
+	}
+}
+
 static inline uint64_t xorshift64star(uint64_t state[static 1])
 {
 	uint64_t x = state[0];